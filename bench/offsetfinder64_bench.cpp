@@ -0,0 +1,431 @@
+//
+//  offsetfinder64_bench.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+
+#include <libgeneral/macros.h>
+
+#include <liboffsetfinder64/kernelpatchfinder64.hpp>
+#include <liboffsetfinder64/ibootpatchfinder64.hpp>
+
+#include "toolutil.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace toolutil;
+
+/*
+    Microbenchmarks for the patchfinder64 primitives.
+    Queries come from the image itself: strings, then the references to them, then the functions holding those.
+    Every primitive runs with the linear scans on a fresh finder, then again after all build_* indices exist.
+    Each measurement runs in a forked child, so its RSS growth is its own and whatever it builds lazily is gone afterwards.
+    Bytes per second only counts bytes a query really had to look at, so it is only reported for scans with a known extent.
+    Results go to stdout (or -o) as JSON, a summary goes to stderr.
+ */
+
+#define MIN_STRING_LEN  8
+#define MAX_STRING_LEN  64
+#define BRANCH_LIMIT    -0x400
+
+struct options{
+    size_t queries = 64;
+    double minSeconds = 0.2;
+    bool scan = true;
+    bool indexed = true;
+    const char *out = NULL;
+};
+
+struct result{
+    std::string name;
+    std::string mode;
+    size_t queries;
+    size_t hits;
+    size_t runs;
+    double seconds;
+    double nsPerQuery;
+    double bytesPerSec;     //bytes scanned per second of query time, < 0 if unknown
+    long rssDeltaKiB;       //peak RSS of the measuring child above its RSS when it started
+};
+
+/*
+    what a measuring child sends back
+ */
+struct childresult{
+    size_t hits;
+    size_t runs;
+    double seconds;
+    double bytesScanned;    //per run, < 0 if unknown
+    long rssDeltaKiB;
+};
+
+struct imageresult{
+    std::string path;
+    std::string finder;
+    size_t size;
+    std::vector<result> results;
+};
+
+struct querydata{
+    std::vector<std::string> strings;
+    std::vector<loc_t> stringLocs;
+    std::vector<loc_t> refs;
+    std::vector<loc_t> functions;
+    std::vector<std::pair<loc_t, int>> regQueries; //{where, reg}
+};
+
+static long peakRSSKiB(){
+    struct rusage ru = {};
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+}
+
+static long currentRSSKiB(){
+#ifdef __APPLE__
+    mach_task_basic_info_data_t info = {};
+    mach_msg_type_number_t cnt = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &cnt) != KERN_SUCCESS) return 0;
+    return (long)(info.resident_size / 1024);
+#else
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%*ld %ld", &pages) != 1) pages = 0;
+    fclose(f);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+}
+
+static std::unique_ptr<patchfinder64> openImage(const char *path, std::string &kind){
+    uint32_t magic = 0;
+    FILE *f = fopen(path, "rb");
+    retassure(f, "failed to open %s", path);
+    size_t didRead = fread(&magic, 1, sizeof(magic), f);
+    fclose(f);
+    if (didRead == sizeof(magic) && (magic == 0xfeedfacf || magic == 0xcafebabe || magic == 0xbebafeca)) {
+        kind = "kernel";
+        return std::unique_ptr<patchfinder64>(new kernelpatchfinder64(path));
+    }
+    kind = "iboot";
+    return std::unique_ptr<patchfinder64>(ibootpatchfinder64::make_ibootpatchfinder64(path));
+}
+
+template <typename T>
+static std::vector<T> sample(const std::vector<T> &all, size_t cnt){
+    if (all.size() <= cnt) return all;
+    std::vector<T> ret;
+    for (size_t i=0; i<cnt; i++) {
+        ret.push_back(all[i * all.size() / cnt]);
+    }
+    return ret;
+}
+
+static querydata deriveQueries(patchfinder64 *pf, size_t cnt){
+    querydata q;
+    const char *buf = (const char *)pf->buf();
+    size_t size = pf->bufSize();
+
+    //NUL delimited printable runs
+    std::vector<std::string> candidates;
+    for (size_t i=1; i<size; i++) {
+        if (buf[i-1] != '\0') continue;
+        size_t len = 0;
+        while (i+len < size && len <= MAX_STRING_LEN && buf[i+len] >= 0x20 && buf[i+len] < 0x7f) len++;
+        if (i+len < size && buf[i+len] == '\0' && len >= MIN_STRING_LEN && len <= MAX_STRING_LEN) {
+            candidates.push_back(std::string(buf+i, len));
+        }
+        i += len;
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    for (auto &str : sample(candidates, cnt*4)) {
+        try {
+            loc_t loc = pf->findstr(str, true);
+            q.strings.push_back(str);
+            q.stringLocs.push_back(loc);
+            if (loc_t ref = pf->find_literal_ref(loc)) q.refs.push_back(ref);
+        } catch (tihmstar::exception &e) {
+            //not mapped
+        }
+    }
+    q.strings = sample(q.strings, cnt);
+    q.stringLocs = sample(q.stringLocs, cnt);
+    q.refs = sample(q.refs, cnt);
+
+    for (loc_t ref : q.refs) {
+        try {
+            loc_t bof = pf->find_bof(ref);
+            q.functions.push_back(bof);
+            uint32_t opcode = *(const uint32_t *)pf->memoryForLoc(ref);
+            q.regQueries.push_back({ref, (int)(opcode & 0x1f)});
+        } catch (tihmstar::exception &e) {
+            //not in a function
+        }
+    }
+    return q;
+}
+
+static childresult measureChild(const options &opt, size_t queryCnt, const std::function<bool(size_t)> &query,
+                               const std::function<size_t(size_t)> &scanned){
+    childresult cr = {0, 0, 0, -1, 0};
+    long startRSS = currentRSSKiB();
+    auto start = std::chrono::steady_clock::now();
+    do {
+        size_t hits = 0;
+        for (size_t i=0; i<queryCnt; i++) {
+            try {
+                if (query(i)) hits++;
+            } catch (tihmstar::exception &e) {
+                //a miss
+            }
+        }
+        cr.hits = hits;
+        cr.runs++;
+        cr.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (cr.seconds < opt.minSeconds && queryCnt);
+    cr.rssDeltaKiB = std::max(0L, peakRSSKiB() - startRSS);
+
+    if (scanned) {
+        //outside of the timing
+        cr.bytesScanned = 0;
+        for (size_t i=0; i<queryCnt; i++) {
+            try {
+                cr.bytesScanned += scanned(i);
+            } catch (tihmstar::exception &e) {
+                //a miss scans everything, but we don't know how much that is
+                cr.bytesScanned = -1;
+                break;
+            }
+        }
+    }
+    return cr;
+}
+
+static result measure(const options &opt, const std::string &name, const std::string &mode,
+                      size_t queryCnt, const std::function<bool(size_t)> &query,
+                      const std::function<size_t(size_t)> &scanned = nullptr){
+    int fds[2] = {-1, -1};
+    retassure(!pipe(fds), "pipe failed errno=%d", errno);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        childresult cr = {};
+        int err = 0;
+        try {
+            cr = measureChild(opt, queryCnt, query, scanned);
+        } catch (...) {
+            err = 1;
+        }
+        if (!err && write(fds[1], &cr, sizeof(cr)) != sizeof(cr)) err = 1;
+        _exit(err);
+    }
+    close(fds[1]);
+    retassure(pid > 0, "fork failed errno=%d", errno);
+
+    childresult cr = {};
+    ssize_t didRead = read(fds[0], &cr, sizeof(cr));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    retassure(didRead == sizeof(cr) && WIFEXITED(status) && !WEXITSTATUS(status), "measuring %s (%s) failed", name.c_str(), mode.c_str());
+
+    result r = {name, mode, queryCnt, cr.hits, cr.runs, cr.seconds, 0, -1, cr.rssDeltaKiB};
+    size_t total = r.runs * queryCnt;
+    if (total) {
+        r.nsPerQuery = r.seconds * 1e9 / total;
+        if (cr.bytesScanned >= 0) r.bytesPerSec = cr.bytesScanned * r.runs / r.seconds;
+    }
+    char rate[0x20] = "-";
+    if (r.bytesPerSec >= 0) snprintf(rate, sizeof(rate), "%.1f", r.bytesPerSec / (1024*1024));
+    fprintf(stderr, "  %-24s %-8s %6zu queries %6zu hits %14.0f ns/query %10s MiB/s %8ld KiB rss\n",
+            name.c_str(), mode.c_str(), queryCnt, r.hits, r.nsPerQuery, rate, r.rssDeltaKiB);
+    return r;
+}
+
+static void runPrimitives(const options &opt, patchfinder64 *pf, const querydata &q, const std::string &mode, std::vector<result> &out){
+    bool scan = mode == "scan";
+    const uint8_t *buf = (const uint8_t *)pf->buf();
+
+    //a linear findstr reads the image up to the end of the hit
+    out.push_back(measure(opt, "findstr", mode, q.strings.size(), [&](size_t i){
+        return pf->findstr(q.strings[i], true) != 0;
+    }, !scan ? nullptr : std::function<size_t(size_t)>([&](size_t i){
+        return (size_t)((const uint8_t *)pf->memoryForLoc(q.stringLocs[i]) - buf) + q.strings[i].size() + 1;
+    })));
+    out.push_back(measure(opt, "find_literal_ref", mode, q.stringLocs.size(), [&](size_t i){
+        return pf->find_literal_ref(q.stringLocs[i]) != 0;
+    }));
+    out.push_back(measure(opt, "find_call_ref", mode, q.functions.size(), [&](size_t i){
+        return pf->find_call_ref(q.functions[i]) != 0;
+    }));
+    out.push_back(measure(opt, "find_branch_ref", mode, q.refs.size(), [&](size_t i){
+        return pf->find_branch_ref(q.refs[i], BRANCH_LIMIT) != 0;
+    }));
+    //a linear find_bof walks back from the query to the prologue
+    out.push_back(measure(opt, "find_bof", mode, q.refs.size(), [&](size_t i){
+        return pf->find_bof(q.refs[i]) != 0;
+    }, !scan ? nullptr : std::function<size_t(size_t)>([&](size_t i){
+        return (size_t)(q.refs[i] - pf->find_bof(q.refs[i]));
+    })));
+    out.push_back(measure(opt, "find_register_value", mode, q.regQueries.size(), [&](size_t i){
+        pf->find_register_value(q.regQueries[i].first, q.regQueries[i].second);
+        return true;
+    }));
+    out.push_back(measure(opt, "findnops", mode, opt.queries, [&](size_t i){
+        return pf->findnops((uint16_t)(1 + i % 8), false) != 0;
+    }));
+}
+
+static imageresult benchImage(const options &opt, const char *path){
+    imageresult ir;
+    ir.path = path;
+    fprintf(stderr, "%s\n", path);
+
+    querydata q;
+    {
+        //separate finder, so the scan runs below don't find indices built while deriving
+        auto pf = openImage(path, ir.finder);
+        ir.size = pf->bufSize();
+        pf->build_xref_index();
+        pf->build_string_index();
+        pf->build_function_table();
+        q = deriveQueries(pf.get(), opt.queries);
+    }
+
+    auto pf = openImage(path, ir.finder);
+    if (opt.scan) {
+        runPrimitives(opt, pf.get(), q, "scan", ir.results);
+    }
+    if (opt.indexed) {
+        std::vector<std::pair<const char *, std::function<void()>>> builds = {
+            {"build_xref_index",        [&]{ pf->build_xref_index();}},
+            {"build_callgraph_index",   [&]{ pf->build_callgraph_index();}},
+            {"build_branch_index",      [&]{ pf->build_branch_index();}},
+            {"build_function_table",    [&]{ pf->build_function_table();}},
+            {"build_string_index",      [&]{ pf->build_string_index();}},
+            {"build_decode_table",      [&]{ pf->build_decode_table();}},
+        };
+        options once = opt;
+        once.minSeconds = 0; //an index only builds once
+        for (auto &b : builds) {
+            ir.results.push_back(measure(once, b.first, "build", 1, [&](size_t){
+                b.second();
+                return true;
+            }));
+            b.second(); //the child's index is gone with it
+        }
+        runPrimitives(opt, pf.get(), q, "indexed", ir.results);
+    }
+    return ir;
+}
+
+static void writeJSON(FILE *f, const std::vector<imageresult> &images){
+    fprintf(f, "{\n  \"version\": %s,\n  \"images\": [", jsonString(VERSION_COMMIT_COUNT "-" VERSION_COMMIT_SHA).c_str());
+    for (size_t i=0; i<images.size(); i++) {
+        auto &ir = images[i];
+        fprintf(f, "%s\n    {\n      \"path\": %s,\n      \"finder\": %s,\n      \"size\": %zu,\n      \"results\": [",
+                i ? "," : "", jsonString(ir.path).c_str(), jsonString(ir.finder).c_str(), ir.size);
+        for (size_t z=0; z<ir.results.size(); z++) {
+            auto &r = ir.results[z];
+            std::string rate = "null";
+            if (r.bytesPerSec >= 0) rate = std::to_string((uint64_t)r.bytesPerSec);
+            fprintf(f, "%s\n        {\"name\": %s, \"mode\": %s, \"queries\": %zu, \"hits\": %zu, \"runs\": %zu, "
+                    "\"seconds\": %.6f, \"ns_per_query\": %.1f, \"bytes_per_sec\": %s, \"rss_delta_kib\": %ld}",
+                    z ? "," : "", jsonString(r.name).c_str(), jsonString(r.mode).c_str(), r.queries, r.hits, r.runs,
+                    r.seconds, r.nsPerQuery, rate.c_str(), r.rssDeltaKiB);
+        }
+        fprintf(f, "\n      ]\n    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [options] image...\n", prog);
+    printf("  -q, --queries <n>     queries per primitive (default 64)\n");
+    printf("  -t, --min-time <ms>   repeat each primitive for at least this long (default 200)\n");
+    printf("  -o, --output <file>   write JSON here instead of stdout\n");
+    printf("  -s, --scan-only       only benchmark without indices\n");
+    printf("  -i, --indexed-only    only benchmark with indices\n");
+}
+
+int main(int argc, char * const argv[]){
+    static struct option longopts[] = {
+        {"queries",         required_argument,  NULL, 'q'},
+        {"min-time",        required_argument,  NULL, 't'},
+        {"output",          required_argument,  NULL, 'o'},
+        {"scan-only",       no_argument,        NULL, 's'},
+        {"indexed-only",    no_argument,        NULL, 'i'},
+        {"help",            no_argument,        NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    options opt;
+    int c = 0;
+    while ((c = getopt_long(argc, argv, "q:t:o:sih", longopts, NULL)) != -1) {
+        switch (c) {
+            case 'q':
+                opt.queries = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                opt.minSeconds = strtod(optarg, NULL) / 1000;
+                break;
+            case 'o':
+                opt.out = optarg;
+                break;
+            case 's':
+                opt.indexed = false;
+                break;
+            case 'i':
+                opt.scan = false;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<imageresult> images;
+    for (int i=optind; i<argc; i++) {
+        try {
+            images.push_back(benchImage(opt, argv[i]));
+        } catch (tihmstar::exception &e) {
+            fprintf(stderr, "%s: failed: %s\n", argv[i], e.what());
+            return 2;
+        }
+    }
+
+    FILE *f = opt.out ? fopen(opt.out, "w") : stdout;
+    if (!f) {
+        fprintf(stderr, "failed to open %s\n", opt.out);
+        return 1;
+    }
+    writeJSON(f, images);
+    if (f != stdout) fclose(f);
+    return 0;
+}
@@ -49,6 +49,10 @@ namespace tihmstar {
     class bad_branch_destination : public OFexception{
         using OFexception::OFexception;
     };
+
+    class patch_conflict : public OFexception{
+        using OFexception::OFexception;
+    };
 };
 
 
@@ -15,8 +15,8 @@ namespace tihmstar {
     namespace offsetfinder64 {
         class kernelpatchfinder64 : public machopatchfinder64{            
         public:
-            kernelpatchfinder64(const char *filename);
-            kernelpatchfinder64(const void *buffer, size_t bufSize);
+            kernelpatchfinder64(const char *filename, int cputype = kCPUTypeARM64, int cpusubtype = kCPUSubtypeAny);
+            kernelpatchfinder64(const void *buffer, size_t bufSize, int cputype = kCPUTypeARM64, int cpusubtype = kCPUSubtypeAny);
                         
             loc_t find_syscall0();
             loc_t find_machtrap_table();
@@ -9,27 +9,58 @@
 #ifndef machopatchfinder64_hpp
 #define machopatchfinder64_hpp
 
+#include <future>
+
 #include <liboffsetfinder64/patchfinder64.hpp>
 
 struct symtab_command;
 namespace tihmstar {
     namespace offsetfinder64 {
+        class symbolindex;
         
         class machopatchfinder64 : public patchfinder64{
             struct symtab_command *__symtab;
+            std::mutex _symbolsLock; //guards creating _symbols and _symbolsBuilder
+            std::atomic<symbolindex *> _symbols;
+            std::future<symbolindex *> _symbolsBuilder;
             
             void loadSegments();
             __attribute__((always_inline)) struct symtab_command *getSymtab();
+            symbolindex *newSymbolIndex();
+            symbolindex *symbols();
             
-            void init();
+            void init(int cputype, int cpusubtype);
+            void selectFatSlice(int cputype, int cpusubtype);
             
+        protected:
+            virtual void addStringRegions(stringindex *index) override;
+
         public:
-            machopatchfinder64(const char *filename);
-            machopatchfinder64(const void *buffer, size_t bufSize);
+            static constexpr int kCPUTypeARM64 = 0x0100000c;    //CPU_TYPE_ARM64
+            static constexpr int kCPUSubtypeAny = -1;
+
+            /*
+                FAT files use the slice of cputype/cpusubtype in place.
+                The default takes arm64e if there is one, any arm64 slice otherwise.
+             */
+            machopatchfinder64(const char *filename, int cputype = kCPUTypeARM64, int cpusubtype = kCPUSubtypeAny);
+            machopatchfinder64(const void *buffer, size_t bufSize, int cputype = kCPUTypeARM64, int cpusubtype = kCPUSubtypeAny);
+            virtual ~machopatchfinder64();
 
             bool haveSymbols() { return __symtab != NULL;};
             loc_t find_sym(const char *sym);
-            std::string sym_for_addr(loc_t addr);
+
+            /*
+                name of the symbol at addr.
+                With allowOffset the containing symbol is returned as "name+0x..." if none starts at addr.
+             */
+            std::string sym_for_addr(loc_t addr, bool allowOffset = false);
+
+            /*
+                symbol lookups build the index on first use,
+                call this to build it right away, or in the background while other work happens.
+             */
+            void build_symbol_index(bool background = false);
             
             
         };
@@ -9,6 +9,9 @@
 #ifndef patch_hpp
 #define patch_hpp
 
+#include <memory>
+#include <vector>
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -16,20 +19,83 @@
 
 namespace tihmstar {
     namespace offsetfinder64{
+        class patchset;
+
+        /*
+            Payloads of up to kInlineSize bytes live inside the patch, larger ones are malloc'ed
+            (or borrowed from a patchset). _patch always points at the payload.
+            Moving never allocates, copying only allocates for large payloads.
+            _patch and _patchSize are public for reading only. Who frees _patch depends on where the payload lives,
+            so assigning either is unsupported, construct a new patch instead.
+         */
         class patch{
+        public:
+            static constexpr size_t kInlineSize = 32;
+        private:
+            enum storage : uint8_t{
+                kInline,
+                kHeap,
+                kBorrowed   //owned by a patchset
+            };
             bool _slideme;
             void(*_slidefunc)(class patch *patch, uint64_t slide);
+            storage _storage;
+            alignas(8) uint8_t _inline[kInlineSize];
+
+            void setPayload(const void *payload, size_t size);
+            void takePayload(patch &other) noexcept;
+            void releasePayload() noexcept;
+
+            friend class patchset;
         public:
             loc_t _location;
             size_t _patchSize;
             const void *_patch;
             patch(loc_t location, const void *patch, size_t patchSize, void(*slidefunc)(class patch *patch, uint64_t slide) = NULL);
-            patch(const patch& cpy) noexcept;
+            patch(const patch& cpy);
+            patch(patch &&mv) noexcept;
             patch &operator=(const patch& cpy);
+            patch &operator=(patch &&mv) noexcept;
             void slide(uint64_t slide);
+            bool needsSlide() const { return _slideme;}
             ~patch();
         };
 
+        /*
+            Patches whose large payloads are packed into a few arena chunks instead of one allocation each.
+            Those patches point into the arena, so they only live as long as the set.
+            toVector gives standalone copies.
+         */
+        class patchset{
+        public:
+            static constexpr size_t kChunkSize = 0x10000;
+        private:
+            std::vector<std::unique_ptr<uint8_t[]>> _chunks;
+            size_t _chunkUsed;
+            std::vector<patch> _patches;
+
+            const void *store(const void *payload, size_t size);
+
+        public:
+            patchset();
+            patchset(patchset &&mv) noexcept = default;
+            patchset &operator=(patchset &&mv) noexcept = default;
+            patchset(const patchset &) = delete;
+            patchset &operator=(const patchset &) = delete;
+
+            void push_back(const patch &p);
+            void push_back(loc_t location, const void *payload, size_t size, void(*slidefunc)(class patch *patch, uint64_t slide) = NULL);
+            void reserve(size_t cnt) { _patches.reserve(cnt);}
+
+            size_t size() const { return _patches.size();}
+            bool empty() const { return _patches.empty();}
+            const patch &operator[](size_t i) const { return _patches[i];}
+            std::vector<patch>::const_iterator begin() const { return _patches.begin();}
+            std::vector<patch>::const_iterator end() const { return _patches.end();}
+
+            std::vector<patch> toVector() const;
+        };
+
     }
 }
 
@@ -0,0 +1,97 @@
+//
+//  patchapplier.hpp
+//  liboffsetfinder64
+//
+
+#ifndef patchapplier_hpp
+#define patchapplier_hpp
+
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <liboffsetfinder64/common.h>
+#include <liboffsetfinder64/patch.hpp>
+
+namespace tihmstar {
+    namespace offsetfinder64{
+        class patchfinder64;
+
+        /*
+            Applies patch sets found by a patchfinder64 to a copy of its image.
+            Locations are translated to image offsets through the finder's segments, all sets are merged
+            and checked for conflicts up front, then written in one pass in offset order.
+            Bytes which already have the patched value are not written, so untouched pages stay clean.
+         */
+        class patchapplier{
+        public:
+            struct report{
+                size_t patchCnt;
+                size_t bytes;           //payload bytes of the set
+                size_t bytesChanged;    //bytes which differed before, overlaps count for the set applied first
+            };
+
+            /*
+                an image file mapped MAP_PRIVATE with the patches applied.
+                Only the touched pages are copied, the file itself is never modified.
+             */
+            class mappedimage{
+                uint8_t *_map;
+                size_t _mapSize;
+                size_t _offset;
+                size_t _size;
+            public:
+                mappedimage(uint8_t *map, size_t mapSize, size_t offset, size_t size);
+                mappedimage(mappedimage &&mv) noexcept;
+                mappedimage(const mappedimage &) = delete;
+                mappedimage &operator=(const mappedimage &) = delete;
+                ~mappedimage();
+
+                uint8_t *buf() const { return _map + _offset;}
+                size_t size() const { return _size;}
+            };
+
+        private:
+            struct placed{
+                size_t off;     //in the image
+                size_t set;
+                size_t idx;
+            };
+            patchfinder64 *_finder;
+            std::vector<std::vector<patch>> _sets;
+            std::vector<placed> _placed; //sorted by offset, then set
+
+            size_t imageOffset(const patch &p) const;
+
+        public:
+            patchapplier(patchfinder64 *finder);
+
+            /*
+                translates the patches and checks them against all sets added before.
+                Overlapping patches have to agree on the overlapping bytes, otherwise this throws patch_conflict
+                and the set is not added. Patches with a pending slide are rejected.
+                Returns the index of the set's report.
+             */
+            size_t add(std::vector<patch> patches);
+
+            /*
+                image has to be laid out like the finder's buffer
+             */
+            std::vector<report> apply(void *image, size_t imageSize) const;
+
+            /*
+                writes the finder's image to outPath and patches it through a MAP_SHARED mapping.
+                The file is written next to outPath and renamed when complete
+             */
+            std::vector<report> apply_to_file(const char *outPath) const;
+
+            /*
+                imagePath holds the finder's image at imageOffset (e.g. a slice of a fat file)
+             */
+            mappedimage apply_private(const char *imagePath, size_t imageOffset = 0, std::vector<report> *reports = NULL) const;
+        };
+    }
+}
+
+#endif /* patchapplier_hpp */
@@ -9,6 +9,9 @@
 #ifndef offsetfinder64_hpp
 #define offsetfinder64_hpp
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <functional>
@@ -24,21 +27,122 @@
 
 namespace tihmstar {
     namespace offsetfinder64{
+        class xrefindex;
+        class callgraph;
+        class branchindex;
+        class functiontable;
+        class stringindex;
+        class decodetable;
+        class regstatecache;
+        class caveallocator;
+        class resultcache;
+        class indexfile;
+        class tracer;
+        struct segmentview;
         
+        class patchfinder64;
+
+        /*
+            Records the nop/zero reservations the creating thread makes on one finder while the scope lives.
+            rollback releases exactly those, reservations of other threads are never touched.
+            Scopes nest and have to be destroyed on the creating thread in reverse order, like locals.
+            A finder which stays loaded can hand every caller the caves a fresh one would by rolling back a scope per call.
+         */
+        class cavescope{
+            caveallocator *_caves;
+            cavescope *_prev;
+            std::vector<uint64_t> _seqs; //sequence numbers of the reservations, oldest first
+            friend caveallocator;
+        public:
+            cavescope(patchfinder64 *pf);
+            cavescope(caveallocator *caves);
+            cavescope(const cavescope &) = delete;
+            cavescope &operator=(const cavescope &) = delete;
+            ~cavescope();
+
+            void rollback();
+        };
+
+        /*
+            After construction all finders may be called from any number of threads on the same instance.
+            Indices are created once (build_* or on first use), cave reservations and register snapshots
+            have their own locks. Construction and destruction are not thread safe.
+         */
         class patchfinder64 {
+            friend cavescope;
         protected:
             bool _freeBuf;
             const uint8_t *_buf;
             size_t _bufSize;
+            size_t _bufMappedSize; //_buf is an mmap of this size, _freeBuf unmaps instead of freeing
+            const uint8_t *_ownedBuf; //if set _buf points into it (e.g. a fat slice), _freeBuf releases this instead
             offsetfinder64::loc_t _entrypoint;
             offsetfinder64::loc_t _base;
             tihmstar::libinsn::vmem *_vmem;
-            std::vector<std::pair<loc_t, loc_t>> _usedNops;
+            std::mutex _lazyLock; //serializes creating the members below, reading them needs no lock
+            std::atomic<xrefindex *> _xrefs;
+            std::atomic<callgraph *> _callgraph;
+            std::atomic<branchindex *> _branches;
+            std::atomic<functiontable *> _functions;
+            std::atomic<stringindex *> _strings;
+            std::atomic<decodetable *> _decoded;
+            std::atomic<regstatecache *> _regstates;
+            std::atomic<caveallocator *> _caves;
+            std::atomic<resultcache *> _cache;
+            std::atomic<indexfile *> _indexFile; //backs indices loaded by use_index_file
+            std::atomic<tracer *> _tracer; //NULL unless tracing, may be the process wide one
+            std::atomic<std::vector<segmentview> *> _segments;
+
+            /*
+                regions which hold C strings for build_string_index.
+                Default is a heuristic pass over all segments. Overrides must keep that pass,
+                findstr trusts the index to hold every printable string as the tail of some entry.
+             */
+            virtual void addStringRegions(stringindex *index);
 
+            /*
+                _buf = whole file, mmap'ed where possible. We own it afterwards.
+             */
+            void loadFile(const char *filename);
+
+            /*
+                drop _buf, freeing or unmapping it if we own it
+             */
+            void releaseBuf();
+
+            /*
+                views of all segments for the memmem family, collected on first use
+             */
+            const std::vector<segmentview> &segments();
+
+            /*
+                nop and zero runs of the image, scanned on first use
+             */
+            caveallocator *caves();
+
+            /*
+                result cache for finders, a no-op until enable_result_cache.
+                A finder returns right away if cacheLookup hits and passes its result through cacheStore otherwise.
+                Caves the calling thread reserved in between are stored with the result and reserved again on a hit.
+             */
+            struct cachequery{
+                std::string finder;
+                std::string args;
+                bool enabled = false;
+                std::unique_ptr<cavescope> caves;
+            };
+            bool cacheLookup(cachequery &q, const char *finder, const std::string &args, std::vector<patch> &out);
+            bool cacheLookup(cachequery &q, const char *finder, const std::string &args, loc_t &out);
+            std::vector<patch> cacheStore(const cachequery &q, std::vector<patch> patches);
+            loc_t cacheStore(const cachequery &q, loc_t value);
+
+        private:
+            bool cacheLookup(cachequery &q, const char *finder, const std::string &args, std::vector<patch> *patches, loc_t *value);
+            void cacheStore(const cachequery &q, const std::vector<patch> *patches, loc_t value);
             
         public:
             patchfinder64(bool freeBuf);
-            ~patchfinder64();
+            virtual ~patchfinder64();
             
             const void *buf() { return _buf;}
             size_t bufSize() { return _bufSize;}
@@ -48,13 +152,114 @@ namespace tihmstar {
             const void *memoryForLoc(loc_t loc);
 
             
+            /*
+                first occurrence of str at or after startAddr, with hasNullTerminator it must be followed by a NUL.
+                That may be the tail of a longer string, the string index never changes the result.
+             */
             loc_t findstr(std::string str, bool hasNullTerminator, loc_t startAddr = 0);
+            /*
+                find_bof walks back to the prologue, find_eof forward to the first ret at or after pos.
+                function_range is [find_bof, find_eof+4), the function table only makes them faster.
+             */
             loc_t find_bof(loc_t pos);
+            loc_t find_eof(loc_t pos);
+            std::pair<loc_t, loc_t> function_range(loc_t pos);
             uint64_t find_register_value(loc_t where, int reg, loc_t startAddr = 0);
             loc_t find_literal_ref(loc_t pos, int ignoreTimes = 0, loc_t startPos = 0);
             loc_t find_call_ref(loc_t pos, int ignoreTimes = 0, loc_t startPos = 0);
             loc_t find_branch_ref(loc_t pos, int limit, int ignoreTimes = 0);
-            loc_t findnops(uint16_t nopCnt, bool useNops = true);
+            
+            /*
+                best fitting unused run of nopCnt nops with pos % align == alignOffset.
+                useNops reserves it until release_nops.
+             */
+            loc_t findnops(uint16_t nopCnt, bool useNops = true, uint32_t align = 4, uint32_t alignOffset = 0);
+            void release_nops(loc_t pos);
+
+            /*
+                first occurrence of little at or after startAddr, throws out_of_range if there is none.
+                memmem_insn only matches at instruction boundaries, use it for opcode needles.
+             */
+            loc_t memmem(const void *little, size_t little_len, loc_t startAddr = 0);
+            loc_t memmem_insn(const void *little, size_t little_len, loc_t startAddr = 0);
+
+            /*
+                every occurrence of every needle in a single pass over the image.
+                Returns {needle index, location} ordered by location.
+             */
+            std::vector<std::pair<size_t, loc_t>> memmem_all(const std::vector<std::string> &needles, bool insnAligned = false);
+
+            /*
+                first occurrence of the first needle which occurs at all, needles are in order of preference.
+                Single pass like memmem_all, throws out_of_range if none occurs.
+             */
+            loc_t memmem_first_of(const std::vector<std::string> &needles, bool insnAligned = false, size_t *which = NULL);
+
+            /*
+                resolve all literal references in one pass.
+                find_literal_ref becomes a lookup afterwards.
+             */
+            void build_xref_index();
+            std::vector<loc_t> find_literal_refs(loc_t pos);
+
+            /*
+                collect all bl/b edges in one pass.
+                find_call_ref becomes a lookup afterwards.
+             */
+            void build_callgraph_index();
+            std::vector<loc_t> find_call_refs(loc_t pos);
+            std::vector<loc_t> find_callees(loc_t start, loc_t end);
+
+            /*
+                reverse index over all immediate branches.
+                find_branch_ref becomes a lookup afterwards, find_branch_refs has no distance limit.
+             */
+            void build_branch_index();
+            std::vector<loc_t> find_branch_refs(loc_t pos);
+
+            /*
+                sorted prologues and rets.
+                find_bof and find_eof become binary searches afterwards.
+             */
+            void build_function_table();
+
+            /*
+                hash all NUL terminated strings.
+                findstr(str, true) afterwards is a lookup for printable strings of at least 4 chars,
+                shorter ones, misses and substring searches still scan.
+             */
+            void build_string_index();
+            std::vector<loc_t> findstrs(std::string str);
+
+            /*
+                decode all executable words once, in parallel.
+                find_register_value, find_literal_ref, find_bof, find_eof and find_callees read the decoded columns afterwards.
+             */
+            void build_decode_table();
+
+            /*
+                xref, call graph, function, string and cave indices from the index file at path.
+                The file is mapped and used in place, so this is about as fast as mapping the image.
+                If it is missing or was written for another image, the indices are built and path is (re)written.
+                Indices which already exist are kept.
+             */
+            void use_index_file(const char *path);
+
+            /*
+                keep finder results in dir, keyed by a hash of the image and the library version.
+                Cached finders return without searching when they already ran on the same image.
+             */
+            void enable_result_cache(const char *dir);
+
+            /*
+                record a span with arguments and result for every public finder and the core primitives
+                (findstr, memmem, literal and call refs, bof, register values).
+                Written to path as Chrome trace JSON by write_trace() and when this finder is destroyed.
+                OFFSETFINDER64_TRACE=<path> traces every finder of the process into one file written at exit,
+                which then takes precedence over this.
+             */
+            void enable_tracing(const char *path);
+            void write_trace();
 
             
             uint32_t pageshit_for_pagesize(uint32_t pagesize);
@@ -0,0 +1,111 @@
+//
+//  branchindex.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+
+#include <libgeneral/macros.h>
+
+#include "branchindex.hpp"
+#include "segmentview.hpp"
+#include "OFexception.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace libinsn;
+
+#define B_MASK          0x7C000000
+#define B_OPCODE        0x14000000
+#define BL_BIT          0x80000000
+#define BCOND_MASK      0xFF000010
+#define BCOND_OPCODE    0x54000000
+#define CB_MASK         0x7E000000
+#define CB_OPCODE       0x34000000
+#define TB_MASK         0x7E000000
+#define TB_OPCODE       0x36000000
+
+static bool branchSiteLess(const branchindex::branch &a, const branchindex::branch &b){
+    return a.site < b.site;
+}
+
+static bool branchTargetLess(const branchindex::branch &a, const branchindex::branch &b){
+    if (a.target != b.target) return a.target < b.target;
+    return a.site < b.site;
+}
+
+branchindex::branchindex(vmem *mem){
+    for (auto &seg : segmentviews(mem, vsegment::kVMPROTEXEC)) {
+        const uint32_t *words = seg.words();
+        size_t wordCnt = seg.wordCnt();
+
+        for (size_t i=0; i<wordCnt; i++) {
+            uint32_t opcode = words[i];
+            loc_t pc = seg.base + i*4;
+            int64_t imm = 0;
+            kind type;
+
+            if ((opcode & B_MASK) == B_OPCODE) {
+                imm = (int32_t)(opcode << 6) >> 4;  //imm26
+                type = (opcode & BL_BIT) ? kBL : kB;
+            } else if ((opcode & BCOND_MASK) == BCOND_OPCODE) {
+                imm = (int32_t)(opcode << 8) >> 11 & ~3; //imm19
+                type = kBcond;
+            } else if ((opcode & CB_MASK) == CB_OPCODE) {
+                imm = (int32_t)(opcode << 8) >> 11 & ~3; //imm19
+                type = kCB;
+            } else if ((opcode & TB_MASK) == TB_OPCODE) {
+                imm = (int32_t)(opcode << 13) >> 16 & ~3; //imm14
+                type = kTB;
+            } else {
+                continue;
+            }
+            _bySite.push_back({pc, (loc_t)(pc + imm), type});
+        }
+    }
+
+    std::sort(_bySite.begin(), _bySite.end(), branchSiteLess);
+    _byTarget = _bySite;
+    std::sort(_byTarget.begin(), _byTarget.end(), branchTargetLess);
+}
+
+size_t branchindex::branchesBetween(loc_t a, loc_t b) const{
+    if (b <= a + 4) return 0;
+    auto first = std::upper_bound(_bySite.begin(), _bySite.end(), branch{a, 0, kB}, branchSiteLess);
+    auto last = std::lower_bound(first, _bySite.end(), branch{b, 0, kB}, branchSiteLess);
+    return last - first;
+}
+
+std::vector<loc_t> branchindex::sources(loc_t target, int kinds) const{
+    std::vector<loc_t> ret;
+    auto it = std::lower_bound(_byTarget.begin(), _byTarget.end(), branch{0, target, kB}, branchTargetLess);
+    for (; it != _byTarget.end() && it->target == target; ++it) {
+        if (it->type & kinds) ret.push_back(it->site);
+    }
+    return ret;
+}
+
+loc_t branchindex::find_source(loc_t target, int limit, int ignoreTimes) const{
+    auto first = std::lower_bound(_byTarget.begin(), _byTarget.end(), branch{0, target, kB}, branchTargetLess);
+    auto last = std::upper_bound(first, _byTarget.end(), branch{(loc_t)-1, target, kB}, branchTargetLess);
+    auto mid = std::lower_bound(first, last, branch{target, target, kB}, branchTargetLess);
+
+    if (limit < 0) {
+        for (auto it = mid; it != first;) {
+            --it;
+            uint64_t nonBranch = (target - it->site)/4 - 1 - branchesBetween(it->site, target);
+            if (nonBranch && nonBranch*4 >= (uint64_t)-(int64_t)limit) break;
+            if (ignoreTimes-- <= 0)
+                return it->site;
+        }
+    }else{
+        if (mid != last && mid->site == target) ++mid; //a branch to itself is not visited by the walk
+        for (auto it = mid; it != last; ++it) {
+            uint64_t nonBranch = (it->site - target)/4 - 1 - branchesBetween(target, it->site);
+            if (nonBranch && nonBranch*4 >= (uint64_t)limit) break;
+            if (ignoreTimes-- <= 0)
+                return it->site;
+        }
+    }
+    retcustomerror(limit_reached, "search limit reached");
+}
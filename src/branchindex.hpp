@@ -0,0 +1,64 @@
+//
+//  branchindex.hpp
+//  liboffsetfinder64
+//
+
+#ifndef branchindex_hpp
+#define branchindex_hpp
+
+#include <vector>
+
+#include <libinsn/vmem.hpp>
+#include <liboffsetfinder64/common.h>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Reverse index over all immediate branches (b, bl, b.cond, cbz/cbnz, tbz/tbnz).
+            Answers "who branches here" with a binary search and no distance limit.
+         */
+        class branchindex{
+        public:
+            enum kind : uint8_t{
+                kB      = 1 << 0,
+                kBL     = 1 << 1,
+                kBcond  = 1 << 2,
+                kCB     = 1 << 3, //cbz, cbnz
+                kTB     = 1 << 4, //tbz, tbnz
+                kAll    = kB | kBL | kBcond | kCB | kTB
+            };
+            struct branch{
+                loc_t site;
+                loc_t target;
+                kind type;
+            };
+        private:
+            std::vector<branch> _bySite;
+            std::vector<branch> _byTarget; //sorted by target, then site
+
+        public:
+            branchindex(tihmstar::libinsn::vmem *mem);
+
+            size_t size() const { return _bySite.size();}
+
+            /*
+                number of immediate branches in (a, b)
+             */
+            size_t branchesBetween(loc_t a, loc_t b) const;
+
+            /*
+                all branches to target in address order
+             */
+            std::vector<loc_t> sources(loc_t target, int kinds = kAll) const;
+
+            /*
+                same semantics as patchfinder64::find_branch_ref:
+                walk away from target (backwards if limit < 0), where only non-branch instructions use up limit.
+                throws limit_reached if there is no matching branch in reach
+             */
+            loc_t find_source(loc_t target, int limit, int ignoreTimes = 0) const;
+        };
+    };
+};
+
+#endif /* branchindex_hpp */
@@ -0,0 +1,87 @@
+//
+//  callgraph.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+
+#include <libgeneral/macros.h>
+
+#include "callgraph.hpp"
+#include "segmentview.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace libinsn;
+
+#define B_MASK      0x7C000000
+#define B_OPCODE    0x14000000
+#define BL_BIT      0x80000000
+
+static bool edgeSiteLess(const callgraph::edge &a, const callgraph::edge &b){
+    return a.site < b.site;
+}
+
+static bool edgeTargetLess(const callgraph::edge &a, const callgraph::edge &b){
+    if (a.target != b.target) return a.target < b.target;
+    return a.site < b.site;
+}
+
+callgraph::callgraph(vmem *mem){
+    std::vector<edge> bySite;
+    for (auto &seg : segmentviews(mem, vsegment::kVMPROTEXEC)) {
+        const uint32_t *words = seg.words();
+        size_t wordCnt = seg.wordCnt();
+
+        for (size_t i=0; i<wordCnt; i++) {
+            uint32_t opcode = words[i];
+            if ((opcode & B_MASK) != B_OPCODE) continue;
+
+            loc_t pc = seg.base + i*4;
+            int64_t imm = (int32_t)(opcode << 6) >> 4; //sign extended imm26 << 2
+            bySite.push_back({pc, (loc_t)(pc + imm), !(opcode & BL_BIT)});
+        }
+    }
+
+    std::sort(bySite.begin(), bySite.end(), edgeSiteLess);
+    std::vector<edge> byTarget = bySite;
+    std::sort(byTarget.begin(), byTarget.end(), edgeTargetLess);
+    _bySite = std::move(bySite);
+    _byTarget = std::move(byTarget);
+}
+
+callgraph::callgraph(column<edge> &&bySite, column<edge> &&byTarget)
+: _bySite(std::move(bySite)), _byTarget(std::move(byTarget))
+{
+    //
+}
+
+loc_t callgraph::find_caller(loc_t target, int ignoreTimes, loc_t startPos) const{
+    auto it = std::lower_bound(_byTarget.begin(), _byTarget.end(), edge{startPos, target, false}, edgeTargetLess);
+    for (; it != _byTarget.end() && it->target == target; ++it) {
+        if (it->isTailcall) continue;
+        if (--ignoreTimes < 0)
+            return it->site;
+    }
+    return 0;
+}
+
+std::vector<loc_t> callgraph::callers(loc_t target, bool includeTailcalls) const{
+    std::vector<loc_t> ret;
+    auto it = std::lower_bound(_byTarget.begin(), _byTarget.end(), edge{0, target, false}, edgeTargetLess);
+    for (; it != _byTarget.end() && it->target == target; ++it) {
+        if (it->isTailcall && !includeTailcalls) continue;
+        ret.push_back(it->site);
+    }
+    return ret;
+}
+
+std::vector<callgraph::edge> callgraph::callees(loc_t start, loc_t end, bool includeTailcalls) const{
+    std::vector<edge> ret;
+    auto it = std::lower_bound(_bySite.begin(), _bySite.end(), edge{start, 0, false}, edgeSiteLess);
+    for (; it != _bySite.end() && it->site < end; ++it) {
+        if (it->isTailcall && !includeTailcalls) continue;
+        ret.push_back(*it);
+    }
+    return ret;
+}
@@ -0,0 +1,59 @@
+//
+//  callgraph.hpp
+//  liboffsetfinder64
+//
+
+#ifndef callgraph_hpp
+#define callgraph_hpp
+
+#include <vector>
+
+#include <libinsn/vmem.hpp>
+#include <liboffsetfinder64/common.h>
+#include "column.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            All bl and b (immediate) edges of the executable segments.
+            Callee->callers is sorted by callsite, caller->callees is sorted by callsite as well,
+            so both directions are a binary search.
+         */
+        class callgraph{
+        public:
+            struct edge{
+                loc_t site;
+                loc_t target;
+                bool isTailcall; //b instead of bl
+            };
+        private:
+            column<edge> _bySite;
+            column<edge> _byTarget; //sorted by target, then site
+
+        public:
+            callgraph(tihmstar::libinsn::vmem *mem);
+            callgraph(column<edge> &&bySite, column<edge> &&byTarget);
+
+            size_t size() const { return _bySite.size();}
+            const column<edge> &bySite() const { return _bySite;}
+            const column<edge> &byTarget() const { return _byTarget;}
+
+            /*
+                ignoreTimes-th bl to target at or after startPos, 0 if there is none
+             */
+            loc_t find_caller(loc_t target, int ignoreTimes = 0, loc_t startPos = 0) const;
+
+            /*
+                all callsites of target in address order
+             */
+            std::vector<loc_t> callers(loc_t target, bool includeTailcalls = false) const;
+
+            /*
+                all edges leaving [start, end) in address order
+             */
+            std::vector<edge> callees(loc_t start, loc_t end, bool includeTailcalls = false) const;
+        };
+    };
+};
+
+#endif /* callgraph_hpp */
@@ -0,0 +1,216 @@
+//
+//  caveallocator.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+
+#include <libgeneral/macros.h>
+
+#include "caveallocator.hpp"
+#include "segmentview.hpp"
+#include "OFexception.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace libinsn;
+
+#define NOP_OPCODE 0xD503201F
+
+static thread_local cavescope *gScopes = NULL; //innermost scope of this thread
+
+#pragma mark freelist
+
+void caveallocator::freelist::add(loc_t start, loc_t end){
+    //merge with adjacent free ranges
+    auto next = byStart.lower_bound(start);
+    if (next != byStart.end() && next->first == end) {
+        end = next->second;
+        remove(next);
+    }
+    auto prev = byStart.lower_bound(start);
+    if (prev != byStart.begin() && (--prev)->second == start) {
+        start = prev->first;
+        remove(prev);
+    }
+    byStart[start] = end;
+    bySize.insert({end-start, start});
+}
+
+void caveallocator::freelist::remove(std::map<loc_t, loc_t>::iterator it){
+    bySize.erase({it->second-it->first, it->first});
+    byStart.erase(it);
+}
+
+void caveallocator::freelist::carve(loc_t start, loc_t end){
+    auto it = byStart.upper_bound(start);
+    retassure(it != byStart.begin(), "range 0x%016llx-0x%016llx is not free", start, end);
+    --it;
+    loc_t fstart = it->first;
+    loc_t fend = it->second;
+    retassure(fstart <= start && end <= fend, "range 0x%016llx-0x%016llx is not free", start, end);
+
+    remove(it);
+    if (fstart < start) {
+        byStart[fstart] = start;
+        bySize.insert({start-fstart, fstart});
+    }
+    if (end < fend) {
+        byStart[end] = fend;
+        bySize.insert({fend-end, end});
+    }
+}
+
+#pragma mark caveallocator
+
+caveallocator::caveallocator(vmem *mem)
+: _nextSeq(0)
+{
+    std::vector<run> runs[kKindCnt];
+    for (auto &seg : segmentviews(mem, vsegment::kVMPROTEXEC)) {
+        const uint32_t *words = seg.words();
+        size_t wordCnt = seg.wordCnt();
+        for (size_t i=0; i<wordCnt; i++) {
+            if (words[i] != NOP_OPCODE) continue;
+            size_t start = i;
+            while (i<wordCnt && words[i] == NOP_OPCODE) i++;
+            runs[kNop].push_back({seg.base + start*4, seg.base + i*4});
+        }
+    }
+
+    for (auto &seg : segmentviews(mem, vsegment::kVMPROTNONE)) {
+        const uint8_t *buf = seg.buf;
+        for (size_t i=0; i<seg.size; i++) {
+            if (buf[i]) continue;
+            size_t start = i;
+            while (i<seg.size && !buf[i]) i++;
+            if (i-start >= kMinZeroRun) runs[kZero].push_back({seg.base + start, seg.base + i});
+        }
+    }
+
+    for (int k=0; k<kKindCnt; k++) {
+        std::sort(runs[k].begin(), runs[k].end());
+        _runs[k] = std::move(runs[k]);
+    }
+    initFreeLists();
+}
+
+caveallocator::caveallocator(column<run> &&nops, column<run> &&zeros)
+: _nextSeq(0)
+{
+    _runs[kNop] = std::move(nops);
+    _runs[kZero] = std::move(zeros);
+    initFreeLists();
+}
+
+void caveallocator::initFreeLists(){
+    for (int k=0; k<kKindCnt; k++) {
+        for (auto &r : _runs[k]) {
+            _free[k].add(r.first, r.second);
+        }
+    }
+}
+
+loc_t caveallocator::allocate(kind k, size_t size, size_t align, size_t alignOffset, bool reserve){
+    retassure(size, "can't allocate 0 bytes");
+    retassure(align && alignOffset < align, "bad alignment %zu+%zu", align, alignOffset);
+    std::lock_guard<std::mutex> lk(_lock);
+    auto &fl = _free[k];
+
+    //smallest first, ties go to the lower address
+    for (auto it = fl.bySize.lower_bound({size, 0}); it != fl.bySize.end(); ++it) {
+        loc_t start = it->second;
+        loc_t end = start + it->first;
+        loc_t pos = start - (start % align) + alignOffset;
+        if (pos < start) pos += align;
+        if (pos + size > end) continue;
+
+        if (reserve) reserveLocked(k, pos, size);
+        return pos;
+    }
+    retcustomerror(out_of_range, "no free cave for 0x%zx bytes (align %zu+%zu)", size, align, alignOffset);
+}
+
+void caveallocator::reserve(kind k, loc_t start, size_t size){
+    std::lock_guard<std::mutex> lk(_lock);
+    reserveLocked(k, start, size);
+}
+
+void caveallocator::reserveLocked(kind k, loc_t start, size_t size){
+    _free[k].carve(start, start+size);
+    uint64_t seq = _nextSeq++;
+    _reserved[start] = {start, start+size, k, seq};
+    _ledger[seq] = start;
+    for (cavescope *scope = gScopes; scope; scope = scope->_prev) {
+        if (scope->_caves == this) scope->_seqs.push_back(seq);
+    }
+}
+
+void caveallocator::release(loc_t start){
+    std::lock_guard<std::mutex> lk(_lock);
+    releaseLocked(start);
+}
+
+void caveallocator::releaseLocked(loc_t start){
+    auto it = _reserved.find(start);
+    retassure(it != _reserved.end(), "no reservation at 0x%016llx", start);
+    _free[it->second.k].add(it->second.start, it->second.end);
+    _ledger.erase(it->second.seq);
+    _reserved.erase(it);
+}
+
+bool caveallocator::isFree(kind k, loc_t start, size_t size) const{
+    std::lock_guard<std::mutex> lk(_lock);
+    auto &bs = _free[k].byStart;
+    auto it = bs.upper_bound(start);
+    if (it == bs.begin()) return false;
+    --it;
+    return it->first <= start && start+size <= it->second;
+}
+
+loc_t caveallocator::firstRun(kind k, size_t size, loc_t startAddr) const{
+    auto &runs = _runs[k];
+    auto it = std::upper_bound(runs.begin(), runs.end(), run{startAddr, (loc_t)-1});
+    if (it != runs.begin()) --it;
+    for (; it != runs.end(); ++it) {
+        loc_t pos = std::max(it->first, startAddr);
+        if (k == kNop) pos = (pos + 3) & ~3ULL;
+        if (pos < it->second && it->second - pos >= size) return pos;
+    }
+    return 0;
+}
+
+std::vector<caveallocator::reservation> caveallocator::ledger(const cavescope &scope) const{
+    std::lock_guard<std::mutex> lk(_lock);
+    std::vector<reservation> ret;
+    for (uint64_t seq : scope._seqs) {
+        auto it = _ledger.find(seq);
+        if (it != _ledger.end()) ret.push_back(_reserved.at(it->second));
+    }
+    return ret;
+}
+
+void caveallocator::rollback(cavescope &scope){
+    std::lock_guard<std::mutex> lk(_lock);
+    for (auto seq = scope._seqs.rbegin(); seq != scope._seqs.rend(); ++seq) {
+        auto it = _ledger.find(*seq);
+        if (it != _ledger.end()) releaseLocked(it->second);
+    }
+    scope._seqs.clear();
+}
+
+#pragma mark cavescope
+
+cavescope::cavescope(caveallocator *caves)
+: _caves(caves), _prev(gScopes)
+{
+    gScopes = this;
+}
+
+cavescope::~cavescope(){
+    gScopes = _prev;
+}
+
+void cavescope::rollback(){
+    _caves->rollback(*this);
+}
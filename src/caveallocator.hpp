@@ -0,0 +1,106 @@
+//
+//  caveallocator.hpp
+//  liboffsetfinder64
+//
+
+#ifndef caveallocator_hpp
+#define caveallocator_hpp
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <stdint.h>
+
+#include <libinsn/vmem.hpp>
+#include <liboffsetfinder64/common.h>
+#include <liboffsetfinder64/patchfinder64.hpp>
+#include "column.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Code caves from a single scan: runs of nops in the executable segments and runs of zero bytes anywhere.
+            Free space is kept as ordered interval maps (by start for splitting/merging, by size for best fit),
+            so allocation, reservation and release are O(log n).
+            Every reservation gets the next sequence number, goes into a ledger and is recorded by the cavescopes of the reserving thread.
+            All members are thread safe, the scan results never change after construction.
+         */
+        class caveallocator{
+        public:
+            enum kind{
+                kNop = 0,
+                kZero,
+                kKindCnt
+            };
+            struct reservation{
+                loc_t start;
+                loc_t end;
+                kind k;
+                uint64_t seq;
+            };
+            typedef std::pair<loc_t, loc_t> run; //[start, end)
+            static constexpr size_t kMinZeroRun = 16;
+
+        private:
+            struct freelist{
+                std::map<loc_t, loc_t> byStart;             //start -> end
+                std::set<std::pair<loc_t, loc_t>> bySize;   //{size, start}
+
+                void add(loc_t start, loc_t end);
+                void remove(std::map<loc_t, loc_t>::iterator it);
+                void carve(loc_t start, loc_t end);
+            };
+            column<run> _runs[kKindCnt]; //as found by the scan, sorted
+            freelist _free[kKindCnt];
+            std::map<loc_t, reservation> _reserved;
+            std::map<uint64_t, loc_t> _ledger; //seq -> start of live reservations
+            uint64_t _nextSeq;
+            mutable std::mutex _lock;   //everything but _runs
+
+            void reserveLocked(kind k, loc_t start, size_t size);
+            void releaseLocked(loc_t start);
+            void initFreeLists();
+
+        public:
+            caveallocator(tihmstar::libinsn::vmem *mem);
+
+            /*
+                runs of a previous scan, e.g. from an indexfile. Nothing is reserved
+             */
+            caveallocator(column<run> &&nops, column<run> &&zeros);
+
+            /*
+                smallest free run of kind which fits size bytes at an address with addr % align == alignOffset.
+                Reserves it unless reserve is false, throws out_of_range if nothing fits.
+             */
+            loc_t allocate(kind k, size_t size, size_t align = 4, size_t alignOffset = 0, bool reserve = true);
+
+            /*
+                reserve a specific range, which has to be free
+             */
+            void reserve(kind k, loc_t start, size_t size);
+            void release(loc_t start);
+            bool isFree(kind k, loc_t start, size_t size) const;
+
+            /*
+                first position at or after startAddr with size bytes of kind, ignoring reservations.
+                Same answer as memmem for a needle of nops/zeros. 0 if there is none
+             */
+            loc_t firstRun(kind k, size_t size, loc_t startAddr = 0) const;
+
+            /*
+                live reservations recorded by scope, in the order they were made.
+                rollback releases them, reservations released in between are skipped.
+             */
+            std::vector<reservation> ledger(const cavescope &scope) const;
+            void rollback(cavescope &scope);
+
+            size_t runCnt(kind k) const { return _runs[k].size();}
+            const column<run> &runs(kind k) const { return _runs[k];}
+        };
+    };
+};
+
+#endif /* caveallocator_hpp */
@@ -0,0 +1,47 @@
+//
+//  column.hpp
+//  liboffsetfinder64
+//
+
+#ifndef column_hpp
+#define column_hpp
+
+#include <vector>
+
+#include <stddef.h>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Read only array for index tables.
+            Either owns its elements (built in this process) or points into memory somebody else owns,
+            e.g. a mapped indexfile, so a loaded index is used in place.
+         */
+        template <typename T>
+        class column{
+            std::vector<T> _own;
+            const T *_data;
+            size_t _size;
+
+        public:
+            column() : _data(NULL), _size(0) {}
+            column(std::vector<T> &&own) : _own(std::move(own)), _data(_own.data()), _size(_own.size()) {}
+            column(const T *data, size_t size) : _data(data), _size(size) {}
+
+            //moving a vector keeps its buffer, so _data stays valid
+            column(column &&other) = default;
+            column &operator=(column &&other) = default;
+            column(const column &) = delete;
+            column &operator=(const column &) = delete;
+
+            const T *begin() const { return _data;}
+            const T *end() const { return _data + _size;}
+            const T *data() const { return _data;}
+            size_t size() const { return _size;}
+            bool empty() const { return !_size;}
+            const T &operator[](size_t i) const { return _data[i];}
+        };
+    };
+};
+
+#endif /* column_hpp */
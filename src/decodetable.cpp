@@ -0,0 +1,162 @@
+//
+//  decodetable.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+
+#include <libgeneral/macros.h>
+
+#include "decodetable.hpp"
+#include "segmentview.hpp"
+#include "parallelscan.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace libinsn;
+
+#define CHUNK_WORDS 0x10000
+
+decodetable::decodetable(vmem *mem, unsigned threadCnt){
+    for (auto &view : segmentviews(mem, vsegment::kVMPROTEXEC)) {
+        segment seg = {};
+        seg.base = view.base;
+        seg.cnt = view.wordCnt();
+        seg.words = view.words();
+        seg.type.resize(seg.cnt);
+        seg.subtype.resize(seg.cnt);
+        seg.supertype.resize(seg.cnt);
+        seg.flags.resize(seg.cnt);
+        seg.rd.resize(seg.cnt);
+        seg.rn.resize(seg.cnt);
+        seg.rm.resize(seg.cnt);
+        seg.rt.resize(seg.cnt);
+        seg.rt2.resize(seg.cnt);
+        seg.imm.resize(seg.cnt);
+        _segments.push_back(std::move(seg));
+    }
+    std::sort(_segments.begin(), _segments.end(), [](const segment &a, const segment &b){
+        return a.base < b.base;
+    });
+
+    //a kernel has one huge __TEXT_EXEC, so split into chunks instead of going per segment
+    std::vector<std::pair<segment *, size_t>> chunks;
+    for (auto &seg : _segments) {
+        for (size_t i=0; i<seg.cnt; i+=CHUNK_WORDS) {
+            chunks.push_back({&seg, i});
+        }
+    }
+
+    parallelscan::run(chunks.size(), [&](size_t c){
+        segment &seg = *chunks[c].first;
+        size_t start = chunks[c].second;
+        decodeRange(seg, start, std::min(start+CHUNK_WORDS, seg.cnt));
+    }, threadCnt);
+}
+
+void decodetable::decodeRange(segment &seg, size_t start, size_t end){
+    const uint32_t *words = seg.words;
+
+    //raw fields first, this loop has no branches
+    for (size_t i=start; i<end; i++) {
+        uint32_t w = words[i];
+        seg.rd[i]  = w & 0x1f;
+        seg.rt[i]  = w & 0x1f;
+        seg.rn[i]  = (w >> 5) & 0x1f;
+        seg.rt2[i] = (w >> 10) & 0x1f;
+        seg.rm[i]  = (w >> 16) & 0x1f;
+    }
+
+    for (size_t i=start; i<end; i++) {
+        insn ins(words[i], seg.pc(i));
+        enum insn::type type = ins.type();
+        enum insn::subtype subtype = ins.subtype();
+        seg.type[i] = (uint8_t)type;
+        seg.subtype[i] = (uint8_t)subtype;
+        seg.supertype[i] = (uint8_t)ins.supertype();
+
+        uint8_t flags = kResolved;
+        try {
+            switch (type) {
+                case insn::adrp:
+                case insn::adr:
+                case insn::movz:
+                case insn::movk:
+                    seg.rd[i] = ins.rd();
+                    seg.imm[i] = ins.imm();
+                    flags |= kHasImm;
+                    break;
+                case insn::add:
+                case insn::sub:
+                    seg.rd[i] = ins.rd();
+                    seg.rn[i] = ins.rn();
+                    if (subtype == insn::st_immediate) {
+                        seg.imm[i] = ins.imm();
+                        flags |= kHasImm;
+                    } else {
+                        seg.rm[i] = ins.rm();
+                    }
+                    break;
+                case insn::mov:
+                    seg.rd[i] = ins.rd();
+                    seg.rm[i] = ins.rm();
+                    break;
+                case insn::ldr:
+                case insn::ldrb:
+                case insn::ldrh:
+                case insn::ldrsw:
+                case insn::str:
+                case insn::strb:
+                case insn::strh:
+                    seg.rt[i] = ins.rt();
+                    seg.rn[i] = ins.rn();
+                    if (subtype == insn::st_immediate || subtype == insn::st_literal) {
+                        seg.imm[i] = ins.imm();
+                        flags |= kHasImm;
+                    }
+                    break;
+                case insn::stp:
+                case insn::ldp:
+                    seg.rt[i] = ins.rt();
+                    seg.rt2[i] = ins.rt2();
+                    seg.rn[i] = ins.rn();
+                    seg.imm[i] = ins.imm();
+                    flags |= kHasImm;
+                    break;
+                case insn::cbz:
+                case insn::cbnz:
+                case insn::tbz:
+                case insn::tbnz:
+                    seg.rt[i] = ins.rt();
+                    //fall through
+                case insn::b:
+                case insn::bl:
+                case insn::bcond:
+                    seg.imm[i] = ins.imm();
+                    flags |= kHasImm;
+                    break;
+                default:
+                    flags = 0;
+                    break;
+            }
+        } catch (...) {
+            //libinsn can't give us this field, users decode the row themselves
+            flags = 0;
+        }
+        seg.flags[i] = flags;
+    }
+}
+
+size_t decodetable::size() const{
+    size_t ret = 0;
+    for (auto &seg : _segments) ret += seg.cnt;
+    return ret;
+}
+
+const decodetable::segment *decodetable::segmentFor(loc_t pos) const{
+    auto seg = std::upper_bound(_segments.begin(), _segments.end(), pos, [](loc_t pos, const segment &s){
+        return pos < s.base;
+    });
+    if (seg == _segments.begin() || pos >= (--seg)->end()) return NULL;
+    return &*seg;
+}
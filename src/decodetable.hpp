@@ -0,0 +1,73 @@
+//
+//  decodetable.hpp
+//  liboffsetfinder64
+//
+
+#ifndef decodetable_hpp
+#define decodetable_hpp
+
+#include <vector>
+
+#include <stdint.h>
+
+#include <libinsn/insn.hpp>
+#include <libinsn/vmem.hpp>
+#include <liboffsetfinder64/common.h>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Every word of the executable segments decoded once, stored as columns.
+            type/subtype/supertype always come from libinsn.
+            Register and imm columns come from libinsn for the instructions the primitives look at (kResolved),
+            for everything else they hold the raw bit fields.
+         */
+        class decodetable{
+        public:
+            enum rowflags : uint8_t{
+                kResolved   = 1 << 0,
+                kHasImm     = 1 << 1
+            };
+            struct segment{
+                loc_t base;
+                size_t cnt;
+                const uint32_t *words;
+                std::vector<uint8_t> type;
+                std::vector<uint8_t> subtype;
+                std::vector<uint8_t> supertype;
+                std::vector<uint8_t> flags;
+                std::vector<uint8_t> rd;
+                std::vector<uint8_t> rn;
+                std::vector<uint8_t> rm;
+                std::vector<uint8_t> rt;
+                std::vector<uint8_t> rt2;
+                std::vector<int64_t> imm; //branch and adr/adrp targets are absolute
+
+                loc_t end() const { return base + cnt*4;}
+                loc_t pc(size_t i) const { return base + i*4;}
+                size_t idx(loc_t pos) const { return (pos-base)/4;}
+                tihmstar::libinsn::insn decode(size_t i) const { return {words[i], pc(i)};}
+            };
+        private:
+            std::vector<segment> _segments;
+
+            static void decodeRange(segment &seg, size_t start, size_t end);
+
+        public:
+            /*
+                decodes on threadCnt threads, 0 means one per cpu
+             */
+            decodetable(tihmstar::libinsn::vmem *mem, unsigned threadCnt = 0);
+
+            const std::vector<segment> &segments() const { return _segments;}
+            size_t size() const;
+
+            /*
+                NULL if pos is not in an executable segment
+             */
+            const segment *segmentFor(loc_t pos) const;
+        };
+    };
+};
+
+#endif /* decodetable_hpp */
@@ -0,0 +1,117 @@
+//
+//  functiontable.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+
+#include <libgeneral/macros.h>
+
+#include "functiontable.hpp"
+#include "segmentview.hpp"
+#include "OFexception.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace libinsn;
+
+#define STP_MASK        0x3A400000 //load/store pair, store, any indexing mode
+#define STP_OPCODE      0x28000000
+#define SUB_SP_MASK     0x7F8003FF //sub (immediate), rd = rn = sp
+#define SUB_SP_OPCODE   0x510003FF
+#define PACIBSP_OPCODE  0xD503237F
+#define RET_MASK        0xFFFFF000 //ret, retaa, retab with any register
+#define RET_OPCODE      0xD65F0000
+
+#define OPCODE_RT2(op)  (((op) >> 10) & 0x1f)
+#define OPCODE_RN(op)   (((op) >> 5) & 0x1f)
+
+static bool anchorLess(const functiontable::anchor &a, const functiontable::anchor &b){
+    return a.stp < b.stp;
+}
+
+static bool isStp(const uint32_t *words, size_t i, loc_t base){
+    if ((words[i] & STP_MASK) != STP_OPCODE) return false;
+    return insn(words[i], base + i*4) == insn::stp;
+}
+
+functiontable::functiontable(vmem *mem){
+    std::vector<anchor> anchors;
+    std::vector<loc_t> rets;
+    std::vector<std::pair<loc_t, loc_t>> segments;
+    for (auto &seg : segmentviews(mem, vsegment::kVMPROTEXEC)) {
+        const uint32_t *words = seg.words();
+        size_t wordCnt = seg.wordCnt();
+        segments.push_back({seg.base, seg.end()});
+
+        for (size_t i=0; i<wordCnt; i++) {
+            uint32_t opcode = words[i];
+            loc_t pc = seg.base + i*4;
+
+            if ((opcode & RET_MASK) == RET_OPCODE) {
+                if (insn(opcode, pc) == insn::ret) rets.push_back(pc);
+                continue;
+            }
+
+            if ((opcode & STP_MASK) != STP_OPCODE || OPCODE_RT2(opcode) != 30 || OPCODE_RN(opcode) != 31) continue;
+            {
+                insn stp(opcode, pc);
+                if (stp != insn::stp || stp.rt2() != 30 || stp.rn() != 31) continue;
+            }
+
+            /*
+                peel exactly like the backward walk:
+                preceding stp, then an optional sub sp, sp, then an optional pacibsp.
+                The walk stops at the segment start.
+             */
+            size_t top = i;
+            while (top > 0 && isStp(words, top-1, seg.base)) top--;
+
+            if (top > 0 && (words[top-1] & SUB_SP_MASK) == SUB_SP_OPCODE) {
+                insn sub(words[top-1], seg.base + (top-1)*4);
+                if (sub == insn::sub && sub.rd() == 31 && sub.rn() == 31) top--;
+            }
+
+            if (top > 0 && words[top-1] == PACIBSP_OPCODE) top--;
+
+            anchors.push_back({pc, seg.base + top*4});
+        }
+    }
+
+    std::sort(anchors.begin(), anchors.end(), anchorLess);
+    std::sort(rets.begin(), rets.end());
+    std::sort(segments.begin(), segments.end());
+
+    _anchors = std::move(anchors);
+    _rets = std::move(rets);
+    _segments = std::move(segments);
+}
+
+functiontable::functiontable(column<anchor> &&anchors, column<loc_t> &&rets, column<std::pair<loc_t, loc_t>> &&segments)
+: _anchors(std::move(anchors)), _rets(std::move(rets)), _segments(std::move(segments))
+{
+    //
+}
+
+std::pair<loc_t, loc_t> functiontable::segmentRange(loc_t pos) const{
+    auto seg = std::upper_bound(_segments.begin(), _segments.end(), std::pair<loc_t, loc_t>{pos, (loc_t)-1});
+    if (seg == _segments.begin() || pos >= (--seg)->second)
+        retcustomerror(out_of_range, "pos=0x%016llx not in an executable segment", pos);
+    return *seg;
+}
+
+loc_t functiontable::find_bof(loc_t pos) const{
+    auto seg = segmentRange(pos);
+    auto it = std::upper_bound(_anchors.begin(), _anchors.end(), anchor{pos, 0}, anchorLess);
+    if (it == _anchors.begin() || (--it)->stp < seg.first)
+        retcustomerror(out_of_range, "no function top before pos=0x%016llx", pos);
+    return it->bof;
+}
+
+loc_t functiontable::find_eof(loc_t pos) const{
+    auto seg = std::upper_bound(_segments.begin(), _segments.end(), std::pair<loc_t, loc_t>{pos, (loc_t)-1});
+    if (seg == _segments.begin() || pos >= (--seg)->second) return 0;
+    auto it = std::lower_bound(_rets.begin(), _rets.end(), pos);
+    if (it == _rets.end() || *it >= seg->second) return 0;
+    return *it;
+}
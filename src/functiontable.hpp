@@ -0,0 +1,60 @@
+//
+//  functiontable.hpp
+//  liboffsetfinder64
+//
+
+#ifndef functiontable_hpp
+#define functiontable_hpp
+
+#include <vector>
+
+#include <libinsn/vmem.hpp>
+#include <liboffsetfinder64/common.h>
+#include "column.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Sorted function boundaries of the executable segments.
+            Prologue anchors (stp x?, x30, [sp, ...]) are kept together with the function top find_bof derives from them,
+            so find_bof is a binary search with identical answers.
+            The ret instructions make find_eof (first ret at or after pos) a binary search as well.
+         */
+        class functiontable{
+        public:
+            struct anchor{
+                loc_t stp;  //stp x?, x30, [sp, ...]
+                loc_t bof;  //after peeling preceding stp/sub sp/pacibsp
+            };
+        private:
+            column<anchor> _anchors;
+            column<loc_t> _rets;
+            column<std::pair<loc_t, loc_t>> _segments;
+
+            std::pair<loc_t, loc_t> segmentRange(loc_t pos) const;
+
+        public:
+            functiontable(tihmstar::libinsn::vmem *mem);
+            functiontable(column<anchor> &&anchors, column<loc_t> &&rets, column<std::pair<loc_t, loc_t>> &&segments);
+
+            size_t size() const { return _anchors.size();}
+            const column<anchor> &anchors() const { return _anchors;}
+            const column<loc_t> &rets() const { return _rets;}
+            const column<std::pair<loc_t, loc_t>> &segments() const { return _segments;}
+
+            /*
+                same answer as the backward walk in patchfinder64::find_bof
+             */
+            loc_t find_bof(loc_t pos) const;
+
+            /*
+                first ret at or after pos, same answer as the forward walk in patchfinder64::find_eof.
+                0 if pos isn't in an executable segment or there is no ret after it in that segment,
+                the walk continues into the next segment then
+             */
+            loc_t find_eof(loc_t pos) const;
+        };
+    };
+};
+
+#endif /* functiontable_hpp */
@@ -10,6 +10,7 @@
 
 #include "ibootpatchfinder64_base.hpp"
 #include "ibootpatchfinder64_iOS14.hpp"
+#include "imagefile.hpp"
 
 
 using namespace std;
@@ -37,24 +38,17 @@ ibootpatchfinder64::ibootpatchfinder64(bool freeBuf)
 
 ibootpatchfinder64 *ibootpatchfinder64::make_ibootpatchfinder64(const char * filename){
     bool didConstructSuccessfully = false;
-    int fd = 0;
-    uint8_t *buf = NULL;
+    imagefile::image img = imagefile::load(filename);
     cleanup([&]{
-        if (fd>0) close(fd);
         if (!didConstructSuccessfully) {
-            safeFreeConst(buf);
+            imagefile::release(img.buf, img.mappedSize);
         }
     })
-    struct stat fs = {0};
-    size_t bufSize = 0;
-    
-    assure((fd = open(filename, O_RDONLY)) != -1);
-    assure(!fstat(fd, &fs));
-    assure((buf = (uint8_t*)malloc(bufSize = fs.st_size)));
-    assure(read(fd,(void*)buf,bufSize)== bufSize);
-    
 
-    auto ret = make_ibootpatchfinder64(buf, bufSize, true);
+    //hand over ownership only once construction succeeded, a throwing constructor would free it too
+    auto ret = make_ibootpatchfinder64(img.buf, img.size, false);
+    ret->_freeBuf = true;
+    ret->_bufMappedSize = img.mappedSize;
     didConstructSuccessfully = true;
     return ret;
 }
@@ -10,7 +10,9 @@
 
 #include "ibootpatchfinder64_base.hpp"
 #include "all_liboffsetfinder.hpp"
+#include "caveallocator.hpp"
 #include "OFexception.hpp"
+#include "tracer.hpp"
 
 using namespace std;
 using namespace tihmstar::offsetfinder64;
@@ -29,25 +31,18 @@ using namespace tihmstar::libinsn;
 #define DEFAULT_BOOTARGS_STR_OTHER1 " -progress"
 #define DEFAULT_BOOTARGS_STR_OTHER2 " -restore"
 #define CERT_STR "Apple Inc.1"
-#define _270ZEROES "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
 
 ibootpatchfinder64_base::ibootpatchfinder64_base(const char * filename) :
     ibootpatchfinder64(true)
 {
-    struct stat fs = {0};
-    int fd = 0;
     bool didConstructSuccessfully = false;
     cleanup([&]{
-        if (fd>0) close(fd);
         if (!didConstructSuccessfully) {
-            safeFreeConst(_buf);
+            releaseBuf();
         }
     })
     
-    assure((fd = open(filename, O_RDONLY)) != -1);
-    assure(!fstat(fd, &fs));
-    assure((_buf = (uint8_t*)malloc( _bufSize = fs.st_size)));
-    assure(read(fd,(void*)_buf,_bufSize)==_bufSize);
+    loadFile(filename);
     
     assure(_bufSize > 0x1000);
     
@@ -150,32 +145,37 @@ ibootpatchfinder64_base::~ibootpatchfinder64_base(){
 }
 
 bool ibootpatchfinder64_base::has_kernel_load(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     try {
-        return (bool) (_vmem->memstr(KERNELCACHE_PREP_STRING) != 0);
+        return tspan.ret((bool) (_vmem->memstr(KERNELCACHE_PREP_STRING) != 0));
     } catch (...) {
-        return 0;
+        return tspan.ret(false);
     }
 }
 
 bool ibootpatchfinder64_base::has_recovery_console(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     try {
-        return (bool) (_vmem->memstr(ENTERING_RECOVERY_CONSOLE) != 0);
+        return tspan.ret((bool) (_vmem->memstr(ENTERING_RECOVERY_CONSOLE) != 0));
     } catch (...) {
-        return 0;
+        return tspan.ret(false);
     }
 }
 
 std::vector<patch> ibootpatchfinder64_base::get_sigcheck_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
+    cachequery cq;
+    if (cacheLookup(cq, __FUNCTION__, "", patches)) return tspan.ret(std::move(patches));
     loc_t img4decodemanifestexists = 0x0;
     bool isnotptr = false;
     bool isadrl = false;
     if(_vers == 5540 && _vers_arr[0] >= 100 || _vers > 5540) {
         debug("get_sigcheck_patch: iOS 13.4 or later(iBoot-%d.%d) detected.",_vers, _vers_arr[0]);
-        img4decodemanifestexists = _vmem->memmem("\xE8\x03\x00\xAA\xC0\x00\x80\x52\xE8\x00\x00\xB4", 12);
+        img4decodemanifestexists = memmem_insn("\xE8\x03\x00\xAA\xC0\x00\x80\x52\xE8\x00\x00\xB4", 12);
     } else if(_vers == 5540 && _vers_arr[0] <= 100 || _vers <= 5540 && _vers >= 3406) {
         debug("get_sigcheck_patch: iOS 13.3 or lower(iBoot-%d.%d) detected.",_vers, _vers_arr[0]);
-        img4decodemanifestexists = _vmem->memmem("\xE8\x03\x00\xAA\xE0\x07\x1F\x32\xE8\x00\x00\xB4", 12);
+        img4decodemanifestexists = memmem_insn("\xE8\x03\x00\xAA\xE0\x07\x1F\x32\xE8\x00\x00\xB4", 12);
     } else if(_vers < 3406) {
         if(_vers <= 1940) {
             debug("get_sigcheck_patch: iOS 7.1.2 or lower(iBoot-%d.%d) detected.",_vers, _vers_arr[0]);
@@ -184,7 +184,7 @@ std::vector<patch> ibootpatchfinder64_base::get_sigcheck_patch(){
             debug("get_sigcheck_patch: iOS 9.3.6 or lower(iBoot-%d.%d) detected.",_vers, _vers_arr[0]);
         }
         isnotptr = true;
-        img4decodemanifestexists = _vmem->memmem("\xE8\x07\x1F\x32\xE0\x00\x00\xB4\xC1\x00\x00\xB4", 12);
+        img4decodemanifestexists = memmem_insn("\xE8\x07\x1F\x32\xE0\x00\x00\xB4\xC1\x00\x00\xB4", 12);
     } else {
         reterror("unknown or unsupported iboot version");
     }
@@ -221,7 +221,7 @@ std::vector<patch> ibootpatchfinder64_base::get_sigcheck_patch(){
     assure(img4interposercallback);
     if(isnotptr) {
         patches.push_back({img4interposercallback,"\x00\x00\x80\xD2\xC0\x03\x5F\xD6" /*mov x0, 0: ret*/, 8});
-        return patches;
+        return tspan.ret(cacheStore(cq, std::move(patches)));
     }
     
     vmem iter3(*_vmem,img4interposercallback);
@@ -250,10 +250,11 @@ std::vector<patch> ibootpatchfinder64_base::get_sigcheck_patch(){
         debug("cpro_jump=%p", cpro_jump);
         patches.push_back({cpro_jump, "\xD5\x03\x20\x1F" /*nop*/, 4});
     }
-    return patches;
+    return tspan.ret(cacheStore(cq, std::move(patches)));
 }
 
 std::vector<patch> ibootpatchfinder64_base::get_demotion_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
     /* always production patch*/
     for (uint64_t demoteReg : {0x3F500000UL,0x3F500000UL,0x3F500000UL,0x481BC000UL,0x481BC000UL,0x20E02A000UL,0x2102BC000UL,0x2102BC000UL,0x2352BC000UL}) {
@@ -268,12 +269,13 @@ std::vector<patch> ibootpatchfinder64_base::get_demotion_patch(){
             patches.push_back({demoteRef,"\x20\x00\x80\xD2" /*mov x0, 0*/,4});
         }
     }
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 std::vector<patch> ibootpatchfinder64_base::get_boot_arg_patch(const char *bootargs) {
+    tracespan tspan(_tracer, "finder", __FUNCTION__, "bootargs", bootargs);
     std::vector <patch> patches;
     if (!bootargs)
-        return patches;
+        return tspan.ret(std::move(patches));
     loc_t default_boot_args_str_loc = 0;
     loc_t default_boot_args_xref = 0;
     int default_boot_args_len = 0;
@@ -322,10 +324,10 @@ std::vector<patch> ibootpatchfinder64_base::get_boot_arg_patch(const char *boota
 
     debug("Relocating boot-args string...\n");
     loc_t cert_str_loc = 0;
-    loc_t bootarg_loc1 = _vmem->memmem(_270ZEROES, 270, default_boot_args_xref);
-    if(_chipid == 8010 || _chipid == 8003 || (_chipid == 8000 && !_7429_0)) {
+    loc_t bootarg_loc1 = caves()->firstRun(caveallocator::kZero, 270, default_boot_args_xref);
+    if(bootarg_loc1 && (_chipid == 8010 || _chipid == 8003 || (_chipid == 8000 && !_7429_0))) {
         debug("Finding another bootarg location...\n");
-        bootarg_loc1 = _vmem->memmem(_270ZEROES, 270, bootarg_loc1 + 270);
+        bootarg_loc1 = caves()->firstRun(caveallocator::kZero, 270, bootarg_loc1 + 270);
     }
     debug("bootarg_loc1=%p\n", bootarg_loc1);
     if(bootarg_loc1) {
@@ -417,7 +419,7 @@ std::vector<patch> ibootpatchfinder64_base::get_boot_arg_patch(const char *boota
     }
     debug("xrefRD=%d\n", xrefRD);
     if (xrefRD > 9 || xrefRD == 4)
-      return patches;
+      return tspan.ret(std::move(patches));
 
     while (++iter != insn::csel)
       ;
@@ -460,10 +462,11 @@ std::vector<patch> ibootpatchfinder64_base::get_boot_arg_patch(const char *boota
       patches.push_back({(loc_t)pins.pc(), &opcode, 4});
     }
 
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> ibootpatchfinder64_base::get_debug_enabled_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
     
     loc_t debug_enabled = findstr("debug-enabled", true);
@@ -479,26 +482,27 @@ std::vector<patch> ibootpatchfinder64_base::get_debug_enabled_patch(){
     
     patches.push_back({iter,"\x20\x00\x80\xD2" /* mov x0,1 */,4});
     
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> ibootpatchfinder64_base::get_cmd_handler_patch(const char *cmd_handler_str, uint64_t ptr){
+    tracespan tspan(_tracer, "finder", __FUNCTION__, "cmd_handler_str", cmd_handler_str, "ptr", ptr);
     std::vector<patch> patches;
     std::string handler_str{"A"};
     handler_str+= cmd_handler_str;
     ((char*)handler_str.c_str())[0] = '\0';
     
-    loc_t handler_str_loc = _vmem->memmem(handler_str.c_str(), handler_str.size());
+    loc_t handler_str_loc = memmem(handler_str.c_str(), handler_str.size());
     debug("handler_str_loc=%p\n",handler_str_loc);
     
     handler_str_loc++;
     
-    loc_t tableref = _vmem->memmem(&handler_str_loc, sizeof(handler_str_loc));
+    loc_t tableref = memmem(&handler_str_loc, sizeof(handler_str_loc));
     debug("tableref=%p\n",tableref);
     
     patches.push_back({tableref+8,&ptr,8});
     
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> ibootpatchfinder64_base::replace_bgcolor_with_memcpy(){
@@ -511,12 +515,12 @@ std::vector<patch> ibootpatchfinder64_base::replace_bgcolor_with_memcpy(){
     handler_str+= "bgcolor";
     ((char*)handler_str.c_str())[0] = '\0';
     
-    loc_t handler_str_loc = _vmem->memmem(handler_str.c_str(), handler_str.size());
+    loc_t handler_str_loc = memmem(handler_str.c_str(), handler_str.size());
     debug("handler_str_loc=%p\n",handler_str_loc);
     
     handler_str_loc++;
     
-    loc_t tableref = _vmem->memmem(&handler_str_loc, sizeof(handler_str_loc));
+    loc_t tableref = memmem(&handler_str_loc, sizeof(handler_str_loc));
     debug("tableref=%p\n",tableref);
     
     patches.push_back({scratchbuf,"memcpy",sizeof("memcpy")}); //overwrite name
@@ -570,6 +574,7 @@ std::vector<patch> ibootpatchfinder64_base::replace_bgcolor_with_memcpy(){
 
 
 std::vector<patch> ibootpatchfinder64_base::get_ra1nra1n_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
     
     /*
@@ -592,14 +597,14 @@ std::vector<patch> ibootpatchfinder64_base::get_ra1nra1n_patch(){
      */
     
 
-    loc_t findloc = _vmem->memmem("\x12\x00\x80\xd2", 4);
+    loc_t findloc = memmem_insn("\x12\x00\x80\xd2", 4);
     debug("findloc=%p\n",findloc);
     
     constexpr const char patch[] = "\xE8\x03\x1B\xAA\xE9\x03\x1D\xAA\x1B\x01\xC0\xD2\x1B\x00\xA5\xF2\xFD\x03\x1B\xAA";
 
     patches.push_back({findloc,patch,sizeof(patch)-1});
 
-    loc_t findloc2 = _vmem->memmem("\x23\x74\x0b\xd5", 4);
+    loc_t findloc2 = memmem_insn("\x23\x74\x0b\xd5", 4);
     debug("findloc2=%p\n",findloc2);
 
     loc_t bzero = find_bof(findloc2);
@@ -611,7 +616,7 @@ std::vector<patch> ibootpatchfinder64_base::get_ra1nra1n_patch(){
         nops[i] = nops[0];
     }
     
-    loc_t findNops = _vmem->memmem(nops, sizeof(nops));
+    loc_t findNops = memmem_insn(nops, sizeof(nops));
     debug("findNops=%p\n",findNops);
 
     
@@ -641,17 +646,18 @@ std::vector<patch> ibootpatchfinder64_base::get_ra1nra1n_patch(){
     
     
     
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 
 std::vector<patch> ibootpatchfinder64_base::get_unlock_nvram_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     debug("check stage");
     if(stage1) {
         debug("iBootStage1 detected, not patching nvram");
-        return patches;
+        return tspan.ret(std::move(patches));
     }
     debug("stage not iBootStage1, continuing patch");
     if(dev) {
@@ -691,15 +697,15 @@ std::vector<patch> ibootpatchfinder64_base::get_unlock_nvram_patch(){
         debug("func3top=%p\n",func3top);
 
         patches.push_back({func3top,"\x00\x00\x80\xD2"/* movz x0, #0x0*/"\xC0\x03\x5F\xD6"/*ret*/,8});
-        return patches;
+        return tspan.ret(std::move(patches));
     }
 
     loc_t debug_uarts_str = findstr("debug-uarts", true);
     debug("debug_uarts_str=%p\n",debug_uarts_str);
 
-    loc_t debug_uarts_ref = _vmem->memmem(&debug_uarts_str, sizeof(debug_uarts_str));
+    loc_t debug_uarts_ref = memmem(&debug_uarts_str, sizeof(debug_uarts_str));
     if(dev) {
-        debug_uarts_ref = _vmem->memmem(&debug_uarts_str, sizeof(debug_uarts_str), debug_uarts_ref + 4);
+        debug_uarts_ref = memmem(&debug_uarts_str, sizeof(debug_uarts_str), debug_uarts_ref + 4);
     }
 
     debug("debug_uarts_ref=%p\n",debug_uarts_ref);
@@ -749,16 +755,17 @@ std::vector<patch> ibootpatchfinder64_base::get_unlock_nvram_patch(){
 
     patches.push_back({func3top,"\x00\x00\x80\xD2"/* movz x0, #0x0*/"\xC0\x03\x5F\xD6"/*ret*/,8});
 
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> ibootpatchfinder64_base::get_nvram_nosave_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     loc_t saveenv_str = findstr("saveenv", true);
     debug("saveenv_str=%p\n",saveenv_str);
 
-    loc_t saveenv_ref = _vmem->memmem(&saveenv_str, sizeof(saveenv_str));
+    loc_t saveenv_ref = memmem(&saveenv_str, sizeof(saveenv_str));
     debug("saveenv_ref=%p\n",saveenv_ref);
 
     loc_t saveenv_cmd_func_pos = _vmem->deref(saveenv_ref+8);
@@ -772,10 +779,11 @@ std::vector<patch> ibootpatchfinder64_base::get_nvram_nosave_patch(){
     debug("nvram_save_func=%p\n",nvram_save_func);
     
     patches.push_back({nvram_save_func,"\xC0\x03\x5F\xD6"/*ret*/,4});
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> ibootpatchfinder64_base::get_nvram_noremove_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     auto nosave_patches = get_nvram_nosave_patch();
@@ -810,16 +818,17 @@ found:
     debug("remove_env_func=%p\n",remove_env_func);
 
     patches.push_back({remove_env_func,"\xC0\x03\x5F\xD6"/*ret*/,4});
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> ibootpatchfinder64_base::get_freshnonce_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     debug("check stage");
     if(stage1) {
         debug("iBootStage1 detected, not patching nvram");
-        return patches;
+        return tspan.ret(std::move(patches));
     }
     debug("stage not iBootStage1, continuing patch");
 
@@ -851,7 +860,7 @@ std::vector<patch> ibootpatchfinder64_base::get_freshnonce_patch(){
     debug("branchloc=%p\n",branchloc);
 
     patches.push_back({branchloc,"\x1F\x20\x03\xD5"/*nop*/,4});
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 //std::vector<patch> ibootpatchfinder64_base::get_readback_loadaddr_patch(){
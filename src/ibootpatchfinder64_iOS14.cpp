@@ -8,12 +8,23 @@
 
 #include <libgeneral/macros.h>
 #include "ibootpatchfinder64_iOS14.hpp"
+#include "insnpattern.hpp"
+#include "tracer.hpp"
 
 using namespace std;
 using namespace tihmstar::offsetfinder64;
 using namespace tihmstar::libinsn;
 
 #define iBOOT_BASE_OFFSET 0x300
+
+#define MOVZ_MASK       0x7F800000
+#define MOVZ_OPCODE     0x52800000
+#define MOVK_MASK       0x7F800000
+#define MOVK_OPCODE     0x72800000
+#define MSR_MASK        0xFFF00000 //msr (register), any system register
+#define MSR_OPCODE      0xD5100000
+#define RET_MASK        0xFFFFFC1F
+#define RET_OPCODE      0xD65F0000
 #define PROD "effective-production-status-ap"
 
 ibootpatchfinder64_iOS14::ibootpatchfinder64_iOS14(const char *filename)
@@ -33,12 +44,15 @@ ibootpatchfinder64_iOS14::ibootpatchfinder64_iOS14(const void *buffer, size_t bu
 }
 
 std::vector<patch> ibootpatchfinder64_iOS14::get_sigcheck_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
-    loc_t img4decodemanifestexists;
+    cachequery cq;
+    if (cacheLookup(cq, __FUNCTION__, "", patches)) return tspan.ret(std::move(patches));
+    loc_t img4decodemanifestexists = 0;
     if(_vers >= 7459 && _vers < 8419) {
-            img4decodemanifestexists = _vmem->memmem("\xE8\x03\x00\xAA\xC0\x00\x80\x52\x28\x01\x00\xB4", 12);
+            img4decodemanifestexists = memmem_insn("\xE8\x03\x00\xAA\xC0\x00\x80\x52\x28\x01\x00\xB4", 12);
     } else {
-        img4decodemanifestexists = _vmem->memmem("\xE8\x03\x00\xAA\xC0\x00\x80\x52\xE8\x00\x00\xB4", 12); //0x180032144;
+        img4decodemanifestexists = memmem_insn("\xE8\x03\x00\xAA\xC0\x00\x80\x52\xE8\x00\x00\xB4", 12); //0x180032144;
     }
     debug("img4decodemanifestexists=%p",img4decodemanifestexists);
     retassure(img4decodemanifestexists, "retassure: %d", __LINE__);
@@ -101,15 +115,16 @@ std::vector<patch> ibootpatchfinder64_iOS14::get_sigcheck_patch(){
             }
         }
     }
-    return patches;
+    return tspan.ret(cacheStore(cq, std::move(patches)));
 }
 
 std::vector<patch> ibootpatchfinder64_iOS14::get_demotion_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
     /* always production patch*/
     debug("prod search");
     if(!_vmem->memstr(PROD))
-        return patches;
+        return tspan.ret(std::move(patches));
     loc_t productionStr = _vmem->memstr(PROD);
     debug("prod done");
     debug("productionStr=%p\n",productionStr);
@@ -138,16 +153,17 @@ std::vector<patch> ibootpatchfinder64_iOS14::get_demotion_patch(){
             patches.push_back({demoteRef,"\xD5\x03\x20\x1F" /*nop*/,4});
         }
     }
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> ibootpatchfinder64_iOS14::get_change_reboot_to_fsboot_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     loc_t rebootstr = findstr("reboot", true);
     debug("rebootstr=%p",rebootstr);
 
-    loc_t rebootrefstr = _vmem->memmem(&rebootstr,sizeof(loc_t));
+    loc_t rebootrefstr = memmem(&rebootstr,sizeof(loc_t));
     debug("rebootrefstr=%p",rebootrefstr);
     
     loc_t rebootrefptr = rebootrefstr+8;
@@ -158,24 +174,30 @@ std::vector<patch> ibootpatchfinder64_iOS14::get_change_reboot_to_fsboot_patch()
 
     patches.push_back({rebootrefstr,&fsbootstr,sizeof(loc_t)}); //rewrite pointer to point to fsboot
 
-    loc_t fsbootrefstr = _vmem->memmem(&fsbootstr,sizeof(loc_t));
+    loc_t fsbootrefstr = memmem(&fsbootstr,sizeof(loc_t));
     debug("fsbootrefstr=%p",fsbootrefstr);
     
     loc_t fsbootfunction = _vmem->deref(fsbootrefstr+8);
     debug("fsbootfunction=%p",fsbootfunction);
     patches.push_back({rebootrefstr+8,&fsbootfunction,sizeof(loc_t)}); //rewrite pointer to point to fsboot
 
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 loc_t ibootpatchfinder64_iOS14::find_iBoot_logstr(uint64_t loghex, int skip, uint64_t shortdec){
-    vmem iter(*_vmem);
-    uint64_t longval = 0;
+    tracespan tspan(_tracer, "finder", __FUNCTION__, "loghex", loghex, "skip", skip, "shortdec", shortdec);
     uint64_t shortval = 0;
+    loc_t pos = 0;
+
+    //movz x9, ...; movk x9, ...*
+    insnpattern logval;
+    logval.op(MOVZ_OPCODE | 9, MOVZ_MASK | 0x1f, [](insn &i){ return i == insn::movz;})
+          .op(MOVK_OPCODE | 9, MOVK_MASK | 0x1f, [](insn &i){ return i == insn::movk;}).repeat(0, insnpattern::kUnbounded);
 
-    while (true) {
-        while (++iter != insn::movz || iter().rd() != 9);
-        longval = iter().imm();
+    insnpattern::match m;
+    while (logval.find(_vmem, pos, m)) {
+        vmem iter(*_vmem,m.start);
+        uint64_t longval = iter().imm();
 
         {
             vmem prevIter{iter,iter.pc()-4};
@@ -183,25 +205,33 @@ loc_t ibootpatchfinder64_iOS14::find_iBoot_logstr(uint64_t loghex, int skip, uin
                 shortval = prevIter().imm();
             }
         }
-        while (++iter == insn::movk && iter().rd() == 9){
-
-            uint64_t curval =  iter().imm();
+        for (uint32_t i=0; i<m.elements[1].second; i++){
+            
+            uint64_t curval =  (++iter).imm();
             
             longval += curval;
         }
+        ++iter;
         if (longval == loghex && (shortdec == shortval || shortdec == 0)){
-            if (skip-- == 0) return iter;
+            if (skip-- == 0) return tspan.ret((loc_t)iter);
         }
+        //the instruction after the movk chain is never a candidate
+        pos = iter.pc()+4;
     }
     
-    return 0;
+    return tspan.ret((loc_t)0);
 }
 
 
 uint32_t ibootpatchfinder64_iOS14::get_el1_pagesize(){
-    vmem iter(*_vmem);
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
+    insnpattern msr_tcr_el1;
+    msr_tcr_el1.op(MSR_OPCODE, MSR_MASK, [](insn &i){ return i == insn::msr && i.special() == insn::tcr_el1;});
+
+    insnpattern::match m;
+    retassure(msr_tcr_el1.find(_vmem, 0, m), "failed to find msr tcr_el1");
 
-    while (++iter != insn::msr || iter().special() != insn::tcr_el1);
+    vmem iter(*_vmem,m.start);
     
     loc_t write_tcr_el1 = iter;
     debug("write_tcr_el1=%p",write_tcr_el1);
@@ -230,11 +260,11 @@ uint32_t ibootpatchfinder64_iOS14::get_el1_pagesize(){
     
     switch (TG0) {
         case 0b00:
-            return 0x1000;
+            return tspan.ret(0x1000);
         case 0b01:
-            return 0x10000;
+            return tspan.ret(0x10000);
         case 0b10:
-            return 0x4000;
+            return tspan.ret(0x4000);
         default:
             reterror("invalid TG0=%d",TG0);
     }
@@ -242,19 +272,23 @@ uint32_t ibootpatchfinder64_iOS14::get_el1_pagesize(){
 
 
 std::vector<patch> ibootpatchfinder64_iOS14::get_rw_and_x_mappings_patch_el1(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     uint32_t pagesize = get_el1_pagesize();
     
-    vmem iter(*_vmem);
+    //msr ttbr0_el1, x?; ...; ret
+    insnpattern msr_ttbr0_el1;
+    msr_ttbr0_el1.op(MSR_OPCODE, MSR_MASK, [](insn &i){ return i == insn::msr && i.special() == insn::ttbr0_el1;})
+                 .gap(insnpattern::kUnbounded).op(RET_OPCODE, RET_MASK, [](insn &i){ return i == insn::ret;});
 
-    while (++iter != insn::msr || iter().special() != insn::ttbr0_el1);
+    insnpattern::match m;
+    retassure(msr_ttbr0_el1.find(_vmem, 0, m), "failed to find msr ttbr0_el1");
     
-    loc_t write_ttbr0_el1 = iter;
+    loc_t write_ttbr0_el1 = m.start;
     debug("write_ttbr0_el1=%p",write_ttbr0_el1);
     
-    while (++iter != insn::ret);
-    loc_t write_ttbr0_el1_eof = iter;
+    loc_t write_ttbr0_el1_eof = m.end;
     debug("write_ttbr0_el1_eof=%p",write_ttbr0_el1_eof);
 
     uint32_t pageshift = pageshit_for_pagesize(pagesize);
@@ -352,25 +386,20 @@ std::vector<patch> ibootpatchfinder64_iOS14::get_rw_and_x_mappings_patch_el1(){
     patches.push_back({(loc_t)(cinsn*4),&loadaddr_block_entry,sizeof(loadaddr_block_entry)}); cinsn+=sizeof(loadaddr_block_entry)/4;
 
     uint32_t fullpatch_size = 0;
-    for (auto p: patches){
+    for (auto &p: patches){
         fullpatch_size += p._patchSize;
     }
     
     /*
      now find an empty spot for to place the payload
      */
-    loc_t nopspace = findnops(fullpatch_size/4 + 1, true); //alloc 1 more nop than we need
-    debug("nopspace=%p",nopspace);
-    
     /*
      ldp needs to load from 8 byte aligned address
      if needs_alignment is false, we start at 8 byte aligned address and the data is placed at 8 byte aligned
      if needs_alignmend is true, then we need to start at 8byte aligned + 4 for the data to be 8 byte aligned
      */
-    if (((nopspace & 0x4) && !needs_alignment /* we don't need alignment, but we start at an +4 address*/ )
-        || (((nopspace & 0x4) == 0) && needs_alignment) /* we are at 8 byte aligned, but we need fixup*/) {
-        nopspace+=4;
-    }
+    loc_t nopspace = findnops(fullpatch_size/4, true, 8, needs_alignment ? 4 : 0);
+    debug("nopspace=%p",nopspace);
     
     //now fixup payload addresses
     for (auto &p: patches){
@@ -394,5 +423,5 @@ std::vector<patch> ibootpatchfinder64_iOS14::get_rw_and_x_mappings_patch_el1(){
     }
     
     
-    return patches;
+    return tspan.ret(std::move(patches));
 }
@@ -0,0 +1,86 @@
+//
+//  imagefile.cpp
+//  liboffsetfinder64
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libgeneral/macros.h>
+
+#include "imagefile.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+#define READ_CHUNK 0x100000
+
+static imagefile::image readAll(int fd, size_t sizeHint){
+    imagefile::image ret = {};
+    uint8_t *buf = NULL;
+    size_t bufSize = sizeHint ? sizeHint : READ_CHUNK;
+    size_t didRead = 0;
+    cleanup([&]{
+        safeFree(buf);
+    })
+
+    assure(buf = (uint8_t*)malloc(bufSize));
+    while (true) {
+        if (didRead == bufSize) {
+            uint8_t *newbuf = NULL;
+            assure(newbuf = (uint8_t*)realloc(buf, bufSize *= 2));
+            buf = newbuf;
+        }
+        ssize_t cnt = read(fd, buf+didRead, bufSize-didRead);
+        if (cnt < 0 && errno == EINTR) continue;
+        retassure(cnt >= 0, "read failed with errno=%d", errno);
+        if (!cnt) break;
+        didRead += cnt;
+    }
+
+    ret.buf = buf; buf = NULL;
+    ret.size = didRead;
+    return ret;
+}
+
+imagefile::image imagefile::load(const char *filename){
+    int fd = -1;
+    struct stat fs = {};
+    cleanup([&]{
+        if (fd >= 0) close(fd);
+    })
+
+    retassure((fd = open(filename, O_RDONLY)) != -1, "failed to open %s", filename);
+    assure(!fstat(fd, &fs));
+
+    if (S_ISREG(fs.st_mode) && fs.st_size > 0) {
+        void *map = mmap(NULL, (size_t)fs.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            /*
+                The finders jump around (xrefs, bof walks), so no MADV_SEQUENTIAL which would drop pages behind us.
+                Let the kernel read ahead while we parse headers instead.
+             */
+            madvise(map, (size_t)fs.st_size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+            madvise(map, (size_t)fs.st_size, MADV_HUGEPAGE);
+#endif
+            return {(const uint8_t *)map, (size_t)fs.st_size, (size_t)fs.st_size};
+        }
+        debug("mmap of %s failed with errno=%d, reading it instead\n", filename, errno);
+    }
+
+    return readAll(fd, S_ISREG(fs.st_mode) ? (size_t)fs.st_size : 0);
+}
+
+void imagefile::release(const void *buf, size_t mappedSize){
+    if (!buf) return;
+    if (mappedSize) {
+        munmap((void*)buf, mappedSize);
+    }else{
+        free((void*)buf);
+    }
+}
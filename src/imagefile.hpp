@@ -0,0 +1,36 @@
+//
+//  imagefile.hpp
+//  liboffsetfinder64
+//
+
+#ifndef imagefile_hpp
+#define imagefile_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Loading images from disk.
+            Regular files are mapped MAP_PRIVATE and read only, so the image shares the page cache
+            and work can start before all of it was read. Pipes and other files, or a failing mmap, fall back to read().
+         */
+        namespace imagefile {
+            struct image{
+                const uint8_t *buf;
+                size_t size;
+                size_t mappedSize; //0 if buf came from malloc
+            };
+
+            image load(const char *filename);
+
+            /*
+                munmap or free, depending on how it was loaded
+             */
+            void release(const void *buf, size_t mappedSize);
+        };
+    };
+};
+
+#endif /* imagefile_hpp */
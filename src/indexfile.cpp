@@ -0,0 +1,201 @@
+//
+//  indexfile.cpp
+//  liboffsetfinder64
+//
+
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libgeneral/macros.h>
+
+#include "indexfile.hpp"
+#include "xrefindex.hpp"
+#include "callgraph.hpp"
+#include "functiontable.hpp"
+#include "stringindex.hpp"
+#include "caveallocator.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+#define INDEX_FORMAT    "3"
+#define INDEX_MAGIC     "OF64IDX" INDEX_FORMAT
+#define ENDIAN_TAG      0x01020304
+#define SECTION_ALIGN   64
+#define LIB_VERSION     "f" INDEX_FORMAT "-" VERSION_COMMIT_COUNT "-" VERSION_COMMIT_SHA
+
+/*
+    the tables go to disk as they are in memory.
+    Changing any of these layouts, or what the index builders put into them, needs a new INDEX_FORMAT.
+    LIB_VERSION carries it as well, since the commit info may be empty.
+ */
+static_assert(sizeof(xrefindex::xref) == 24, "xref layout changed");
+static_assert(sizeof(callgraph::edge) == 24, "edge layout changed");
+static_assert(sizeof(functiontable::anchor) == 16, "anchor layout changed");
+static_assert(sizeof(stringindex::entry) == 32, "string entry layout changed");
+static_assert(sizeof(caveallocator::run) == 16, "run layout changed");
+
+namespace {
+    struct fileHeader{
+        char magic[8];
+        uint32_t endianTag;
+        uint32_t sectionCnt;
+        uint64_t imageHash;
+        uint64_t imageSize;
+        char version[64];   //NUL padded
+    };
+
+    struct pendingSection{
+        indexfile::section id;
+        uint32_t elemSize;
+        const void *data;
+        uint64_t count;
+    };
+
+    template <typename T>
+    void addSection(std::vector<pendingSection> &secs, indexfile::section id, const column<T> &col){
+        secs.push_back({id, (uint32_t)sizeof(T), col.data(), col.size()});
+    }
+}
+
+//what this build expects, so a loaded file never fails half way through installing its indices
+static const struct{
+    indexfile::section id;
+    uint32_t elemSize;
+} kExpectedSections[] = {
+    {indexfile::kXrefs,             sizeof(xrefindex::xref)},
+    {indexfile::kCallsBySite,       sizeof(callgraph::edge)},
+    {indexfile::kCallsByTarget,     sizeof(callgraph::edge)},
+    {indexfile::kFunctionAnchors,   sizeof(functiontable::anchor)},
+    {indexfile::kFunctionRets,      sizeof(loc_t)},
+    {indexfile::kFunctionSegments,  sizeof(std::pair<loc_t, loc_t>)},
+    {indexfile::kStrings,           sizeof(stringindex::entry)},
+    {indexfile::kStringSlots,       sizeof(uint32_t)},
+    {indexfile::kStringUniqueCnt,   sizeof(uint64_t)},
+    {indexfile::kNopRuns,           sizeof(caveallocator::run)},
+    {indexfile::kZeroRuns,          sizeof(caveallocator::run)},
+    {indexfile::kStringTails,       sizeof(uint32_t)},
+};
+
+static bool hostIsLittleEndian(){
+    uint32_t tag = ENDIAN_TAG;
+    return *(const uint8_t *)&tag == 0x04;
+}
+
+static bool writeAll(FILE *f, const void *buf, size_t size){
+    return !size || fwrite(buf, 1, size, f) == size;
+}
+
+#pragma mark indexfile
+
+indexfile::indexfile(const char *path, uint64_t imageHash, uint64_t imageSize)
+: _file{}, _sections(NULL), _sectionCnt(0)
+{
+    static_assert(sizeof(sectionHeader) == 24, "section header layout changed");
+    retassure(hostIsLittleEndian(), "index files are little endian only");
+    _file = imagefile::load(path);
+    cleanup([&]{
+        if (!_sections) imagefile::release(_file.buf, _file.mappedSize);
+    })
+
+    const fileHeader *hdr = (const fileHeader *)_file.buf;
+    retassure(_file.size >= sizeof(fileHeader), "%s is too small", path);
+    retassure(!memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)), "%s is not an index file", path);
+    retassure(hdr->endianTag == ENDIAN_TAG, "%s has the wrong byte order", path);
+    retassure(hdr->imageHash == imageHash && hdr->imageSize == imageSize, "%s belongs to another image", path);
+    retassure(!strncmp(hdr->version, LIB_VERSION, sizeof(hdr->version)), "%s was written by library version %.64s", path, hdr->version);
+    retassure((_file.size - sizeof(fileHeader)) / sizeof(sectionHeader) >= hdr->sectionCnt, "%s has a truncated section table", path);
+
+    const sectionHeader *sections = (const sectionHeader *)(hdr+1);
+    for (uint32_t i=0; i<hdr->sectionCnt; i++) {
+        const sectionHeader &s = sections[i];
+        retassure(s.elemSize && s.offset % SECTION_ALIGN == 0 && s.offset <= _file.size
+                  && s.count <= (_file.size - s.offset) / s.elemSize, "%s has a damaged section %u", path, s.id);
+    }
+
+    _sectionCnt = hdr->sectionCnt;
+    _sections = sections;
+    try {
+        for (auto &e : kExpectedSections) {
+            size_t count = 0;
+            find(e.id, e.elemSize, count);
+        }
+    } catch (...) {
+        _sections = NULL;
+        throw;
+    }
+}
+
+indexfile::~indexfile(){
+    imagefile::release(_file.buf, _file.mappedSize);
+}
+
+const void *indexfile::find(section s, size_t elemSize, size_t &count) const{
+    for (uint32_t i=0; i<_sectionCnt; i++) {
+        if (_sections[i].id != s) continue;
+        retassure(_sections[i].elemSize == elemSize, "section %u has elements of %u bytes, expected %zu", s, _sections[i].elemSize, elemSize);
+        count = (size_t)_sections[i].count;
+        return _file.buf + _sections[i].offset;
+    }
+    reterror("no section %u in index file", s);
+}
+
+void indexfile::write(const char *path, uint64_t imageHash, uint64_t imageSize, const contents &c){
+    retassure(hostIsLittleEndian(), "index files are little endian only");
+    retassure(c.xrefs && c.calls && c.functions && c.strings && c.caves, "all indices need to be built");
+
+    std::vector<pendingSection> secs;
+    addSection(secs, kXrefs, c.xrefs->table());
+    addSection(secs, kCallsBySite, c.calls->bySite());
+    addSection(secs, kCallsByTarget, c.calls->byTarget());
+    addSection(secs, kFunctionAnchors, c.functions->anchors());
+    addSection(secs, kFunctionRets, c.functions->rets());
+    addSection(secs, kFunctionSegments, c.functions->segments());
+    addSection(secs, kStrings, c.strings->entries());
+    addSection(secs, kStringSlots, c.strings->slots());
+    uint64_t uniqueCnt = c.strings->uniqueCnt();
+    secs.push_back({kStringUniqueCnt, sizeof(uniqueCnt), &uniqueCnt, 1});
+    addSection(secs, kNopRuns, c.caves->runs(caveallocator::kNop));
+    addSection(secs, kZeroRuns, c.caves->runs(caveallocator::kZero));
+    addSection(secs, kStringTails, c.strings->tails());
+
+    fileHeader hdr = {};
+    memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.endianTag = ENDIAN_TAG;
+    hdr.sectionCnt = (uint32_t)secs.size();
+    hdr.imageHash = imageHash;
+    hdr.imageSize = imageSize;
+    strncpy(hdr.version, LIB_VERSION, sizeof(hdr.version));
+
+    std::vector<sectionHeader> table;
+    uint64_t offset = sizeof(hdr) + secs.size()*sizeof(sectionHeader);
+    for (auto &s : secs) {
+        offset = (offset + SECTION_ALIGN-1) & ~(uint64_t)(SECTION_ALIGN-1);
+        table.push_back({s.id, s.elemSize, offset, s.count});
+        offset += s.elemSize * s.count;
+    }
+
+    std::string tmp = std::string(path) + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    FILE *f = fopen(tmp.c_str(), "wb");
+    retassure(f, "failed to create %s errno=%d", tmp.c_str(), errno);
+
+    static const uint8_t zeros[SECTION_ALIGN] = {};
+    bool ok = writeAll(f, &hdr, sizeof(hdr)) && writeAll(f, table.data(), table.size()*sizeof(sectionHeader));
+    uint64_t pos = sizeof(hdr) + table.size()*sizeof(sectionHeader);
+    for (size_t i=0; ok && i<secs.size(); i++) {
+        ok = writeAll(f, zeros, table[i].offset - pos) && writeAll(f, secs[i].data, secs[i].elemSize * secs[i].count);
+        pos = table[i].offset + secs[i].elemSize * secs[i].count;
+    }
+    ok &= !fclose(f);
+    if (!ok || rename(tmp.c_str(), path)) {
+        unlink(tmp.c_str());
+        reterror("failed to write index file %s", path);
+    }
+}
@@ -0,0 +1,94 @@
+//
+//  indexfile.hpp
+//  liboffsetfinder64
+//
+
+#ifndef indexfile_hpp
+#define indexfile_hpp
+
+#include <stdint.h>
+
+#include "column.hpp"
+#include "imagefile.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        class xrefindex;
+        class callgraph;
+        class functiontable;
+        class stringindex;
+        class caveallocator;
+
+        /*
+            Derived indices of one image on disk, mapped read only and used in place.
+            Layout (little endian, v3):
+                header      magic, endian tag, section count, image hash and size, library version
+                sections    {id, element size, file offset, element count}
+                data        the index tables exactly as they are in memory, each 64 byte aligned
+            A file only loads for the image (and library version) it was written for.
+            Element sizes are checked against this build, hosts which are not little endian never load one.
+         */
+        class indexfile{
+        public:
+            enum section : uint32_t{
+                kXrefs = 1,
+                kCallsBySite,
+                kCallsByTarget,
+                kFunctionAnchors,
+                kFunctionRets,
+                kFunctionSegments,
+                kStrings,
+                kStringSlots,
+                kStringUniqueCnt,
+                kNopRuns,
+                kZeroRuns,
+                kStringTails
+            };
+            struct contents{
+                const xrefindex *xrefs;
+                const callgraph *calls;
+                const functiontable *functions;
+                const stringindex *strings;
+                const caveallocator *caves;
+            };
+        private:
+            struct sectionHeader{
+                uint32_t id;
+                uint32_t elemSize;
+                uint64_t offset;
+                uint64_t count;
+            };
+            imagefile::image _file;
+            const sectionHeader *_sections;
+            uint32_t _sectionCnt;
+
+            const void *find(section s, size_t elemSize, size_t &count) const;
+
+        public:
+            /*
+                throws if path is missing, damaged or was written for another image
+             */
+            indexfile(const char *path, uint64_t imageHash, uint64_t imageSize);
+            ~indexfile();
+            indexfile(const indexfile &) = delete;
+            indexfile &operator=(const indexfile &) = delete;
+
+            /*
+                section s in place, valid as long as this indexfile
+             */
+            template <typename T>
+            column<T> get(section s) const{
+                size_t count = 0;
+                const T *data = (const T *)find(s, sizeof(T), count);
+                return column<T>(data, count);
+            }
+
+            /*
+                writes to a temporary file next to path and renames it
+             */
+            static void write(const char *path, uint64_t imageHash, uint64_t imageSize, const contents &c);
+        };
+    };
+};
+
+#endif /* indexfile_hpp */
@@ -0,0 +1,218 @@
+//
+//  insnpattern.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <array>
+
+#include <string.h>
+
+#include <libgeneral/macros.h>
+
+#include "insnpattern.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace libinsn;
+
+#define kNoCapture 0xff
+
+insnpattern::insnpattern()
+: _pendingGapMin(0), _pendingGapMax(0), _anchor(0)
+{
+    //
+}
+
+insnpattern &insnpattern::op(uint32_t value, uint32_t mask, std::function<bool(insn &)> check){
+    retassure((value & mask) == value, "value 0x%08x has bits outside of mask 0x%08x", value, mask);
+    retassure(_elements.size() || !_pendingGapMax, "pattern can't start with a gap");
+    _elements.push_back({value, mask, _pendingGapMin, _pendingGapMax, 1, 1, {}, check});
+    _pendingGapMin = _pendingGapMax = 0;
+    compile();
+    return *this;
+}
+
+insnpattern &insnpattern::any(){
+    return op(0, 0);
+}
+
+insnpattern &insnpattern::gap(uint32_t max, uint32_t min){
+    retassure(min <= max, "bad gap %u..%u", min, max);
+    _pendingGapMin = min;
+    _pendingGapMax = max;
+    return *this;
+}
+
+insnpattern &insnpattern::repeat(uint32_t min, uint32_t max){
+    retassure(_elements.size(), "repeat without element");
+    retassure(min <= max && max, "bad repeat %u..%u", min, max);
+    _elements.back().repeatMin = min;
+    _elements.back().repeatMax = max;
+    compile();
+    return *this;
+}
+
+insnpattern &insnpattern::capture(field f, int slot){
+    retassure(_elements.size(), "capture without element");
+    retassure(slot >= 0 && slot < kMaxCaptures, "bad capture slot %d", slot);
+    _elements.back().fields.push_back({(uint8_t)f, (uint8_t)slot, true});
+    return *this;
+}
+
+insnpattern &insnpattern::same(field f, int slot){
+    retassure(_elements.size(), "same without element");
+    retassure(slot >= 0 && slot < kMaxCaptures, "bad capture slot %d", slot);
+    _elements.back().fields.push_back({(uint8_t)f, (uint8_t)slot, false});
+    return *this;
+}
+
+void insnpattern::compile(){
+    /*
+        The anchor is the most selective element which still sits at a fixed distance from the start,
+        so a raw word hit gives the candidate start directly.
+     */
+    int best = -1;
+    _anchor = 0;
+    for (size_t i=0; i<_elements.size(); i++) {
+        const element &e = _elements[i];
+        if (e.gapMin != e.gapMax) break;
+        if (e.repeatMin != 1 || e.repeatMax != 1) break;
+        int bits = __builtin_popcount(e.mask);
+        if (bits > best) {
+            best = bits;
+            _anchor = i;
+        }
+    }
+}
+
+bool insnpattern::test(const element &e, const segmentview &seg, size_t idx, uint8_t *regs) const{
+    uint32_t opcode = seg.words()[idx];
+    if ((opcode & e.mask) != e.value) return false;
+
+    for (auto &f : e.fields) {
+        if (f.capture || regs[f.slot] == kNoCapture) continue;
+        if (((opcode >> f.shift) & 0x1f) != regs[f.slot]) return false;
+    }
+
+    if (e.check) {
+        insn i(opcode, seg.base + idx*4);
+        if (!e.check(i)) return false;
+    }
+
+    for (auto &f : e.fields) {
+        if (f.capture || regs[f.slot] == kNoCapture) regs[f.slot] = (opcode >> f.shift) & 0x1f;
+    }
+    return true;
+}
+
+bool insnpattern::matchFrom(const segmentview &seg, size_t elem, size_t idx, size_t lastIdx, match &m) const{
+    if (elem == _elements.size()) {
+        m.end = seg.base + lastIdx*4;
+        return true;
+    }
+    const element &e = _elements[elem];
+    size_t wordCnt = seg.wordCnt();
+
+    for (uint64_t gap = e.gapMin; gap <= e.gapMax && idx+gap <= wordCnt; gap++) {
+        size_t pos = idx+gap;
+        uint8_t saved[kMaxCaptures];
+        memcpy(saved, m.regs, kMaxCaptures);
+
+        if (e.repeatMin == 1 && e.repeatMax == 1) {
+            if (pos < wordCnt && test(e, seg, pos, m.regs)) {
+                m.elements[elem] = {seg.base + pos*4, 1};
+                if (matchFrom(seg, elem+1, pos+1, pos, m)) return true;
+            }
+            memcpy(m.regs, saved, kMaxCaptures);
+            continue;
+        }
+
+        //collect the longest run, keeping the captures after every step
+        std::vector<std::array<uint8_t, kMaxCaptures>> states(1);
+        memcpy(states[0].data(), saved, kMaxCaptures);
+        while (states.size()-1 < e.repeatMax && pos+states.size()-1 < wordCnt) {
+            std::array<uint8_t, kMaxCaptures> regs = states.back();
+            if (!test(e, seg, pos+states.size()-1, regs.data())) break;
+            states.push_back(regs);
+        }
+
+        for (size_t cnt = states.size(); cnt-- > e.repeatMin;) {
+            memcpy(m.regs, states[cnt].data(), kMaxCaptures);
+            m.elements[elem] = {seg.base + pos*4, (uint32_t)cnt};
+            if (matchFrom(seg, elem+1, pos+cnt, cnt ? pos+cnt-1 : lastIdx, m)) return true;
+        }
+        memcpy(m.regs, saved, kMaxCaptures);
+    }
+    return false;
+}
+
+bool insnpattern::matchAt(const segmentview &seg, size_t idx, match &m) const{
+    m.start = seg.base + idx*4;
+    m.end = m.start;
+    m.elements.assign(_elements.size(), {0, 0});
+    memset(m.regs, kNoCapture, sizeof(m.regs));
+    return matchFrom(seg, 0, idx, idx, m);
+}
+
+bool insnpattern::matchAt(vmem *mem, loc_t pos, match &m) const{
+    retassure(_elements.size(), "empty pattern");
+    for (auto &seg : segmentviews(mem, vsegment::kVMPROTNONE)) {
+        if (pos < seg.base || pos >= seg.end()) continue;
+        return matchAt(seg, (pos-seg.base)/4, m);
+    }
+    return false;
+}
+
+bool insnpattern::find(vmem *mem, loc_t startAddr, match &m) const{
+    retassure(_elements.size(), "empty pattern");
+    const element &a = _elements[_anchor];
+
+    for (auto &seg : segmentviews(mem, vsegment::kVMPROTEXEC)) {
+        if (seg.end() <= startAddr) continue;
+        const uint32_t *words = seg.words();
+        size_t wordCnt = seg.wordCnt();
+        size_t first = (startAddr > seg.base) ? (startAddr - seg.base + 3)/4 : 0;
+
+        for (size_t i = first + _anchor; i < wordCnt; i++) {
+            if ((words[i] & a.mask) != a.value) continue;
+            if (matchAt(seg, i - _anchor, m)) return true;
+        }
+    }
+    return false;
+}
+
+std::vector<insnpattern::match> insnpattern::findAll(vmem *mem, size_t limit) const{
+    retassure(_elements.size(), "empty pattern");
+    std::vector<match> ret;
+
+    for (auto &seg : segmentviews(mem, vsegment::kVMPROTEXEC)) {
+        scan(seg, seg.wordCnt(), ret, limit);
+        if (limit && ret.size() >= limit) break;
+    }
+    return ret;
+}
+
+void insnpattern::scan(const segmentview &seg, size_t startCnt, std::vector<match> &out, size_t limit) const{
+    retassure(_elements.size(), "empty pattern");
+    const element &a = _elements[_anchor];
+    const uint32_t *words = seg.words();
+    size_t end = std::min(startCnt + _anchor, seg.wordCnt());
+    match m;
+
+    for (size_t i = _anchor; i < end; i++) {
+        if ((words[i] & a.mask) != a.value) continue;
+        if (!matchAt(seg, i - _anchor, m)) continue;
+        out.push_back(m);
+        if (limit && out.size() >= limit) return;
+    }
+}
+
+size_t insnpattern::maxLength() const{
+    uint64_t ret = 0;
+    for (auto &e : _elements) {
+        if (e.gapMax == kUnbounded || e.repeatMax == kUnbounded) return kUnbounded;
+        ret += (uint64_t)e.gapMax + e.repeatMax;
+    }
+    return ret;
+}
@@ -0,0 +1,134 @@
+//
+//  insnpattern.hpp
+//  liboffsetfinder64
+//
+
+#ifndef insnpattern_hpp
+#define insnpattern_hpp
+
+#include <vector>
+#include <functional>
+
+#include <stdint.h>
+
+#include <libinsn/insn.hpp>
+#include <libinsn/vmem.hpp>
+#include <liboffsetfinder64/common.h>
+#include "segmentview.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Masked ARM64 instruction sequence.
+            Every element is an opcode value/mask pair, optionally with register captures,
+            a bounded gap of arbitrary instructions before it, a repeat count and a decoded check.
+
+            The scan only tests the most selective mask on raw words,
+            everything else is matched at the candidates and libinsn decoding only happens there.
+
+                insnpattern p;
+                p.op(0x52800009, 0x7F80001F)                        //movz w9/x9
+                 .op(0x72800009, 0x7F80001F).repeat(0, 3)           //movk w9/x9
+                 .gap(8).op(0x39400000, 0xFFC00000).same(kRn, 0);   //ldrb through a captured register
+         */
+        class insnpattern{
+        public:
+            enum field{
+                kRd  = 0,
+                kRt  = 0,
+                kRn  = 5,
+                kRa  = 10,
+                kRt2 = 10,
+                kRm  = 16
+            };
+            static constexpr int kMaxCaptures = 8;
+            static constexpr uint32_t kUnbounded = (uint32_t)-1;
+
+            struct match{
+                loc_t start;    //first matched instruction
+                loc_t end;      //last matched instruction
+                std::vector<std::pair<loc_t, uint32_t>> elements; //first location and repeat count per element
+                uint8_t regs[kMaxCaptures];
+            };
+
+        private:
+            struct fieldop{
+                uint8_t shift;
+                uint8_t slot;
+                bool capture;   //false means compare against the slot
+            };
+            struct element{
+                uint32_t value;
+                uint32_t mask;
+                uint32_t gapMin;
+                uint32_t gapMax;
+                uint32_t repeatMin;
+                uint32_t repeatMax;
+                std::vector<fieldop> fields;
+                std::function<bool(tihmstar::libinsn::insn &)> check;
+            };
+            std::vector<element> _elements;
+            uint32_t _pendingGapMin;
+            uint32_t _pendingGapMax;
+            size_t _anchor;
+
+            void compile();
+            bool test(const element &e, const segmentview &seg, size_t idx, uint8_t *regs) const;
+            bool matchFrom(const segmentview &seg, size_t elem, size_t idx, size_t lastIdx, match &m) const;
+            bool matchAt(const segmentview &seg, size_t idx, match &m) const;
+
+        public:
+            insnpattern();
+
+            /*
+                next instruction, (opcode & mask) == value.
+                check is called with the decoded instruction once the mask matched.
+             */
+            insnpattern &op(uint32_t value, uint32_t mask, std::function<bool(tihmstar::libinsn::insn &)> check = nullptr);
+            insnpattern &any();
+
+            /*
+                between min and max arbitrary instructions before the next element, shortest first
+             */
+            insnpattern &gap(uint32_t max, uint32_t min = 0);
+
+            /*
+                the last element matches between min and max times in a row, longest first
+             */
+            insnpattern &repeat(uint32_t min, uint32_t max);
+
+            /*
+                store a register field of the last element in slot,
+                or require it to equal what was stored before
+             */
+            insnpattern &capture(field f, int slot);
+            insnpattern &same(field f, int slot);
+
+            size_t size() const { return _elements.size();}
+
+            /*
+                most instructions a match can span, kUnbounded if a gap or repeat has no limit
+             */
+            size_t maxLength() const;
+
+            /*
+                match starting exactly at pos
+             */
+            bool matchAt(tihmstar::libinsn::vmem *mem, loc_t pos, match &m) const;
+
+            /*
+                first match starting at or after startAddr in the executable segments
+             */
+            bool find(tihmstar::libinsn::vmem *mem, loc_t startAddr, match &m) const;
+            std::vector<match> findAll(tihmstar::libinsn::vmem *mem, size_t limit = 0) const;
+
+            /*
+                matches which start in the first startCnt words of seg, appended in address order.
+                Words past startCnt are only read, e.g. the overlap of a parallelscan chunk.
+             */
+            void scan(const segmentview &seg, size_t startCnt, std::vector<match> &out, size_t limit = 0) const;
+        };
+    };
+};
+
+#endif /* insnpattern_hpp */
@@ -10,32 +10,54 @@
 
 #include "kernelpatchfinder64.hpp"
 #include "all_liboffsetfinder.hpp"
+#include "insnpattern.hpp"
+#include "parallelscan.hpp"
+#include "tracer.hpp"
 
 using namespace std;
 using namespace tihmstar;
 using namespace offsetfinder64;
 using namespace libinsn;
 
+#define MOVZ_MASK       0x7F800000
+#define MOVZ_OPCODE     0x52800000
+#define MADD_MASK       0x7FE08000
+#define MADD_OPCODE     0x1B000000
+#define LDRB_MASK       0xFEC00000 //all addressing modes
+#define LDRB_OPCODE     0x38400000
+#define CMP_MASK        0x6000001F //subs, rd = zr
+#define CMP_OPCODE      0x6000001F
+#define CMP_IMM_MASK    0x7FFFFC1F
+#define CMP_IMM_OPCODE  0x7100001F
+#define MRS_TPIDR_EL1_MASK      0xFFFFFFE0
+#define MRS_TPIDR_EL1_OPCODE    0xD538D080
+
+static std::function<bool(insn &)> isType(enum insn::type t){
+    return [t](insn &i){ return i == t;};
+}
+
 
-kernelpatchfinder64::kernelpatchfinder64(const char *filename)
-    : machopatchfinder64(filename)
+kernelpatchfinder64::kernelpatchfinder64(const char *filename, int cputype, int cpusubtype)
+    : machopatchfinder64(filename, cputype, cpusubtype)
 {
     //
 }
 
-kernelpatchfinder64::kernelpatchfinder64(const void *buffer, size_t bufSize)
-    : machopatchfinder64(buffer,bufSize)
+kernelpatchfinder64::kernelpatchfinder64(const void *buffer, size_t bufSize, int cputype, int cpusubtype)
+    : machopatchfinder64(buffer,bufSize,cputype,cpusubtype)
 {
     //
 }
 
 loc_t kernelpatchfinder64::find_syscall0(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     constexpr char sig_syscall_3[] = "\x06\x00\x00\x00\x03\x00\x0c\x00";
-    loc_t sys3 = _vmem->memmem(sig_syscall_3, sizeof(sig_syscall_3)-1);
-    return sys3 - (3 * 0x18) + 0x8;
+    loc_t sys3 = memmem(sig_syscall_3, sizeof(sig_syscall_3)-1);
+    return tspan.ret(sys3 - (3 * 0x18) + 0x8);
 }
 
 loc_t kernelpatchfinder64::find_machtrap_table(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     loc_t table = 0;
     
     vmem iter(*_vmem, 0, vsegment::kVMPROTNONE);
@@ -68,24 +90,31 @@ loc_t kernelpatchfinder64::find_machtrap_table(){
         }
     }
 foundpos:
-    return table;
+    return tspan.ret(table);
 }
 
 
 loc_t kernelpatchfinder64::find_function_for_syscall(int syscall){
+    tracespan tspan(_tracer, "finder", __FUNCTION__, "syscall", syscall);
     loc_t syscallTable = find_syscall0();
     loc_t tableEntry = (syscallTable + 3*(syscall-1)*sizeof(uint64_t));
-    return _vmem->deref(tableEntry);
+    return tspan.ret(_vmem->deref(tableEntry));
 }
 
 loc_t kernelpatchfinder64::find_function_for_machtrap(int trapcall){
+    tracespan tspan(_tracer, "finder", __FUNCTION__, "trapcall", trapcall);
     loc_t machtrapTable = find_machtrap_table();
     loc_t tableEntry =machtrapTable + 4*8*trapcall;
-    return _vmem->deref(tableEntry);
+    return tspan.ret(_vmem->deref(tableEntry));
 }
 
 
 loc_t kernelpatchfinder64::find_kerneltask(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
+    loc_t kernel_task = 0;
+    cachequery cq;
+    if (cacheLookup(cq, __FUNCTION__, "", kernel_task)) return tspan.ret(kernel_task);
+
     loc_t strloc = findstr("current_task() == kernel_task", true);
     debug("strloc=%p\n",strloc);
     
@@ -96,8 +125,6 @@ loc_t kernelpatchfinder64::find_kerneltask(){
     debug("bof=%p\n",bof);
     
     vmem iter(*_vmem,bof);
-
-    loc_t kernel_task = 0;
     
     do{
         if (++iter == insn::mrs) {
@@ -121,7 +148,7 @@ loc_t kernelpatchfinder64::find_kerneltask(){
                         case insn::cmp:
                             if ((kernelreg == iter2().rm() && xreg == iter2().rn())
                                 || (xreg == iter2().rm() && kernelreg == iter2().rn())) {
-                                return kernel_task;
+                                return tspan.ret(cacheStore(cq, kernel_task));
                             }
                             break;
                         default:
@@ -137,13 +164,14 @@ loc_t kernelpatchfinder64::find_kerneltask(){
 
 
 std::vector<patch> kernelpatchfinder64::get_MarijuanARM_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
     constexpr char release_arm[] = "RELEASE_ARM";
     constexpr char marijuanarm[] = "MarijuanARM";
 
     loc_t strloc = -1;
     try {
-        while ((strloc = _vmem->memmem(release_arm, sizeof(release_arm)-1, strloc+1))) {
+        while ((strloc = memmem(release_arm, sizeof(release_arm)-1, strloc+1))) {
             patches.push_back({strloc,marijuanarm,sizeof(marijuanarm)-1});
         }
     } catch (...) {
@@ -153,11 +181,14 @@ std::vector<patch> kernelpatchfinder64::get_MarijuanARM_patch(){
     //everything is fine as long as we found at least one instance
     retassure(patches.size(), "Not a single instance of %s was found",release_arm);
     
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> kernelpatchfinder64::get_task_conversion_eval_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
+    cachequery cq;
+    if (cacheLookup(cq, __FUNCTION__, "", patches)) return tspan.ret(std::move(patches));
 
     /*
      if (caller == kernel_task) {
@@ -192,82 +223,82 @@ std::vector<patch> kernelpatchfinder64::get_task_conversion_eval_patch(){
     loc_t kernel_task = find_kerneltask();
     debug("kernel_task=%p\n",kernel_task);
 
-    vmem iter(*_vmem);
-    
-    while (true) {
-        try {
-            ++iter;
-        } catch (out_of_range &e) {
-            break;
-        }
+    //every mrs is checked on its own and the lookahead reads through _vmem, so chunks need no overlap
+    patches = parallelscan::scan<patch>(_vmem, 0, [&](const parallelscan::chunk &c, std::vector<patch> &out){
+        const uint32_t *words = c.view.words();
+        for (size_t w=0; w<c.startCnt; w++) {
+            if ((words[w] & MRS_TPIDR_EL1_MASK) != MRS_TPIDR_EL1_OPCODE) continue;
+            vmem iter(*_vmem, c.view.base + w*4);
+
+            if (iter() == insn::mrs && iter().special() == insn::systemreg::tpidr_el1) {
+                vmem iter2(iter,(loc_t)iter);
+                int8_t regtpidr = iter().rt();
+                int8_t regThisTask = -1;
+                      
+                int cntCmp = 0;
         
-        if (iter() == insn::mrs && iter().special() == insn::systemreg::tpidr_el1) {
-            vmem iter2(iter,(loc_t)iter);
-            int8_t regtpidr = iter().rt();
-            int8_t regThisTask = -1;
-                          
-            int cntCmp = 0;
-            
-            for (int i=0; i<100; i++) {
-                switch ((++iter2).type()) {
-                    case insn::ldr:
-                        if (iter2().rn() == regtpidr) {
-                            regThisTask = iter2().rt();
-                        }
-                        break;
-                    case insn::ccmp:
-                        if (iter2().special() != 0x4) break;
-                        //intentionally fall through
-                    case insn::cmp:
-                        if (cntCmp > 0) cntCmp++;
-                        if (iter2().subtype() == insn::st_register) {
-                            int8_t regKernelTask = -1;
-                            if (iter2().rm() == regThisTask) {
-                                regKernelTask = iter2().rn();
-                            }else if (iter2().rn() == regThisTask){
-                                regKernelTask = iter2().rm();
-                            }else{
-                                break; //false alarm
+                for (int i=0; i<100; i++) {
+                    switch ((++iter2).type()) {
+                        case insn::ldr:
+                            if (iter2().rn() == regtpidr) {
+                                regThisTask = iter2().rt();
                             }
-                            if (cntCmp == 0) cntCmp++;
-
-                            loc_t bof = find_bof(iter2);
-                            if (bof > iter) { //sanity check
-                                //we cross function boundaries, probaly this is not what we are looking for
-                                break;
+                            break;
+                        case insn::ccmp:
+                            if (iter2().special() != 0x4) break;
+                            //intentionally fall through
+                        case insn::cmp:
+                            if (cntCmp > 0) cntCmp++;
+                            if (iter2().subtype() == insn::st_register) {
+                                int8_t regKernelTask = -1;
+                                if (iter2().rm() == regThisTask) {
+                                    regKernelTask = iter2().rn();
+                                }else if (iter2().rn() == regThisTask){
+                                    regKernelTask = iter2().rm();
+                                }else{
+                                    break; //false alarm
+                                }
+                                if (cntCmp == 0) cntCmp++;
+
+                                loc_t bof = find_bof(iter2);
+                                if (bof > iter) { //sanity check
+                                    //we cross function boundaries, probaly this is not what we are looking for
+                                    break;
+                                }
+                        
+                                uint64_t cmpVal = find_register_value(iter2, regKernelTask, iter);                            
+                                if (cmpVal == kernel_task && cntCmp == 2 && iter2() == insn::ccmp) {
+                                    debug("get_task_conversion_eval_patch: patchloc=%p\n",(void*)(loc_t)iter2);
+                                    insn pins = insn::new_register_ccmp(iter2, iter2().condition(), iter2().special(), iter2().rn(), iter2().rn());
+                                    uint32_t opcode = pins.opcode();
+                                    out.push_back({(loc_t)pins.pc(), &opcode, 4});
+                                    goto loop_continue;
+                                }
                             }
-                            
-                            uint64_t cmpVal = find_register_value(iter2, regKernelTask, iter);                            
-                            if (cmpVal == kernel_task && cntCmp == 2 && iter2() == insn::ccmp) {
-                                debug("%s: patchloc=%p\n",__FUNCTION__,(void*)(loc_t)iter2);
-                                insn pins = insn::new_register_ccmp(iter2, iter2().condition(), iter2().special(), iter2().rn(), iter2().rn());
-                                uint32_t opcode = pins.opcode();
-                                patches.push_back({(loc_t)pins.pc(), &opcode, 4});
-                                goto loop_continue;
+                            break;
+                        case insn::ret:
+                            goto loop_continue;
+                        default:
+                            try {
+                                if (iter2().rt() == regtpidr) regtpidr = -1;
+                                if (iter2().rt() == regThisTask) regThisTask = -1;
+                            } catch (...) {
+                                //
                             }
-                        }
-                        break;
-                    case insn::ret:
-                        goto loop_continue;
-                    default:
-                        try {
-                            if (iter2().rt() == regtpidr) regtpidr = -1;
-                            if (iter2().rt() == regThisTask) regThisTask = -1;
-                        } catch (...) {
-                            //
-                        }
-                        break;
+                            break;
+                    }
                 }
             }
+        loop_continue:
+            continue;
         }
-    loop_continue:
-        continue;
-    }
+    });
     
-    return patches;
+    return tspan.ret(cacheStore(cq, std::move(patches)));
 }
 
 std::vector<patch> kernelpatchfinder64::get_vm_fault_internal_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     loc_t str = _vmem->memstr("\"Write fault on compressor map, va: %p type: %u bounds: %p->%p");
@@ -277,9 +308,14 @@ std::vector<patch> kernelpatchfinder64::get_vm_fault_internal_patch(){
     debug("ref=%p\n",ref);
 
     
-    vmem iter(*_vmem,ref);
-    
-    while (++iter != insn::cmp || iter().imm() != 6 || iter-1 != insn::and_);
+    insnpattern and_cmp6;
+    and_cmp6.op(0, 0, isType(insn::and_))
+            .op(CMP_IMM_OPCODE | (6 << 10), CMP_IMM_MASK, [](insn &i){ return i == insn::cmp && i.imm() == 6;});
+
+    insnpattern::match m;
+    retassure(and_cmp6.find(_vmem, ref, m), "failed to find and + cmp #6 after ref");
+
+    vmem iter(*_vmem,m.end);
     ++iter;
     
     loc_t pos = iter;
@@ -291,49 +327,53 @@ std::vector<patch> kernelpatchfinder64::get_vm_fault_internal_patch(){
         patches.push_back({iter, &opcode, 4});
     }
 
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> kernelpatchfinder64::get_trustcache_true_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
+    cachequery cq;
+    if (cacheLookup(cq, __FUNCTION__, "", patches)) return tspan.ret(std::move(patches));
 
-    vmem iter(*_vmem);
-
+    /*
+        movz
+        ?
+        madd
+        14x { ldrb; ldrb; cmp; b.cond/cbz/tbz/...; madd }
+     */
+    insnpattern ladder;
+    ladder.op(MOVZ_OPCODE, MOVZ_MASK, isType(insn::movz))
+          .any()
+          .op(MADD_OPCODE, MADD_MASK, isType(insn::madd));
+    for (int i=0; i<14; i++) {
+        ladder.op(LDRB_OPCODE, LDRB_MASK, isType(insn::ldrb))
+              .op(LDRB_OPCODE, LDRB_MASK, isType(insn::ldrb))
+              .op(CMP_OPCODE, CMP_MASK, isType(insn::cmp))
+              .op(0, 0, [](insn &i){ return i.supertype() == insn::sut_branch_imm;})
+              .op(MADD_OPCODE, MADD_MASK, isType(insn::madd));
+    }
 
-    try {
-        for (int z=0;;z++) {
-inloop:
-            while (++iter != insn::madd);
-            vmem iter2(*_vmem,iter);
-            
-            for (int i=0; i<14; i++) {
-                if (++iter2 != insn::ldrb) goto inloop;
-                if (++iter2 != insn::ldrb) goto inloop;
-                if (++iter2 != insn::cmp) goto inloop;
-                if ((++iter2).supertype() != insn::sut_branch_imm) goto inloop;
-                if (++iter2 != insn::madd) goto inloop;
-            }
-            iter2 = vmem(*_vmem,iter);
-            --iter2;
-            if (--iter2 != insn::movz) goto inloop;
+    auto matches = parallelscan::scan<insnpattern::match>(_vmem, ladder.maxLength(), [&](const parallelscan::chunk &c, std::vector<insnpattern::match> &out){
+        ladder.scan(c.view, c.startCnt, out);
+    });
 
-            loc_t found = iter2;
-            debug("found=%p\n",found);
-            
-            constexpr char patch[] = "\x20\x00\x80\xD2\xC0\x03\x5F\xD6";
-            patches.push_back({found,patch,sizeof(patch)-1});
-        }
-    } catch (...) {
-        //
+    for (auto &m : matches) {
+        loc_t found = m.start;
+        debug("found=%p\n",found);
+        
+        constexpr char patch[] = "\x20\x00\x80\xD2\xC0\x03\x5F\xD6";
+        patches.push_back({found,patch,sizeof(patch)-1});
     }
 
     assure(patches.size()); //need at least one
    
     
-    return patches;
+    return tspan.ret(cacheStore(cq, std::move(patches)));
 }
 
 std::vector<patch> kernelpatchfinder64::get_mount_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     loc_t mount = find_function_for_syscall(167);
@@ -399,10 +439,11 @@ std::vector<patch> kernelpatchfinder64::get_mount_patch(){
 
     patches.push_back({iter, "\x1F\x00\x00\xEB" /* cmp x0, x0 */, 4});
     
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 std::vector<patch> kernelpatchfinder64::get_tfp0_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     loc_t get_task_for_pid = find_function_for_machtrap(45);
@@ -418,11 +459,15 @@ std::vector<patch> kernelpatchfinder64::get_tfp0_patch(){
 
     patches.push_back({p1,"\x1F\x20\x03\xD5",4});
     
-    return patches;
+    return tspan.ret(std::move(patches));
 };
 
 std::vector<patch> kernelpatchfinder64::get_amfi_patch(bool doApplyPatch){
+    tracespan tspan(_tracer, "finder", __FUNCTION__, "doApplyPatch", doApplyPatch);
     std::vector<patch> patches;
+    cachequery cq;
+    //without doApplyPatch the cave isn't reserved, so a stored result could point at one which is taken by now
+    if (doApplyPatch && cacheLookup(cq, __FUNCTION__, std::to_string(doApplyPatch), patches)) return tspan.ret(std::move(patches));
     
     loc_t amfi_str = findstr("AMFI: hook..execve() killing pid %u: %s\n", true);
     debug("amfi_str=%p\n",amfi_str);
@@ -480,11 +525,12 @@ std::vector<patch> kernelpatchfinder64::get_amfi_patch(bool doApplyPatch){
     debug("p2=%p\n",(loc_t)iter);
     patches.push_back({iter, "\x1F\x00\x00\x6B", 4});
     
-    return patches;
+    return tspan.ret(cacheStore(cq, std::move(patches)));
 }
 
 
 std::vector<patch> kernelpatchfinder64::get_get_task_allow_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     loc_t amif_str = findstr("AMFI: ", false);
@@ -537,10 +583,11 @@ std::vector<patch> kernelpatchfinder64::get_get_task_allow_patch(){
 
     patches.push_back({p1,patch,sizeof(patch)-1});
 
-    return patches;
+    return tspan.ret(std::move(patches));
 };
 
 std::vector<patch> kernelpatchfinder64::get_apfs_snapshot_patch(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     std::vector<patch> patches;
 
     loc_t os_update_str = findstr("com.apple.os.update-",true);
@@ -564,7 +611,7 @@ std::vector<patch> kernelpatchfinder64::get_apfs_snapshot_patch(){
 //    constexpr char patch_nop[] = "\x1F\x20\x03\xD5";
 //    patches.push_back({iter,patch_nop,sizeof(patch_nop)-1});
     
-    return patches;
+    return tspan.ret(std::move(patches));
 }
 
 
@@ -1427,10 +1474,12 @@ std::vector<patch> kernelpatchfinder64::get_apfs_snapshot_patch(){
 //}
 //
 loc_t kernelpatchfinder64::find_rootvnode() {
-    return find_sym("_rootvnode");
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
+    return tspan.ret(find_sym("_rootvnode"));
 }
 
 loc_t kernelpatchfinder64::find_allproc(){
+    tracespan tspan(_tracer, "finder", __FUNCTION__);
     loc_t str = findstr("\"pgrp_add : pgrp is dead adding process\"",true);
     retassure(str, "Failed to find str");
     
@@ -1443,6 +1492,6 @@ loc_t kernelpatchfinder64::find_allproc(){
     
     loc_t retval = (loc_t)find_register_value(ptr-2, 8);
     
-    return retval;
+    return tspan.ret(retval);
 }
 
@@ -14,6 +14,7 @@
 #include <arpa/inet.h>
 
 #include <mach-o/loader.h>
+#include <mach-o/fat.h>
 #include <mach-o/nlist.h>
 
 #include <libgeneral/macros.h>
@@ -24,10 +25,23 @@
 #endif //HAVE_IMG4TOOL
 
 #include "machopatchfinder64.hpp"
+#include "stringindex.hpp"
+#include "symbolindex.hpp"
+#include "tracer.hpp"
 
 using namespace tihmstar::offsetfinder64;
 using namespace tihmstar::libinsn;
 
+#ifndef CPU_SUBTYPE_MASK
+#define CPU_SUBTYPE_MASK 0xff000000
+#endif
+#ifndef CPU_SUBTYPE_ARM64E
+#define CPU_SUBTYPE_ARM64E 2
+#endif
+#ifndef ntohll
+#define ntohll(x) (((uint64_t)ntohl((uint32_t)(x)) << 32) | ntohl((uint32_t)((x) >> 32)))
+#endif
+
 #pragma mark macho external
 
 __attribute__((always_inline)) struct load_command *find_load_command64(struct mach_header_64 *mh, uint32_t lc){
@@ -62,14 +76,9 @@ __attribute__((always_inline)) struct section_64 *find_section(struct segment_co
 #pragma mark macho local
 
 __attribute__((always_inline)) struct symtab_command *machopatchfinder64::getSymtab(){
+    //looked up in init(), so concurrent callers only ever read it
     if (!__symtab){
-        try {
-            __symtab = find_symtab_command((struct mach_header_64 *)_buf);
-        } catch (tihmstar::load_command_not_found &e) {
-            if (e.cmd() != LC_SYMTAB)
-                throw;
-            retcustomerror(symtab_not_found, "symtab not found. Is this a dumped kernel?");
-        }
+        retcustomerror(symtab_not_found, "symtab not found. Is this a dumped kernel?");
     }
     return __symtab;
 }
@@ -129,70 +138,97 @@ void machopatchfinder64::loadSegments(){
     printf("\n");
 }
 
-void machopatchfinder64::init(){
-    if (*(uint32_t*)_buf == 0xbebafeca || *(uint32_t*)_buf == 0xcafebabe) {
-        bool swap = *(uint32_t*)_buf == 0xbebafeca;
-    
-        uint8_t* tryfat = [=]() -> uint8_t* {
-            // just select first slice
-            uint32_t* kdata32 = (uint32_t*) _buf;
-            uint32_t narch = kdata32[1];
-            if (swap) narch = ntohl(narch);
-    
-            if (narch != 1) {
-                printf("expected 1 arch in fat file, got %u\n", narch);
-                return NULL;
-            }
-    
-            uint32_t offset = kdata32[2 + 2];
-            if (swap) offset = ntohl(offset);
-    
-            if (offset != sizeof(uint32_t)*(2 + 5)) {
-                printf("wat, file offset not sizeof(fat_header) + sizeof(fat_arch)?!\n");
-            }
-    
-            uint32_t filesize = kdata32[2 + 3];
-            if (swap) filesize = ntohl(filesize);
-    
-            uint8_t *ret = (uint8_t*) malloc(filesize);
-            if (ret != NULL) {
-                memcpy(ret, _buf + offset, filesize);
-            }
-            return ret;
-        }();
-    
-        if (tryfat) {
-            printf("got fat macho with first slice at %u\n", (uint32_t) (tryfat - _buf));
-            if (_freeBuf) {
-                free((void*)_buf);
-            }
-            _freeBuf = true;
-            _buf = tryfat;tryfat = NULL;
-        } else {
-            printf("got fat macho but failed to parse\n");
+void machopatchfinder64::selectFatSlice(int cputype, int cpusubtype){
+    const uint8_t *fat = _buf;
+    retassure(_bufSize >= sizeof(struct fat_header), "truncated fat header");
+    uint32_t magic = ntohl(((const struct fat_header *)fat)->magic);
+    uint32_t narch = ntohl(((const struct fat_header *)fat)->nfat_arch);
+    bool is64 = magic == FAT_MAGIC_64;
+    size_t archSize = is64 ? sizeof(struct fat_arch_64) : sizeof(struct fat_arch);
+    retassure(sizeof(struct fat_header) + (uint64_t)narch*archSize <= _bufSize, "truncated fat header with %u archs", narch);
+
+    int best = -1;
+    uint64_t bestOffset = 0;
+    uint64_t bestSize = 0;
+    for (uint32_t i=0; i<narch; i++) {
+        const uint8_t *arch = fat + sizeof(struct fat_header) + i*archSize;
+        int archType = 0;
+        int archSubtype = 0;
+        uint64_t offset = 0;
+        uint64_t size = 0;
+        if (is64) {
+            const struct fat_arch_64 *a = (const struct fat_arch_64 *)arch;
+            archType = (int)ntohl(a->cputype);
+            archSubtype = (int)ntohl(a->cpusubtype) & ~CPU_SUBTYPE_MASK;
+            offset = ntohll(a->offset);
+            size = ntohll(a->size);
+        }else{
+            const struct fat_arch *a = (const struct fat_arch *)arch;
+            archType = (int)ntohl(a->cputype);
+            archSubtype = (int)ntohl(a->cpusubtype) & ~CPU_SUBTYPE_MASK;
+            offset = ntohl(a->offset);
+            size = ntohl(a->size);
+        }
+        debug("fat slice %u: cputype=0x%x cpusubtype=0x%x offset=0x%llx size=0x%llx\n", i, archType, archSubtype, offset, size);
+
+        if (archType != cputype) continue;
+        if (cpusubtype != kCPUSubtypeAny && archSubtype != cpusubtype) continue;
+        if (offset > _bufSize || size > _bufSize - offset) {
+            printf("fat slice %u is out of bounds, skipping it\n", i);
+            continue;
+        }
+        bool preferred = cpusubtype == kCPUSubtypeAny && cputype == kCPUTypeARM64 && archSubtype == CPU_SUBTYPE_ARM64E;
+        if (best == -1 || preferred) {
+            best = i;
+            bestOffset = offset;
+            bestSize = size;
+            if (preferred || cpusubtype != kCPUSubtypeAny) break;
         }
     }
+    retassure(best != -1, "fat file has no slice for cputype=0x%x cpusubtype=0x%x", cputype, cpusubtype);
+    printf("got fat macho, using slice %d at 0x%llx\n", best, bestOffset);
+
+    //no copy, _buf points into the file and releaseBuf() still releases the whole thing
+    if (!_ownedBuf) _ownedBuf = _buf;
+    _buf += bestOffset;
+    _bufSize = bestSize;
+}
+
+void machopatchfinder64::init(int cputype, int cpusubtype){
+    retassure(_bufSize >= sizeof(uint32_t), "buffer too small");
+    uint32_t fatMagic = ntohl(*(uint32_t*)_buf);
+    if (fatMagic == FAT_MAGIC || fatMagic == FAT_MAGIC_64) {
+        selectFatSlice(cputype, cpusubtype);
+    }
     
+    retassure(_bufSize >= sizeof(struct mach_header_64), "buffer too small");
     assure(*(uint32_t*)_buf == 0xfeedfacf);
     
+    //before loadSegments(), which already asks getSymtab()
+    try {
+        __symtab = find_symtab_command((struct mach_header_64 *)_buf);
+    } catch (tihmstar::load_command_not_found &e) {
+        if (e.cmd() != LC_SYMTAB)
+            throw;
+        //no symbols, getSymtab() will complain
+    }
+
     loadSegments();
 }
 
 
-machopatchfinder64::machopatchfinder64(const char *filename) :
+machopatchfinder64::machopatchfinder64(const char *filename, int cputype, int cpusubtype) :
     patchfinder64(true),
-    __symtab(NULL)
+    __symtab(NULL),
+    _symbols(NULL)
 {
-    struct stat fs = {0};
-    int fd = 0;
     bool didConstructSuccessfully = false;
 #ifdef HAVE_IMG4TOOL
     img4tool::ASN1DERElement *img4tmp = NULL;
 #endif //HAVE_IMG4TOOL
     cleanup([&]{
-        if (fd>0) close(fd);
         if (!didConstructSuccessfully) {
-            safeFreeConst(_buf);
+            releaseBuf();
         }
 #ifdef HAVE_IMG4TOOL
         if (img4tmp) {
@@ -201,10 +237,7 @@ machopatchfinder64::machopatchfinder64(const char *filename) :
 #endif //HAVE_IMG4TOOL
     })
     
-    assure((fd = open(filename, O_RDONLY)) != -1);
-    assure(!fstat(fd, &fs));
-    assure((_buf = (uint8_t*)malloc( _bufSize = fs.st_size)));
-    assure(read(fd,(void*)_buf,_bufSize)==_bufSize);
+    loadFile(filename);
     
     
 #ifdef HAVE_IMG4TOOL
@@ -222,8 +255,9 @@ machopatchfinder64::machopatchfinder64(const char *filename) :
             *img4tmp = img4tool::getPayloadFromIM4P(*img4tmp);
             
             assure(img4tmp->ownsBuffer());
-            free((void*)_buf);
+            releaseBuf();
             
+            _freeBuf = true;
             assure(_buf = (uint8_t*)malloc(_bufSize = img4tmp->payloadSize()));
             memcpy((void*)_buf, img4tmp->payload(), _bufSize);
         }
@@ -232,44 +266,102 @@ machopatchfinder64::machopatchfinder64(const char *filename) :
     printf("Warning: compiled without img4tool, extracting from IMG4/IM4P disabled!\n");
 #endif //HAVE_IMG4TOOL
 
-    init();
+    init(cputype, cpusubtype);
 
     didConstructSuccessfully = true;
 }
 
-machopatchfinder64::machopatchfinder64(const void *buffer, size_t bufSize) :
+machopatchfinder64::machopatchfinder64(const void *buffer, size_t bufSize, int cputype, int cpusubtype) :
 patchfinder64(false),
-__symtab(NULL)
+__symtab(NULL),
+_symbols(NULL)
 {
     _bufSize = bufSize;
     _buf = (uint8_t*)buffer;
-    init();
+    init(cputype, cpusubtype);
 }
 
+machopatchfinder64::~machopatchfinder64(){
+    if (_symbolsBuilder.valid()) {
+        //the builder reads _buf, which goes away with us
+        try {
+            _symbols = _symbolsBuilder.get();
+        } catch (...) {
+            //
+        }
+    }
+    if (_symbols) delete _symbols;
+}
 
 
-loc_t machopatchfinder64::find_sym(const char *sym){
-    const uint8_t *psymtab = _buf + getSymtab()->symoff;
-    const uint8_t *pstrtab = _buf + getSymtab()->stroff;
-    
-    struct nlist_64 *entry = (struct nlist_64 *)psymtab;
-    for (uint32_t i = 0; i < getSymtab()->nsyms; i++, entry++)
-        if (!strcmp(sym, (char*)(pstrtab + entry->n_un.n_strx)))
-            return (loc_t)entry->n_value;
-    
-    retcustomerror(symbol_not_found,sym);
-    return 0;//never reached
+void machopatchfinder64::addStringRegions(stringindex *index){
+    struct mach_header_64 *mh = (struct mach_header_64*)_buf;
+    struct load_command *lcmd = (struct load_command *)(mh + 1);
+    for (uint32_t i=0; i<mh->ncmds; i++, lcmd = (struct load_command *)((uint8_t *)lcmd + lcmd->cmdsize)) {
+        if (lcmd->cmd != LC_SEGMENT_64) continue;
+        struct segment_command_64* seg = (struct segment_command_64*)lcmd;
+        struct section_64 *sect = (struct section_64 *)(seg + 1);
+        for (uint32_t z=0; z<seg->nsects; z++, sect++) {
+            if ((sect->flags & SECTION_TYPE) != S_CSTRING_LITERALS)
+                continue;
+            if (!sect->offset || sect->offset + sect->size > _bufSize)
+                continue; //zerofill or not backed by the file
+            index->addCstringRegion({(loc_t)sect->addr, _buf + sect->offset, sect->size, std::string(seg->segname, strnlen(seg->segname, sizeof(seg->segname)))});
+        }
+    }
+    //the rest, e.g. __const and fileset kernelcaches which don't have sections in the top level header
+    patchfinder64::addStringRegions(index);
 }
 
-std::string machopatchfinder64::sym_for_addr(loc_t addr){
-    const uint8_t *psymtab = _buf + getSymtab()->symoff;
-    const uint8_t *pstrtab = _buf + getSymtab()->stroff;
-    
-    struct nlist_64 *entry = (struct nlist_64 *)psymtab;
-    for (uint32_t i = 0; i < getSymtab()->nsyms; i++, entry++)
-        if (addr == (loc_t)entry->n_value) {
-            return (const char*)(pstrtab + entry->n_un.n_strx);
+symbolindex *machopatchfinder64::newSymbolIndex(){
+    struct symtab_command *symtab = getSymtab();
+    retassure(symtab->symoff + (uint64_t)symtab->nsyms*sizeof(struct nlist_64) <= _bufSize, "symtab out of bounds");
+    retassure(symtab->stroff + (uint64_t)symtab->strsize <= _bufSize, "strtab out of bounds");
+    return new symbolindex(_buf + symtab->symoff, symtab->nsyms, (const char*)_buf + symtab->stroff, symtab->strsize);
+}
+
+symbolindex *machopatchfinder64::symbols(){
+    if (symbolindex *ret = _symbols) return ret;
+    std::lock_guard<std::mutex> lk(_symbolsLock);
+    if (!_symbols) {
+        if (_symbolsBuilder.valid()) {
+            _symbols = _symbolsBuilder.get();
+        }else{
+            _symbols = newSymbolIndex();
         }
+    }
+    return _symbols;
+}
 
-    retcustomerror(symbol_not_found,"No symbol for address=0x%016llx",addr);
+void machopatchfinder64::build_symbol_index(bool background){
+    std::lock_guard<std::mutex> lk(_symbolsLock);
+    if (_symbols || _symbolsBuilder.valid()) return;
+    if (background) {
+        getSymtab(); //fail here rather than on first lookup
+        _symbolsBuilder = std::async(std::launch::async, [this]{
+            return newSymbolIndex();
+        });
+    }else{
+        _symbols = newSymbolIndex();
+    }
+}
+
+loc_t machopatchfinder64::find_sym(const char *sym){
+    tracespan tspan(_tracer, "finder", __FUNCTION__, "sym", sym);
+    const symbolindex::symbol *entry = symbols()->find(sym);
+    if (!entry) retcustomerror(symbol_not_found,sym);
+    return tspan.ret(entry->addr);
+}
+
+std::string machopatchfinder64::sym_for_addr(loc_t addr, bool allowOffset){
+    const symbolindex::symbol *entry = symbols()->find(addr, allowOffset);
+    if (!entry) retcustomerror(symbol_not_found,"No symbol for address=0x%016llx",addr);
+
+    std::string ret{entry->name, entry->len};
+    if (entry->addr != addr) {
+        char off[0x20];
+        snprintf(off, sizeof(off), "+0x%llx", (unsigned long long)(addr - entry->addr));
+        ret += off;
+    }
+    return ret;
 }
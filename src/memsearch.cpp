@@ -0,0 +1,227 @@
+//
+//  memsearch.cpp
+//  liboffsetfinder64
+//
+
+#include <string.h>
+
+#include "memsearch.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define MEMSEARCH_X86 1
+#   include <immintrin.h>
+#elif defined(__ARM_NEON)
+#   define MEMSEARCH_NEON 1
+#   include <arm_neon.h>
+#endif
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace memsearch;
+
+/*
+    All vector paths use the same filter:
+    compare a block of candidate positions against the first and the last byte of the needle at once,
+    only positions where both match get a full memcmp.
+    The aligned paths compare the first 32bit word of the needle against whole words instead.
+    Whatever is left at the end of the buffer is handed to the scalar path.
+ */
+
+#pragma mark scalar
+static const uint8_t *find_scalar(const uint8_t *hay, size_t hayLen, const uint8_t *needle, size_t needleLen){
+    return (const uint8_t *)::memmem(hay, hayLen, needle, needleLen);
+}
+
+static const uint8_t *find_aligned32_scalar(const uint8_t *hay, size_t hayLen, const uint8_t *needle, size_t needleLen){
+    uint32_t first = 0;
+    memcpy(&first, needle, sizeof(first));
+    for (size_t i=0; i+needleLen <= hayLen; i+=4) {
+        uint32_t w = 0;
+        memcpy(&w, &hay[i], sizeof(w));
+        if (w == first && !memcmp(&hay[i+4], &needle[4], needleLen-4))
+            return &hay[i];
+    }
+    return NULL;
+}
+
+#ifdef MEMSEARCH_X86
+#pragma mark x86
+__attribute__((target("sse2")))
+static const uint8_t *find_sse(const uint8_t *hay, size_t hayLen, const uint8_t *needle, size_t needleLen){
+    const __m128i first = _mm_set1_epi8((char)needle[0]);
+    const __m128i last = _mm_set1_epi8((char)needle[needleLen-1]);
+    size_t i = 0;
+    for (; i + needleLen-1 + 16 <= hayLen; i+=16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *)&hay[i]);
+        __m128i bl = _mm_loadu_si128((const __m128i *)&hay[i+needleLen-1]);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, bf), _mm_cmpeq_epi8(last, bl)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (!memcmp(&hay[pos+1], &needle[1], needleLen-2)) return &hay[pos];
+            mask &= mask-1;
+        }
+    }
+    return find_scalar(&hay[i], hayLen-i, needle, needleLen);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *find_avx2(const uint8_t *hay, size_t hayLen, const uint8_t *needle, size_t needleLen){
+    const __m256i first = _mm256_set1_epi8((char)needle[0]);
+    const __m256i last = _mm256_set1_epi8((char)needle[needleLen-1]);
+    size_t i = 0;
+    for (; i + needleLen-1 + 32 <= hayLen; i+=32) {
+        __m256i bf = _mm256_loadu_si256((const __m256i *)&hay[i]);
+        __m256i bl = _mm256_loadu_si256((const __m256i *)&hay[i+needleLen-1]);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, bf), _mm256_cmpeq_epi8(last, bl)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (!memcmp(&hay[pos+1], &needle[1], needleLen-2)) return &hay[pos];
+            mask &= mask-1;
+        }
+    }
+    return find_scalar(&hay[i], hayLen-i, needle, needleLen);
+}
+
+__attribute__((target("sse2")))
+static const uint8_t *find_aligned32_sse(const uint8_t *hay, size_t hayLen, const uint8_t *needle, size_t needleLen){
+    uint32_t w = 0;
+    memcpy(&w, needle, sizeof(w));
+    const __m128i first = _mm_set1_epi32((int)w);
+    size_t i = 0;
+    for (; i + needleLen-4 + 16 <= hayLen; i+=16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)&hay[i]);
+        uint32_t mask = (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first, b)));
+        while (mask) {
+            size_t pos = i + 4*__builtin_ctz(mask);
+            if (!memcmp(&hay[pos+4], &needle[4], needleLen-4)) return &hay[pos];
+            mask &= mask-1;
+        }
+    }
+    return find_aligned32_scalar(&hay[i], hayLen-i, needle, needleLen);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *find_aligned32_avx2(const uint8_t *hay, size_t hayLen, const uint8_t *needle, size_t needleLen){
+    uint32_t w = 0;
+    memcpy(&w, needle, sizeof(w));
+    const __m256i first = _mm256_set1_epi32((int)w);
+    size_t i = 0;
+    for (; i + needleLen-4 + 32 <= hayLen; i+=32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)&hay[i]);
+        uint32_t mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(first, b)));
+        while (mask) {
+            size_t pos = i + 4*__builtin_ctz(mask);
+            if (!memcmp(&hay[pos+4], &needle[4], needleLen-4)) return &hay[pos];
+            mask &= mask-1;
+        }
+    }
+    return find_aligned32_scalar(&hay[i], hayLen-i, needle, needleLen);
+}
+#endif //MEMSEARCH_X86
+
+#ifdef MEMSEARCH_NEON
+#pragma mark neon
+static const uint8_t *find_neon(const uint8_t *hay, size_t hayLen, const uint8_t *needle, size_t needleLen){
+    const uint8x16_t first = vdupq_n_u8(needle[0]);
+    const uint8x16_t last = vdupq_n_u8(needle[needleLen-1]);
+    size_t i = 0;
+    for (; i + needleLen-1 + 16 <= hayLen; i+=16) {
+        uint8x16_t bf = vld1q_u8(&hay[i]);
+        uint8x16_t bl = vld1q_u8(&hay[i+needleLen-1]);
+        uint8x16_t eq = vandq_u8(vceqq_u8(first, bf), vceqq_u8(last, bl));
+        //4 bits per byte
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        while (mask) {
+            int bit = __builtin_ctzll(mask);
+            size_t pos = i + (bit >> 2);
+            if (!memcmp(&hay[pos+1], &needle[1], needleLen-2)) return &hay[pos];
+            mask &= ~(0xfULL << (bit & ~3));
+        }
+    }
+    return find_scalar(&hay[i], hayLen-i, needle, needleLen);
+}
+
+static const uint8_t *find_aligned32_neon(const uint8_t *hay, size_t hayLen, const uint8_t *needle, size_t needleLen){
+    uint32_t w = 0;
+    memcpy(&w, needle, sizeof(w));
+    const uint32x4_t first = vdupq_n_u32(w);
+    size_t i = 0;
+    for (; i + needleLen-4 + 16 <= hayLen; i+=16) {
+        uint32x4_t b = vreinterpretq_u32_u8(vld1q_u8(&hay[i]));
+        //16 bits per word
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(vceqq_u32(first, b))), 0);
+        while (mask) {
+            int bit = __builtin_ctzll(mask);
+            size_t pos = i + 4*(bit >> 4);
+            if (!memcmp(&hay[pos+4], &needle[4], needleLen-4)) return &hay[pos];
+            mask &= ~(0xffffULL << (bit & ~15));
+        }
+    }
+    return find_aligned32_scalar(&hay[i], hayLen-i, needle, needleLen);
+}
+#endif //MEMSEARCH_NEON
+
+#pragma mark public
+impl memsearch::detected(){
+    static const impl best = []{
+#ifdef MEMSEARCH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return kImplAVX2;
+        if (__builtin_cpu_supports("sse2")) return kImplSSE;
+#elif defined(MEMSEARCH_NEON)
+        return kImplNEON;
+#endif
+        return kImplScalar;
+    }();
+    return best;
+}
+
+const char *memsearch::implName(impl i){
+    switch (i) {
+        case kImplScalar:   return "scalar";
+        case kImplSSE:      return "sse2";
+        case kImplAVX2:     return "avx2";
+        case kImplNEON:     return "neon";
+    }
+    return "unknown";
+}
+
+const uint8_t *memsearch::find(const uint8_t *hay, size_t hayLen, const void *needle_, size_t needleLen, impl i){
+    const uint8_t *needle = (const uint8_t *)needle_;
+    if (needleLen > hayLen) return NULL;
+    if (needleLen < 2) return find_scalar(hay, hayLen, needle, needleLen);
+
+    switch (i) {
+#ifdef MEMSEARCH_X86
+        case kImplAVX2: return find_avx2(hay, hayLen, needle, needleLen);
+        case kImplSSE:  return find_sse(hay, hayLen, needle, needleLen);
+#endif
+#ifdef MEMSEARCH_NEON
+        case kImplNEON: return find_neon(hay, hayLen, needle, needleLen);
+#endif
+        default:        return find_scalar(hay, hayLen, needle, needleLen);
+    }
+}
+
+const uint8_t *memsearch::find_aligned32(const uint8_t *hay, size_t hayLen, const void *needle_, size_t needleLen, impl i){
+    const uint8_t *needle = (const uint8_t *)needle_;
+    if (needleLen > hayLen) return NULL;
+    if (needleLen < 4) {
+        //can't filter on a whole word, check the candidates directly
+        for (size_t off=0; off+needleLen <= hayLen; off+=4) {
+            if (!memcmp(&hay[off], needle, needleLen)) return &hay[off];
+        }
+        return NULL;
+    }
+
+    switch (i) {
+#ifdef MEMSEARCH_X86
+        case kImplAVX2: return find_aligned32_avx2(hay, hayLen, needle, needleLen);
+        case kImplSSE:  return find_aligned32_sse(hay, hayLen, needle, needleLen);
+#endif
+#ifdef MEMSEARCH_NEON
+        case kImplNEON: return find_aligned32_neon(hay, hayLen, needle, needleLen);
+#endif
+        default:        return find_aligned32_scalar(hay, hayLen, needle, needleLen);
+    }
+}
@@ -0,0 +1,43 @@
+//
+//  memsearch.hpp
+//  liboffsetfinder64
+//
+
+#ifndef memsearch_hpp
+#define memsearch_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        namespace memsearch {
+            enum impl{
+                kImplScalar = 0,
+                kImplSSE,
+                kImplAVX2,
+                kImplNEON
+            };
+
+            /*
+                best implementation supported by this cpu, detected once at runtime
+             */
+            impl detected();
+            const char *implName(impl i);
+
+            /*
+                first occurrence of needle in hay, NULL if there is none.
+                All implementations give identical results.
+             */
+            const uint8_t *find(const uint8_t *hay, size_t hayLen, const void *needle, size_t needleLen, impl i = detected());
+
+            /*
+                like find, but only matches at offsets which are a multiple of 4.
+                Meant for opcode needles, hay must start at an instruction boundary.
+             */
+            const uint8_t *find_aligned32(const uint8_t *hay, size_t hayLen, const void *needle, size_t needleLen, impl i = detected());
+        };
+    };
+};
+
+#endif /* memsearch_hpp */
@@ -0,0 +1,104 @@
+//
+//  multisearch.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <queue>
+
+#include <libgeneral/macros.h>
+
+#include "multisearch.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+#define kNoState ((uint32_t)-1)
+
+multisearch::multisearch()
+: _finalized(false)
+{
+    newState(); //root
+}
+
+uint32_t multisearch::newState(){
+    _delta.resize(_delta.size()+256, kNoState);
+    _outputs.emplace_back();
+    return (uint32_t)(_outputs.size()-1);
+}
+
+uint32_t multisearch::addPattern(const void *pattern_, size_t len, bool insnAligned){
+    const uint8_t *pattern = (const uint8_t *)pattern_;
+    retassure(!_finalized, "can't add patterns after finalize");
+    retassure(len, "empty pattern");
+
+    uint32_t id = (uint32_t)_patterns.size();
+    uint32_t state = 0;
+    for (size_t i=0; i<len; i++) {
+        uint32_t next = _delta[state*256 + pattern[i]];
+        if (next == kNoState) {
+            next = newState();
+            _delta[state*256 + pattern[i]] = next;
+        }
+        state = next;
+    }
+    _outputs[state].push_back(id);
+    _patterns.push_back({len, insnAligned});
+    return id;
+}
+
+void multisearch::finalize(){
+    if (_finalized) return;
+    std::vector<uint32_t> fail(stateCnt(), 0);
+    std::queue<uint32_t> todo;
+
+    for (int c=0; c<256; c++) {
+        uint32_t &next = _delta[c];
+        if (next == kNoState) {
+            next = 0;
+        } else {
+            todo.push(next);
+        }
+    }
+
+    //breadth first, so the failure state of every state is complete before it is used
+    while (!todo.empty()) {
+        uint32_t state = todo.front();
+        todo.pop();
+        auto &fo = _outputs[fail[state]];
+        _outputs[state].insert(_outputs[state].end(), fo.begin(), fo.end());
+
+        for (int c=0; c<256; c++) {
+            uint32_t &next = _delta[state*256 + c];
+            if (next == kNoState) {
+                next = _delta[fail[state]*256 + c];
+            } else {
+                fail[next] = _delta[fail[state]*256 + c];
+                todo.push(next);
+            }
+        }
+    }
+    _finalized = true;
+}
+
+void multisearch::scan(const segmentview &seg, std::vector<match> &out) const{
+    retassure(_finalized, "scan before finalize");
+    size_t first = out.size();
+    const uint32_t *delta = _delta.data();
+    uint32_t state = 0;
+
+    for (size_t i=0; i<seg.size; i++) {
+        state = delta[state*256 + seg.buf[i]];
+        for (uint32_t id : _outputs[state]) {
+            const pattern &p = _patterns[id];
+            loc_t addr = seg.base + i+1 - p.len;
+            if (p.insnAligned && (addr & 3)) continue;
+            out.push_back({addr, id});
+        }
+    }
+
+    //matches are found at their end, report them by where they start
+    std::sort(out.begin()+first, out.end(), [](const match &a, const match &b){
+        return a.addr < b.addr || (a.addr == b.addr && a.pattern < b.pattern);
+    });
+}
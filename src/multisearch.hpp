@@ -0,0 +1,65 @@
+//
+//  multisearch.hpp
+//  liboffsetfinder64
+//
+
+#ifndef multisearch_hpp
+#define multisearch_hpp
+
+#include <vector>
+
+#include <stdint.h>
+
+#include <liboffsetfinder64/common.h>
+#include "segmentview.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Aho-Corasick automaton over a set of byte patterns.
+            One pass over a segment reports every occurrence of every pattern.
+         */
+        class multisearch{
+        public:
+            struct match{
+                loc_t addr;
+                uint32_t pattern;
+            };
+        private:
+            struct pattern{
+                size_t len;
+                bool insnAligned;
+            };
+            std::vector<pattern> _patterns;
+            std::vector<uint32_t> _delta;                   //states*256, goto merged with failure links
+            std::vector<std::vector<uint32_t>> _outputs;    //per state, includes outputs of the failure chain
+            bool _finalized;
+
+            uint32_t newState();
+
+        public:
+            multisearch();
+
+            /*
+                returns the pattern id, ids are handed out in insertion order starting at 0.
+                insnAligned patterns only match at instruction boundaries.
+             */
+            uint32_t addPattern(const void *pattern, size_t len, bool insnAligned = false);
+
+            /*
+                build the automaton, call after all patterns were added
+             */
+            void finalize();
+
+            size_t patternCnt() const { return _patterns.size();}
+            size_t stateCnt() const { return _outputs.size();}
+
+            /*
+                append all matches in seg to out, ordered by address then pattern id
+             */
+            void scan(const segmentview &seg, std::vector<match> &out) const;
+        };
+    };
+};
+
+#endif /* multisearch_hpp */
@@ -0,0 +1,68 @@
+//
+//  parallelscan.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <libgeneral/macros.h>
+
+#include "parallelscan.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace libinsn;
+
+std::vector<parallelscan::chunk> parallelscan::chunks(vmem *mem, size_t overlap, size_t chunkWords){
+    retassure(chunkWords, "chunkWords can't be 0");
+    std::vector<segmentview> segs = segmentviews(mem, vsegment::kVMPROTEXEC);
+    std::sort(segs.begin(), segs.end(), [](const segmentview &a, const segmentview &b){
+        return a.base < b.base;
+    });
+
+    std::vector<chunk> ret;
+    for (auto &seg : segs) {
+        size_t wordCnt = seg.wordCnt();
+        for (size_t i=0; i<wordCnt; i+=chunkWords) {
+            size_t startCnt = std::min(chunkWords, wordCnt-i);
+            size_t viewCnt = std::min(startCnt + overlap, wordCnt-i);
+            ret.push_back({{seg.base + i*4, seg.buf + i*4, viewCnt*4, seg.name}, startCnt});
+        }
+    }
+    return ret;
+}
+
+void parallelscan::run(size_t jobCnt, const std::function<void(size_t job)> &job, unsigned threadCnt){
+    if (!threadCnt) threadCnt = std::thread::hardware_concurrency();
+    if (!threadCnt) threadCnt = 1;
+    if (threadCnt > jobCnt) threadCnt = (unsigned)jobCnt;
+
+    std::atomic<size_t> nextJob{0};
+    std::exception_ptr err = NULL;
+    std::mutex errLock;
+
+    auto worker = [&]{
+        try {
+            for (size_t j; (j = nextJob++) < jobCnt;) {
+                job(j);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lk(errLock);
+            if (!err) err = std::current_exception();
+            nextJob = jobCnt;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i=1; i<threadCnt; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) t.join();
+
+    if (err) std::rethrow_exception(err);
+}
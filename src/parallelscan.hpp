@@ -0,0 +1,65 @@
+//
+//  parallelscan.hpp
+//  liboffsetfinder64
+//
+
+#ifndef parallelscan_hpp
+#define parallelscan_hpp
+
+#include <functional>
+#include <vector>
+
+#include <stdint.h>
+
+#include <libinsn/vmem.hpp>
+#include <liboffsetfinder64/common.h>
+#include "segmentview.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Whole image scans on a thread pool.
+            The executable segments are cut into chunks, a chunk owns the first startCnt words of its view
+            and the view reaches up to overlap words further (never past the segment),
+            so a candidate starting in the chunk sees the same words as a sequential scan would.
+            Per chunk results are concatenated in address order.
+         */
+        namespace parallelscan {
+            static constexpr size_t kChunkWords = 0x10000;
+
+            struct chunk{
+                segmentview view;
+                size_t startCnt;
+            };
+
+            std::vector<chunk> chunks(tihmstar::libinsn::vmem *mem, size_t overlap, size_t chunkWords = kChunkWords);
+
+            /*
+                job(0) ... job(jobCnt-1) on threadCnt threads (0 is one per core), the calling thread helps.
+                The first exception stops the remaining jobs and is rethrown.
+             */
+            void run(size_t jobCnt, const std::function<void(size_t job)> &job, unsigned threadCnt = 0);
+
+            /*
+                scanChunk(const chunk &, std::vector<T> &out) has to append in address order
+                and must only touch state which is safe to share between threads.
+             */
+            template <typename T, typename F>
+            std::vector<T> scan(tihmstar::libinsn::vmem *mem, size_t overlap, F &&scanChunk, unsigned threadCnt = 0){
+                std::vector<chunk> todo = chunks(mem, overlap);
+                std::vector<std::vector<T>> results(todo.size());
+                run(todo.size(), [&](size_t i){
+                    scanChunk(todo[i], results[i]);
+                }, threadCnt);
+
+                std::vector<T> ret;
+                for (auto &r : results) {
+                    ret.insert(ret.end(), std::make_move_iterator(r.begin()), std::make_move_iterator(r.end()));
+                }
+                return ret;
+            }
+        };
+    };
+};
+
+#endif /* parallelscan_hpp */
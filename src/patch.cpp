@@ -6,33 +6,83 @@
 //  Copyright © 2018 tihmstar. All rights reserved.
 //
 
+#include <libgeneral/macros.h>
+
 #include "patch.hpp"
 
 using namespace tihmstar::offsetfinder64;
 
-patch::patch(loc_t location, const void *patch, size_t patchSize, void(*slidefunc)(class patch *patch, uint64_t slide)) : _location(location), _patchSize(patchSize), _slidefunc(slidefunc){
-    _patch = malloc(_patchSize);
-    memcpy((void*)_patch, patch, _patchSize);
-    _slideme = (_slidefunc) ? true : false;
+#pragma mark patch
+
+patch::patch(loc_t location, const void *patch, size_t patchSize, void(*slidefunc)(class patch *patch, uint64_t slide))
+: _slideme(slidefunc != NULL), _slidefunc(slidefunc), _storage(kInline), _location(location), _patchSize(0), _patch(NULL){
+    setPayload(patch, patchSize);
 }
 
-patch::patch(const patch& cpy) noexcept : _location(cpy._location), _patchSize(cpy._patchSize){
-    _patch = malloc(_patchSize);
-    memcpy((void*)_patch, cpy._patch, _patchSize);
-    _slidefunc = cpy._slidefunc;
-    _slideme = cpy._slideme;
+patch::patch(const patch& cpy)
+: _slideme(cpy._slideme), _slidefunc(cpy._slidefunc), _storage(kInline), _location(cpy._location), _patchSize(0), _patch(NULL){
+    setPayload(cpy._patch, cpy._patchSize);
+}
+
+patch::patch(patch &&mv) noexcept
+: _slideme(mv._slideme), _slidefunc(mv._slidefunc), _storage(kInline), _location(mv._location), _patchSize(0), _patch(NULL){
+    takePayload(mv);
 }
 
 patch &patch::operator=(const patch& cpy){
+    if (this == &cpy) return *this;
+    releasePayload();
     _location = cpy._location;
-    _patchSize = cpy._patchSize;
-    _patch = malloc(_patchSize);
-    memcpy((void*)_patch, cpy._patch, _patchSize);
     _slidefunc = cpy._slidefunc;
     _slideme = cpy._slideme;
+    setPayload(cpy._patch, cpy._patchSize);
     return *this;
 }
 
+patch &patch::operator=(patch &&mv) noexcept{
+    if (this == &mv) return *this;
+    releasePayload();
+    _location = mv._location;
+    _slidefunc = mv._slidefunc;
+    _slideme = mv._slideme;
+    takePayload(mv);
+    return *this;
+}
+
+void patch::setPayload(const void *payload, size_t size){
+    if (size <= kInlineSize) {
+        _storage = kInline;
+        _patch = _inline;
+    }else{
+        void *buf = NULL;
+        assure(buf = malloc(size));
+        _storage = kHeap;
+        _patch = buf;
+    }
+    if (size) memcpy((void*)_patch, payload, size);
+    _patchSize = size;
+}
+
+void patch::takePayload(patch &other) noexcept{
+    _patchSize = other._patchSize;
+    _storage = other._storage;
+    if (other._storage == kInline) {
+        memcpy(_inline, other._inline, other._patchSize);
+        _patch = _inline;
+    }else{
+        _patch = other._patch;
+    }
+    other._storage = kInline;
+    other._patch = other._inline;
+    other._patchSize = 0;
+}
+
+void patch::releasePayload() noexcept{
+    if (_storage == kHeap) free((void*)_patch);
+    _storage = kInline;
+    _patch = _inline;
+    _patchSize = 0;
+}
 
 void patch::slide(uint64_t slide){
     if (!_slideme)
@@ -43,5 +93,54 @@ void patch::slide(uint64_t slide){
 }
 
 patch::~patch(){
-    free((void*)_patch);
+    releasePayload();
+}
+
+#pragma mark patchset
+
+patchset::patchset()
+: _chunkUsed(kChunkSize)
+{
+    //
+}
+
+const void *patchset::store(const void *payload, size_t size){
+    uint8_t *dst = NULL;
+    if (size > kChunkSize/4) {
+        //big payloads get a chunk of their own, the current chunk stays last and keeps filling up
+        std::unique_ptr<uint8_t[]> chunk(new uint8_t[size]);
+        dst = chunk.get();
+        _chunks.insert(_chunks.empty() ? _chunks.end() : _chunks.end()-1, std::move(chunk));
+    }else{
+        size_t aligned = (size + 7) & ~(size_t)7;
+        if (_chunkUsed + aligned > kChunkSize) {
+            _chunks.emplace_back(new uint8_t[kChunkSize]);
+            _chunkUsed = 0;
+        }
+        dst = _chunks.back().get() + _chunkUsed;
+        _chunkUsed += aligned;
+    }
+    memcpy(dst, payload, size);
+    return dst;
+}
+
+void patchset::push_back(const patch &p){
+    push_back(p._location, p._patch, p._patchSize, p._slidefunc);
+    _patches.back()._slideme = p._slideme;
+}
+
+void patchset::push_back(loc_t location, const void *payload, size_t size, void(*slidefunc)(class patch *patch, uint64_t slide)){
+    if (size <= patch::kInlineSize) {
+        _patches.emplace_back(location, payload, size, slidefunc);
+        return;
+    }
+    patch p(location, NULL, 0, slidefunc);
+    p._storage = patch::kBorrowed;
+    p._patch = store(payload, size);
+    p._patchSize = size;
+    _patches.push_back(std::move(p));
+}
+
+std::vector<patch> patchset::toVector() const{
+    return std::vector<patch>(_patches.begin(), _patches.end());
 }
@@ -0,0 +1,186 @@
+//
+//  patchapplier.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libgeneral/macros.h>
+
+#include "patchapplier.hpp"
+#include "patchfinder64.hpp"
+#include "OFexception.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+#pragma mark mappedimage
+
+patchapplier::mappedimage::mappedimage(uint8_t *map, size_t mapSize, size_t offset, size_t size)
+: _map(map), _mapSize(mapSize), _offset(offset), _size(size)
+{
+    //
+}
+
+patchapplier::mappedimage::mappedimage(mappedimage &&mv) noexcept
+: _map(mv._map), _mapSize(mv._mapSize), _offset(mv._offset), _size(mv._size)
+{
+    mv._map = NULL;
+    mv._mapSize = 0;
+}
+
+patchapplier::mappedimage::~mappedimage(){
+    if (_map) munmap(_map, _mapSize);
+}
+
+#pragma mark patchapplier
+
+patchapplier::patchapplier(patchfinder64 *finder)
+: _finder(finder)
+{
+    //
+}
+
+size_t patchapplier::imageOffset(const patch &p) const{
+    retassure(!p.needsSlide(), "patch at 0x%016llx needs to be slid first", p._location);
+    const uint8_t *buf = (const uint8_t *)_finder->buf();
+    const uint8_t *mem = (const uint8_t *)_finder->memoryForLoc(p._location);
+    retassure(mem >= buf && mem < buf + _finder->bufSize(), "patch at 0x%016llx is not backed by the image", p._location);
+    if (p._patchSize > 1) {
+        //all of it has to be in one segment, which is contiguous in the file
+        const uint8_t *last = (const uint8_t *)_finder->memoryForLoc(p._location + p._patchSize - 1);
+        retassure(last == mem + p._patchSize - 1, "patch at 0x%016llx crosses a segment boundary", p._location);
+    }
+    return mem - buf;
+}
+
+size_t patchapplier::add(std::vector<patch> patches){
+    size_t set = _sets.size();
+    std::vector<placed> all = _placed;
+    for (size_t i=0; i<patches.size(); i++) {
+        if (!patches[i]._patchSize) continue;
+        all.push_back({imageOffset(patches[i]), set, i});
+    }
+    std::stable_sort(all.begin(), all.end(), [](const placed &a, const placed &b){
+        return a.off < b.off;
+    });
+
+    auto payload = [&](const placed &pl) -> const patch &{
+        return (pl.set == set) ? patches[pl.idx] : _sets[pl.set][pl.idx];
+    };
+
+    //sweep over the patches in offset order, comparing each one to all earlier ones it overlaps
+    std::vector<const placed *> active;
+    for (auto &pl : all) {
+        const patch &p = payload(pl);
+        active.erase(std::remove_if(active.begin(), active.end(), [&](const placed *a){
+            return a->off + payload(*a)._patchSize <= pl.off;
+        }), active.end());
+
+        for (const placed *a : active) {
+            if (a->set != set && pl.set != set) continue; //checked when the later one was added
+            const patch &ap = payload(*a);
+            size_t end = std::min(a->off + ap._patchSize, pl.off + p._patchSize);
+            if (memcmp((const uint8_t *)ap._patch + (pl.off - a->off), p._patch, end - pl.off)) {
+                retcustomerror(patch_conflict, "patch at 0x%016llx (set %zu) conflicts with patch at 0x%016llx (set %zu)",
+                               p._location, pl.set, ap._location, a->set);
+            }
+        }
+        active.push_back(&pl);
+    }
+
+    _sets.push_back(std::move(patches));
+    _placed = std::move(all);
+    return set;
+}
+
+std::vector<patchapplier::report> patchapplier::apply(void *image, size_t imageSize) const{
+    uint8_t *out = (uint8_t *)image;
+    std::vector<report> reports(_sets.size(), report{0, 0, 0});
+    for (size_t s=0; s<_sets.size(); s++) {
+        reports[s].patchCnt = _sets[s].size();
+    }
+
+    for (auto &pl : _placed) {
+        const patch &p = _sets[pl.set][pl.idx];
+        const uint8_t *src = (const uint8_t *)p._patch;
+        retassure(pl.off + p._patchSize <= imageSize, "patch at 0x%016llx is outside of the output image", p._location);
+        reports[pl.set].bytes += p._patchSize;
+
+        //only store bytes which differ, so pages which already match are never dirtied
+        for (size_t i=0; i<p._patchSize; i++) {
+            if (out[pl.off+i] == src[i]) continue;
+            out[pl.off+i] = src[i];
+            reports[pl.set].bytesChanged++;
+        }
+    }
+    return reports;
+}
+
+std::vector<patchapplier::report> patchapplier::apply_to_file(const char *outPath) const{
+    const uint8_t *buf = (const uint8_t *)_finder->buf();
+    size_t size = _finder->bufSize();
+    std::string tmp = std::string(outPath) + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    int fd = -1;
+    uint8_t *map = NULL;
+    bool done = false;
+    cleanup([&]{
+        if (map) munmap(map, size);
+        if (fd >= 0) close(fd);
+        if (!done) unlink(tmp.c_str());
+    })
+
+    retassure((fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) != -1, "failed to create %s errno=%d", tmp.c_str(), errno);
+    for (size_t didWrite = 0; didWrite < size;) {
+        ssize_t cnt = write(fd, buf + didWrite, size - didWrite);
+        if (cnt < 0 && errno == EINTR) continue;
+        retassure(cnt > 0, "failed to write %s errno=%d", tmp.c_str(), errno);
+        didWrite += cnt;
+    }
+
+    std::vector<report> reports;
+    if (size) {
+        void *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        retassure(shared != MAP_FAILED, "failed to map %s errno=%d", tmp.c_str(), errno);
+        map = (uint8_t *)shared;
+        reports = apply(map, size);
+        retassure(!msync(map, size, MS_SYNC), "failed to sync %s errno=%d", tmp.c_str(), errno);
+    }else{
+        reports = apply(NULL, 0);
+    }
+    retassure(!rename(tmp.c_str(), outPath), "failed to rename %s to %s errno=%d", tmp.c_str(), outPath, errno);
+    done = true;
+    return reports;
+}
+
+patchapplier::mappedimage patchapplier::apply_private(const char *imagePath, size_t imageOffset, std::vector<report> *reports) const{
+    int fd = -1;
+    struct stat fs = {};
+    cleanup([&]{
+        if (fd >= 0) close(fd);
+    })
+
+    retassure((fd = open(imagePath, O_RDONLY)) != -1, "failed to open %s", imagePath);
+    assure(!fstat(fd, &fs));
+    size_t fileSize = (size_t)fs.st_size;
+    size_t size = _finder->bufSize();
+    retassure(imageOffset <= fileSize && size <= fileSize - imageOffset, "%s is too small for the image", imagePath);
+
+    //private writable mapping of a read only file: writes go to copies of the touched pages
+    uint8_t *map = (uint8_t *)mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    retassure(map != MAP_FAILED, "failed to map %s errno=%d", imagePath, errno);
+    mappedimage ret(map, fileSize, imageOffset, size);
+
+    std::vector<report> rep = apply(ret.buf(), ret.size());
+    if (reports) *reports = std::move(rep);
+    return ret;
+}
@@ -6,12 +6,29 @@
 //  Copyright © 2018 tihmstar. All rights reserved.
 //
 
+#include <algorithm>
+
 #include <string.h>
 
 #include <libgeneral/macros.h>
 
 #include "all_liboffsetfinder.hpp"
 #include "patchfinder64.hpp"
+#include "xrefindex.hpp"
+#include "callgraph.hpp"
+#include "branchindex.hpp"
+#include "functiontable.hpp"
+#include "stringindex.hpp"
+#include "decodetable.hpp"
+#include "regstatecache.hpp"
+#include "caveallocator.hpp"
+#include "segmentview.hpp"
+#include "memsearch.hpp"
+#include "multisearch.hpp"
+#include "imagefile.hpp"
+#include "resultcache.hpp"
+#include "indexfile.hpp"
+#include "tracer.hpp"
 
 using namespace std;
 using namespace tihmstar;
@@ -22,36 +39,225 @@ using namespace libinsn;
 
 #define HAS_BITS(a,b) (((a) & (b)) == (b))
 
+/*
+    create the index unless another thread already did, readers never see a half built index.
+    If make throws the next caller tries again.
+ */
+template <typename T, typename F>
+static T *lazyInit(std::atomic<T *> &index, std::mutex &lock, F make){
+    if (T *ret = index) return ret;
+    std::lock_guard<std::mutex> lk(lock);
+    if (T *ret = index) return ret;
+    T *ret = make();
+    index = ret;
+    return ret;
+}
+
 #pragma mark constructor/destructor
 
 patchfinder64::patchfinder64(bool freeBuf) :
     _freeBuf(freeBuf),
     _buf(NULL),
     _bufSize(0),
+    _bufMappedSize(0),
+    _ownedBuf(NULL),
     _entrypoint(0),
-    _base(0)
+    _base(0),
+    _vmem(NULL),
+    _xrefs(NULL),
+    _callgraph(NULL),
+    _branches(NULL),
+    _functions(NULL),
+    _strings(NULL),
+    _decoded(NULL),
+    _regstates(NULL),
+    _caves(NULL),
+    _cache(NULL),
+    _indexFile(NULL),
+    _tracer(tracer::global()),
+    _segments(NULL)
 {
     //
 }
 
 patchfinder64::~patchfinder64(){
+    if (_xrefs) delete _xrefs;
+    if (_callgraph) delete _callgraph;
+    if (_branches) delete _branches;
+    if (_functions) delete _functions;
+    if (_strings) delete _strings;
+    if (_decoded) delete _decoded;
+    if (_regstates) delete _regstates;
+    if (_caves) delete _caves;
+    if (_cache) delete _cache;
+    if (_segments) delete _segments;
+    if (_indexFile) delete _indexFile; //after all indices which might point into it
+    if (_tracer && _tracer != tracer::global()) {
+        try {
+            _tracer.load()->write();
+        } catch (tihmstar::exception &e) {
+            debug("failed to write trace: %s\n", e.what());
+        }
+        delete _tracer;
+    }
     if (_vmem) delete _vmem;
-    if (_freeBuf) safeFreeConst(_buf);
+    releaseBuf();
+}
+
+void patchfinder64::loadFile(const char *filename){
+    releaseBuf();
+    imagefile::image img = imagefile::load(filename);
+    _buf = img.buf;
+    _bufSize = img.size;
+    _bufMappedSize = img.mappedSize;
+    _freeBuf = true;
+}
+
+void patchfinder64::releaseBuf(){
+    if (_freeBuf) imagefile::release(_ownedBuf ? _ownedBuf : _buf, _bufMappedSize);
+    _buf = NULL;
+    _bufMappedSize = 0;
+    _ownedBuf = NULL;
 }
 
 
 #pragma mark patchfinder
 
+const std::vector<segmentview> &patchfinder64::segments(){
+    return *lazyInit(_segments, _lazyLock, [this]{
+        return new std::vector<segmentview>(segmentviews(_vmem, vsegment::kVMPROTNONE));
+    });
+}
+
 const void *patchfinder64::memoryForLoc(loc_t loc){
     return _vmem->memoryForLoc(loc);
 }
 
 
+/*
+    first occurrence of little which lies completely in [startAddr, endAddr), 0 if there is none
+ */
+static loc_t memmemRange(const std::vector<segmentview> &segs, const void *little, size_t little_len, loc_t startAddr, loc_t endAddr){
+    for (auto &seg : segs) {
+        if (seg.end() <= startAddr) continue;
+        if (seg.base >= endAddr) continue;
+        size_t off = (startAddr > seg.base) ? startAddr - seg.base : 0;
+        size_t size = (seg.end() > endAddr) ? endAddr - seg.base : seg.size;
+        if (size <= off) continue;
+        if (const uint8_t *rt = memsearch::find(seg.buf+off, size-off, little, little_len)) {
+            return seg.base + (rt-seg.buf);
+        }
+    }
+    return 0;
+}
+
 loc_t patchfinder64::findstr(std::string str, bool hasNullTerminator, loc_t startAddr){
-    return _vmem->memmem(str.c_str(), str.size()+(hasNullTerminator), startAddr);
+    tracespan tspan(_tracer, "primitive", __FUNCTION__, "str", str, "hasNullTerminator", hasNullTerminator, "startAddr", startAddr);
+    stringindex *strings = _strings;
+    if (strings && hasNullTerminator && strlen(str.c_str()) == str.size() && stringindex::isHeuristicString(str.c_str(), str.size())) {
+        //the heuristic pass over all segments made every occurrence the tail of an indexed run
+        if (loc_t ret = strings->findTail(str.c_str(), str.size(), startAddr)) return tspan.ret(ret);
+    }
+    return tspan.ret(memmem(str.c_str(), str.size()+(hasNullTerminator), startAddr));
+}
+
+loc_t patchfinder64::memmem(const void *little, size_t little_len, loc_t startAddr){
+    tracespan tspan(_tracer, "primitive", __FUNCTION__, "little_len", little_len, "startAddr", startAddr);
+    if (loc_t ret = memmemRange(segments(), little, little_len, startAddr, (loc_t)-1)) return tspan.ret(ret);
+    retcustomerror(out_of_range, "memmem failed to find needle");
+}
+
+loc_t patchfinder64::memmem_insn(const void *little, size_t little_len, loc_t startAddr){
+    tracespan tspan(_tracer, "primitive", __FUNCTION__, "little_len", little_len, "startAddr", startAddr);
+    startAddr = (startAddr+3) & ~3ULL;
+    for (auto &seg : segments()) {
+        if (seg.end() <= startAddr) continue;
+        size_t off = (startAddr > seg.base) ? startAddr - seg.base : 0;
+        if (const uint8_t *rt = memsearch::find_aligned32(seg.buf+off, seg.size-off, little, little_len)) {
+            return tspan.ret(seg.base + (rt-seg.buf));
+        }
+    }
+    retcustomerror(out_of_range, "memmem_insn failed to find needle");
+}
+
+std::vector<std::pair<size_t, loc_t>> patchfinder64::memmem_all(const std::vector<std::string> &needles, bool insnAligned){
+    std::vector<std::pair<size_t, loc_t>> ret;
+    std::vector<multisearch::match> matches;
+    multisearch ms;
+
+    for (auto &needle : needles) {
+        ms.addPattern(needle.data(), needle.size(), insnAligned);
+    }
+    ms.finalize();
+
+    for (auto &seg : segments()) {
+        ms.scan(seg, matches);
+    }
+    std::stable_sort(matches.begin(), matches.end(), [](const multisearch::match &a, const multisearch::match &b){
+        return a.addr < b.addr;
+    });
+    for (auto &m : matches) {
+        ret.push_back({m.pattern, m.addr});
+    }
+    return ret;
+}
+
+loc_t patchfinder64::memmem_first_of(const std::vector<std::string> &needles, bool insnAligned, size_t *which){
+    auto hits = memmem_all(needles, insnAligned);
+    for (size_t i=0; i<needles.size(); i++) {
+        for (auto &hit : hits) {
+            if (hit.first != i) continue;
+            if (which) *which = i;
+            return hit.second;
+        }
+    }
+    retcustomerror(out_of_range, "memmem_first_of failed to find any of %zu needles", needles.size());
+}
+
+std::vector<loc_t> patchfinder64::findstrs(std::string str){
+    build_string_index();
+    return _strings.load()->findAll(str.c_str(), str.size());
+}
+
+void patchfinder64::addStringRegions(stringindex *index){
+    for (auto &seg : segments()) {
+        index->addHeuristicRegion(seg);
+    }
+}
+
+void patchfinder64::build_string_index(){
+    segments(); //addStringRegions runs under _lazyLock and may not create them there
+    lazyInit(_strings, _lazyLock, [this]{
+        stringindex *strings = new stringindex(_buf);
+        try {
+            addStringRegions(strings);
+            strings->finalize();
+        } catch (...) {
+            delete strings;
+            throw;
+        }
+        return strings;
+    });
 }
 
 loc_t patchfinder64::find_bof(loc_t pos){
+    tracespan tspan(_tracer, "primitive", __FUNCTION__, "pos", pos);
+    if (functiontable *functions = _functions) return tspan.ret(functions->find_bof(pos));
+
+    decodetable *decoded = _decoded;
+    if (const decodetable::segment *seg = decoded ? decoded->segmentFor(pos) : NULL) {
+        //same walk as below on the columns
+        size_t i = seg->idx(pos);
+        while (i && (seg->type[i] != insn::stp || seg->rt2[i] != 30 || seg->rn[i] != 31)) i--;
+        if (seg->type[i] == insn::stp && seg->rt2[i] == 30 && seg->rn[i] == 31) {
+            while (i && seg->type[i-1] == insn::stp) i--;
+            if (i && seg->type[i-1] == insn::sub && seg->rd[i-1] == 31 && seg->rn[i-1] == 31) i--;
+            if (i && seg->type[i-1] == insn::pacibsp) i--;
+            return tspan.ret(seg->pc(i));
+        }
+        //no prologue left in this segment, let the iterator deal with it
+    }
+
     vsegment functop = _vmem->seg(pos);
 
 
@@ -80,11 +286,142 @@ loc_t patchfinder64::find_bof(loc_t pos){
         //
     }
     
-    return functop;
+    return tspan.ret((loc_t)functop);
 }
 
+loc_t patchfinder64::find_eof(loc_t pos){
+    if (functiontable *functions = _functions) {
+        if (loc_t eof = functions->find_eof(pos)) return eof;
+        //no ret left in this segment, let the iterator deal with it
+    }
+
+    decodetable *decoded = _decoded;
+    if (const decodetable::segment *seg = decoded ? decoded->segmentFor(pos) : NULL) {
+        for (size_t i = seg->idx(pos); i<seg->cnt; i++) {
+            if (seg->type[i] == insn::ret) return seg->pc(i);
+        }
+        //no ret left in this segment, let the iterator deal with it
+    }
+
+    vmem iter(*_vmem, pos);
+    while (iter() != insn::ret) ++iter;
+    return iter;
+}
+
+std::pair<loc_t, loc_t> patchfinder64::function_range(loc_t pos){
+    return {find_bof(pos), find_eof(pos)+4};
+}
+
+void patchfinder64::build_function_table(){
+    lazyInit(_functions, _lazyLock, [this]{ return new functiontable(_vmem);});
+}
+
+void patchfinder64::build_decode_table(){
+    lazyInit(_decoded, _lazyLock, [this]{ return new decodetable(_vmem);});
+}
+
+namespace {
+    /*
+        one row of the decode table with the same accessors as insn
+     */
+    struct decodedrow{
+        const decodetable::segment &seg;
+        size_t i;
+
+        enum insn::type type() const { return (enum insn::type)seg.type[i];}
+        enum insn::subtype subtype() const { return (enum insn::subtype)seg.subtype[i];}
+        uint8_t rd() const { return seg.rd[i];}
+        uint8_t rn() const { return seg.rn[i];}
+        uint8_t rm() const { return seg.rm[i];}
+        uint8_t rt() const { return seg.rt[i];}
+        int64_t imm() const { return seg.imm[i];}
+    };
+
+    /*
+        imm of a row, from libinsn if the table doesn't have it
+     */
+    int64_t rowImm(const decodetable::segment &seg, size_t i){
+        if (seg.flags[i] & decodetable::kHasImm) return seg.imm[i];
+        return seg.decode(i).imm();
+    }
+}
+
+template <typename T>
+static void trackRegisterValue(uint64_t *value, T &&ins){
+    switch (ins.type()) {
+        case insn::adrp:
+            value[ins.rd()] = ins.imm();
+            //                printf("%p: ADRP X%d, 0x%llx\n", (void*)functop.pc(), functop.rd(), functop.imm());
+            break;
+        case insn::add:
+            value[ins.rd()] = value[ins.rn()] + ins.imm();
+            //                printf("%p: ADD X%d, X%d, 0x%llx\n", (void*)functop.pc(), functop.rd(), functop.rn(), (uint64_t)functop.imm());
+            break;
+        case insn::adr:
+            value[ins.rd()] = ins.imm();
+            //                printf("%p: ADR X%d, 0x%llx\n", (void*)functop.pc(), functop.rd(), functop.imm());
+            break;
+        case insn::ldr:
+            //                printf("%p: LDR X%d, [X%d, 0x%llx]\n", (void*)functop.pc(), functop.rt(), functop.rn(), (uint64_t)functop.imm());
+            value[ins.rt()] = value[ins.rn()];
+            if (ins.subtype() == insn::st_immediate) {
+                value[ins.rt()] += ins.imm(); // XXX address, not actual value
+            }
+            break;
+        case insn::movz:
+            value[ins.rd()] = ins.imm();
+            break;
+        case insn::movk:
+            value[ins.rd()] |= ins.imm();
+            break;
+        case insn::mov:
+            value[ins.rd()] = value[ins.rm()];
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+    run the instructions in [from, to) on value
+ */
+static void replayRegisterValues(vmem *mem, const decodetable *decoded, uint64_t *value, loc_t from, loc_t to){
+    if (const decodetable::segment *seg = decoded ? decoded->segmentFor(from) : NULL) {
+        if (to <= seg->end()) {
+            for (size_t i = seg->idx(from); seg->pc(i) < to; i++) {
+                switch (seg->type[i]) {
+                    case insn::adrp:
+                    case insn::add:
+                    case insn::adr:
+                    case insn::ldr:
+                    case insn::movz:
+                    case insn::movk:
+                    case insn::mov:
+                        break;
+                    default:
+                        continue; //doesn't change a tracked register, don't decode it again
+                }
+                uint8_t flags = seg->flags[i];
+                //add without an immediate still needs imm() from libinsn
+                if ((flags & decodetable::kResolved) && ((flags & decodetable::kHasImm) || seg->type[i] != insn::add)) {
+                    trackRegisterValue(value, decodedrow{*seg, i});
+                } else {
+                    trackRegisterValue(value, seg->decode(i));
+                }
+            }
+            return;
+        }
+    }
+
+    vsegment functop = mem->seg(to);
+    functop = from;
+    for (;(loc_t)functop.pc() < to;++functop) {
+        trackRegisterValue(value, functop());
+    }
+}
 
 uint64_t patchfinder64::find_register_value(loc_t where, int reg, loc_t startAddr){
+    tracespan tspan(_tracer, "primitive", __FUNCTION__, "where", where, "reg", reg, "startAddr", startAddr);
     vsegment functop = _vmem->seg(where);
     
     if (!startAddr) {
@@ -92,47 +429,97 @@ uint64_t patchfinder64::find_register_value(loc_t where, int reg, loc_t startAdd
     }else{
         functop = startAddr;
     }
-    
-    uint64_t value[32] = {0};
-    
-    for (;(loc_t)functop.pc() < where;++functop) {
-        switch (functop().type()) {
-            case insn::adrp:
-                value[functop().rd()] = functop().imm();
-                //                printf("%p: ADRP X%d, 0x%llx\n", (void*)functop.pc(), functop.rd(), functop.imm());
-                break;
-            case insn::add:
-                value[functop().rd()] = value[functop().rn()] + functop().imm();
-                //                printf("%p: ADD X%d, X%d, 0x%llx\n", (void*)functop.pc(), functop.rd(), functop.rn(), (uint64_t)functop.imm());
-                break;
-            case insn::adr:
-                value[functop().rd()] = functop().imm();
-                //                printf("%p: ADR X%d, 0x%llx\n", (void*)functop.pc(), functop.rd(), functop.imm());
-                break;
-            case insn::ldr:
-                //                printf("%p: LDR X%d, [X%d, 0x%llx]\n", (void*)functop.pc(), functop.rt(), functop.rn(), (uint64_t)functop.imm());
-                value[functop().rt()] = value[functop().rn()];
-                if (functop().subtype() == insn::st_immediate) {
-                    value[functop().rt()] += functop().imm(); // XXX address, not actual value
+    loc_t start = functop.pc();
+    if (where <= start) return tspan.ret((uint64_t)0);
+
+    regstatecache *regstates = lazyInit(_regstates, _lazyLock, []{ return new regstatecache();});
+    decodetable *decoded = _decoded;
+
+    //snapshots are only taken at or before where, so we never replay more than the plain walk would
+    size_t want = (where - start)/4 / regstatecache::kCheckpointInterval;
+    regstatecache::regstate value;
+    for (size_t k = regstates->nearest(start, want, value); k < want; k++) {
+        replayRegisterValues(_vmem, decoded, value.data(), regstatecache::checkpointPC(start, k), regstatecache::checkpointPC(start, k+1));
+        regstates->add(start, k+1, value);
+    }
+
+    replayRegisterValues(_vmem, decoded, value.data(), regstatecache::checkpointPC(start, want), where);
+    return tspan.ret(value[reg]);
+}
+
+/*
+    find_literal_ref on the decode table columns, same matching as the libinsn walk.
+    Lookaheads stay within the segment, like the xref index.
+ */
+static loc_t findLiteralRefDecoded(const decodetable *decoded, loc_t pos, int ignoreTimes, loc_t startPos){
+    for (auto &seg : decoded->segments()) {
+        if (seg.end() <= startPos) continue;
+        for (size_t i = (startPos > seg.base) ? seg.idx(startPos) : 0; i<seg.cnt; i++) {
+            switch (seg.type[i]) {
+                case insn::adr:
+                case insn::bcond:
+                    if (rowImm(seg, i) == (int64_t)pos) {
+                        if (ignoreTimes) {
+                            ignoreTimes--;
+                            break;
+                        }
+                        return seg.pc(i);
+                    }
+                    break;
+                case insn::adrp:
+                {
+                    uint8_t rd = seg.rd[i];
+                    int64_t imm = rowImm(seg, i);
+                    for (size_t j=i+1; j<=i+10 && j<seg.cnt; j++) {
+                        bool isRef = false;
+                        if (seg.type[j] == insn::add && rd == seg.rd[j]) {
+                            isRef = true;
+                        }else if (seg.supertype[j] == insn::sut_memory && seg.subtype[j] == insn::st_immediate && rd == seg.rn[j]){
+                            isRef = true;
+                        }
+                        if (isRef && imm + rowImm(seg, j) == (int64_t)pos) {
+                            if (ignoreTimes) {
+                                ignoreTimes--;
+                                break;
+                            }
+                            return seg.pc(j);
+                        }
+                    }
+                    break;
+                }
+                case insn::movz:
+                {
+                    uint8_t rd = seg.rd[i];
+                    uint64_t imm = rowImm(seg, i);
+                    for (size_t j=i+1; j<=i+10 && j<seg.cnt; j++) {
+                        if (seg.type[j] == insn::movk && rd == seg.rd[j]) {
+                            imm |= rowImm(seg, j);
+                            if (imm == (uint64_t)pos) {
+                                if (ignoreTimes) {
+                                    ignoreTimes--;
+                                    break;
+                                }
+                                return seg.pc(j);
+                            }
+                        }else if (seg.type[j] == insn::movz && rd == seg.rd[j]){
+                            break;
+                        }
+                    }
+                    break;
                 }
-                break;
-            case insn::movz:
-                value[functop().rd()] = functop().imm();
-                break;
-            case insn::movk:
-                value[functop().rd()] |= functop().imm();
-                break;
-            case insn::mov:
-                value[functop().rd()] = value[functop().rm()];
-                break;
-            default:
-                break;
+                default:
+                    break;
+            }
         }
     }
-    return value[reg];
+    return 0;
 }
 
 loc_t patchfinder64::find_literal_ref(loc_t pos, int ignoreTimes, loc_t startPos){
+    tracespan tspan(_tracer, "primitive", __FUNCTION__, "pos", pos, "ignoreTimes", ignoreTimes, "startPos", startPos);
+    if (xrefindex *xrefs = _xrefs) return tspan.ret(xrefs->find(pos, ignoreTimes, startPos));
+    if (decodetable *decoded = _decoded) return tspan.ret(findLiteralRefDecoded(decoded, pos, ignoreTimes, startPos));
+
     vmem adrp(*_vmem, startPos);
     
     try {
@@ -143,7 +530,7 @@ loc_t patchfinder64::find_literal_ref(loc_t pos, int ignoreTimes, loc_t startPos
                         ignoreTimes--;
                         continue;
                     }
-                    return (loc_t)adrp.pc();
+                    return tspan.ret((loc_t)adrp.pc());
                 }
             }
             
@@ -163,7 +550,7 @@ loc_t patchfinder64::find_literal_ref(loc_t pos, int ignoreTimes, loc_t startPos
                                 ignoreTimes--;
                                 break;
                             }
-                            return (loc_t)iter.pc();
+                            return tspan.ret((loc_t)iter.pc());
                         }
                     }else if (iter().supertype() == insn::sut_memory && iter().subtype() == insn::st_immediate && rd == iter().rn()){
                         if (imm + iter().imm() == (int64_t)pos){
@@ -171,7 +558,7 @@ loc_t patchfinder64::find_literal_ref(loc_t pos, int ignoreTimes, loc_t startPos
                                 ignoreTimes--;
                                 break;
                             }
-                            return (loc_t)iter.pc();
+                            return tspan.ret((loc_t)iter.pc());
                         }
                     }
                 }
@@ -194,7 +581,7 @@ loc_t patchfinder64::find_literal_ref(loc_t pos, int ignoreTimes, loc_t startPos
                                 ignoreTimes--;
                                 break;
                             }
-                            return (loc_t)iter.pc();
+                            return tspan.ret((loc_t)iter.pc());
                         }
                     }else if (iter() == insn::movz && rd == iter().rd()){
                         break;
@@ -210,37 +597,112 @@ loc_t patchfinder64::find_literal_ref(loc_t pos, int ignoreTimes, loc_t startPos
                         ignoreTimes--;
                         continue;
                     }
-                    return (loc_t)adrp.pc();
+                    return tspan.ret((loc_t)adrp.pc());
                 }
             }
         }
     } catch (tihmstar::out_of_range &e) {
-        return 0;
+        return tspan.ret((loc_t)0);
     }
-    return 0;
+    return tspan.ret((loc_t)0);
+}
+
+std::vector<loc_t> patchfinder64::find_literal_refs(loc_t pos){
+    if (xrefindex *xrefs = _xrefs) return xrefs->refs(pos);
+
+    std::vector<loc_t> ret;
+    for (loc_t ref = 0; (ref = find_literal_ref(pos, (int)ret.size())); ) {
+        ret.push_back(ref);
+    }
+    return ret;
+}
+
+void patchfinder64::build_xref_index(){
+    lazyInit(_xrefs, _lazyLock, [this]{ return new xrefindex(_vmem);});
 }
 
 loc_t patchfinder64::find_call_ref(loc_t pos, int ignoreTimes, loc_t startPos){
+    tracespan tspan(_tracer, "primitive", __FUNCTION__, "pos", pos, "ignoreTimes", ignoreTimes, "startPos", startPos);
+    if (callgraph *calls = _callgraph) {
+        loc_t ref = calls->find_caller(pos, ignoreTimes, startPos);
+        if (!ref) retcustomerror(out_of_range, "call reference not found");
+        return tspan.ret(ref);
+    }
+
     vmem bl(*_vmem, startPos);
     if (bl() == insn::bl) goto isBL;
     while (true){
         while (++bl != insn::bl);
     isBL:
         if (bl().imm() == (uint64_t)pos && --ignoreTimes <0)
-            return bl;
+            return tspan.ret((loc_t)bl);
     }
     reterror("call reference not found");
 }
 
 
+std::vector<loc_t> patchfinder64::find_call_refs(loc_t pos){
+    if (callgraph *calls = _callgraph) return calls->callers(pos);
+
+    std::vector<loc_t> ret;
+    try {
+        loc_t ref = 0;
+        while (true) {
+            ref = find_call_ref(pos, 0, ref);
+            ret.push_back(ref);
+            ref += 4;
+        }
+    } catch (tihmstar::out_of_range &e) {
+        //no more refs
+    }
+    return ret;
+}
+
+std::vector<loc_t> patchfinder64::find_callees(loc_t start, loc_t end){
+    std::vector<loc_t> ret;
+    if (callgraph *calls = _callgraph) {
+        for (auto &e : calls->callees(start, end)) {
+            ret.push_back(e.target);
+        }
+        return ret;
+    }
+
+    decodetable *decoded = _decoded;
+    if (const decodetable::segment *seg = decoded ? decoded->segmentFor(start) : NULL) {
+        if (end <= seg->end()) {
+            for (size_t i = seg->idx(start); seg->pc(i) < end; i++) {
+                if (seg->type[i] != insn::bl) continue;
+                ret.push_back((seg->flags[i] & decodetable::kHasImm) ? seg->imm[i] : seg->decode(i).imm());
+            }
+            return ret;
+        }
+    }
+
+    vmem iter(*_vmem, start);
+    try {
+        for (; (loc_t)iter.pc() < end; ++iter) {
+            if (iter() == insn::bl) ret.push_back(iter().imm());
+        }
+    } catch (tihmstar::out_of_range &e) {
+        //end of segment
+    }
+    return ret;
+}
+
+void patchfinder64::build_callgraph_index(){
+    lazyInit(_callgraph, _lazyLock, [this]{ return new callgraph(_vmem);});
+}
+
 loc_t patchfinder64::find_branch_ref(loc_t pos, int limit, int ignoreTimes){
+    if (branchindex *branches = _branches) return branches->find_source(pos, limit, ignoreTimes);
+
     vmem brnch(*_vmem, pos);
 
     if (limit < 0 ) {
         while (true) {
             while ((--brnch).supertype() != insn::supertype::sut_branch_imm){
                 limit +=4;
-                retassure(limit < 0, "search limit reached");
+                if (limit >= 0) retcustomerror(limit_reached, "search limit reached");
             }
             if (brnch().imm() == pos){
                 if (ignoreTimes--  <=0)
@@ -251,7 +713,7 @@ loc_t patchfinder64::find_branch_ref(loc_t pos, int limit, int ignoreTimes){
         while (true) {
            while ((++brnch).supertype() != insn::supertype::sut_branch_imm){
                limit -=4;
-               retassure(limit > 0, "search limit reached");
+               if (limit <= 0) retcustomerror(limit_reached, "search limit reached");
            }
            if (brnch().imm() == pos){
                if (ignoreTimes--  <=0)
@@ -262,34 +724,155 @@ loc_t patchfinder64::find_branch_ref(loc_t pos, int limit, int ignoreTimes){
     reterror("branchref not found");
 }
 
-loc_t patchfinder64::findnops(uint16_t nopCnt, bool useNops){
-    uint32_t *needle = NULL;
-    cleanup([&]{
-        safeFree(needle);
+std::vector<loc_t> patchfinder64::find_branch_refs(loc_t pos){
+    build_branch_index();
+    return _branches.load()->sources(pos);
+}
+
+void patchfinder64::build_branch_index(){
+    lazyInit(_branches, _lazyLock, [this]{ return new branchindex(_vmem);});
+}
+
+caveallocator *patchfinder64::caves(){
+    return lazyInit(_caves, _lazyLock, [this]{ return new caveallocator(_vmem);});
+}
+
+loc_t patchfinder64::findnops(uint16_t nopCnt, bool useNops, uint32_t align, uint32_t alignOffset){
+    return caves()->allocate(caveallocator::kNop, nopCnt*4, align, alignOffset, useNops);
+}
+
+void patchfinder64::release_nops(loc_t pos){
+    caveallocator *allocator = _caves;
+    retassure(allocator, "no nops were ever reserved");
+    allocator->release(pos);
+}
+
+cavescope::cavescope(patchfinder64 *pf)
+: cavescope(pf->caves())
+{
+    //
+}
+
+void patchfinder64::use_index_file(const char *path){
+    uint64_t imageHash = resultcache::hashImage(_buf, _bufSize);
+    indexfile *file = NULL;
+    try {
+        file = lazyInit(_indexFile, _lazyLock, [&]{ return new indexfile(path, imageHash, _bufSize);});
+    } catch (tihmstar::exception &e) {
+        debug("index file %s unusable, rebuilding it\n", path);
+    }
+
+    if (!file) {
+        build_xref_index();
+        build_callgraph_index();
+        build_function_table();
+        build_string_index();
+        indexfile::write(path, imageHash, _bufSize, {_xrefs, _callgraph, _functions, _strings, caves()});
+        return;
+    }
+
+    lazyInit(_xrefs, _lazyLock, [&]{
+        return new xrefindex(file->get<xrefindex::xref>(indexfile::kXrefs));
     });
-    loc_t pos = 0;
-    needle = (uint32_t *)malloc(nopCnt*4);
-    
-    for (uint16_t i=0; i<nopCnt; i++) {
-        needle[i] = *(uint32_t*)"\x1F\x20\x03\xD5";
+    lazyInit(_callgraph, _lazyLock, [&]{
+        return new callgraph(file->get<callgraph::edge>(indexfile::kCallsBySite), file->get<callgraph::edge>(indexfile::kCallsByTarget));
+    });
+    lazyInit(_functions, _lazyLock, [&]{
+        return new functiontable(file->get<functiontable::anchor>(indexfile::kFunctionAnchors),
+                                 file->get<loc_t>(indexfile::kFunctionRets),
+                                 file->get<std::pair<loc_t, loc_t>>(indexfile::kFunctionSegments));
+    });
+    lazyInit(_strings, _lazyLock, [&]{
+        column<uint64_t> uniqueCnt = file->get<uint64_t>(indexfile::kStringUniqueCnt);
+        retassure(uniqueCnt.size() == 1, "bad string count in index file");
+        return new stringindex(_buf, file->get<stringindex::entry>(indexfile::kStrings), file->get<uint32_t>(indexfile::kStringSlots),
+                               file->get<uint32_t>(indexfile::kStringTails), (size_t)uniqueCnt[0]);
+    });
+    lazyInit(_caves, _lazyLock, [&]{
+        return new caveallocator(file->get<caveallocator::run>(indexfile::kNopRuns), file->get<caveallocator::run>(indexfile::kZeroRuns));
+    });
+}
+
+void patchfinder64::enable_result_cache(const char *dir){
+    lazyInit(_cache, _lazyLock, [&]{ return new resultcache(dir, _buf, _bufSize);});
+}
+
+void patchfinder64::enable_tracing(const char *path){
+#ifdef NO_TRACING
+    reterror("built with NO_TRACING");
+#else
+    lazyInit(_tracer, _lazyLock, [&]{ return new tracer(path);});
+#endif
+}
+
+void patchfinder64::write_trace(){
+    tracer *t = _tracer;
+    retassure(t, "tracing is not enabled");
+    t->write();
+}
+
+bool patchfinder64::cacheLookup(cachequery &q, const char *finder, const std::string &args, std::vector<patch> *patches, loc_t *value){
+    resultcache *cache = _cache;
+    q.finder = finder;
+    q.args = args;
+    q.enabled = cache != NULL;
+    if (!cache) return false;
+
+    resultcache::entry e = {};
+    if (cache->get(finder, args, e)) {
+        std::unique_ptr<cavescope> reserved(e.caves.size() ? new cavescope(this) : NULL);
+        try {
+            for (auto &res : e.caves) {
+                _caves.load()->reserve(res.k, res.start, res.end - res.start);
+            }
+            debug("%s: result cache hit\n", finder);
+            if (patches) *patches = std::move(e.patches);
+            if (value) *value = e.value;
+            return true;
+        } catch (tihmstar::exception &err) {
+            //a cave it used is taken by now, run the finder so it picks another one
+            reserved->rollback();
+        }
     }
 
-    
-    pos = -4;
-nextNops:
-    pos = _vmem->memmem(needle, nopCnt*4,pos+4);
-    std::pair<loc_t, loc_t> range(pos,pos+4*nopCnt);
-    
-    for (auto &r : _usedNops) {
-        if (r.first > range.first && r.first < range.second) goto nextNops; //used range inside found range
-        if (range.first > r.first && range.first < r.second) goto nextNops; //found range inside used range
+    q.caves.reset(new cavescope(this));
+    return false;
+}
+
+void patchfinder64::cacheStore(const cachequery &q, const std::vector<patch> *patches, loc_t value){
+    if (!q.enabled) return;
+    resultcache::entry e = {value, {}, {}};
+    if (patches) {
+        for (auto &p : *patches) {
+            if (p.needsSlide()) return; //slide callbacks can't go to disk
+        }
+        e.patches = *patches;
     }
+    if (q.caves) e.caves = _caves.load()->ledger(*q.caves);
 
-    if (useNops) {
-        _usedNops.push_back(range);
+    try {
+        _cache.load()->put(q.finder, q.args, e);
+    } catch (tihmstar::exception &err) {
+        debug("%s: failed to store result in cache\n", q.finder.c_str());
     }
-    
-    return pos;
+}
+
+bool patchfinder64::cacheLookup(cachequery &q, const char *finder, const std::string &args, std::vector<patch> &out){
+    return cacheLookup(q, finder, args, &out, NULL);
+}
+
+bool patchfinder64::cacheLookup(cachequery &q, const char *finder, const std::string &args, loc_t &out){
+    return cacheLookup(q, finder, args, NULL, &out);
+}
+
+std::vector<patch> patchfinder64::cacheStore(const cachequery &q, std::vector<patch> patches){
+    cacheStore(q, &patches, 0);
+    return patches;
+}
+
+loc_t patchfinder64::cacheStore(const cachequery &q, loc_t value){
+    cacheStore(q, NULL, value);
+    return value;
 }
 
 uint32_t patchfinder64::pageshit_for_pagesize(uint32_t pagesize){
@@ -0,0 +1,61 @@
+//
+//  regstatecache.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+
+#include <libgeneral/macros.h>
+
+#include "regstatecache.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+regstatecache::regstatecache(size_t capacity)
+: _capacity(capacity)
+{
+    retassure(_capacity, "capacity can't be 0");
+}
+
+regstatecache::function &regstatecache::get(loc_t start){
+    auto it = _map.find(start);
+    if (it != _map.end()) {
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return _lru.front();
+    }
+
+    if (_lru.size() >= _capacity) {
+        _map.erase(_lru.back().start);
+        _lru.pop_back();
+    }
+    _lru.push_front({start, {regstate{}}});
+    _map[start] = _lru.begin();
+    return _lru.front();
+}
+
+size_t regstatecache::nearest(loc_t start, size_t want, regstate &state){
+    std::lock_guard<std::mutex> lk(_lock);
+    function &func = get(start);
+    size_t k = std::min(want, func.checkpoints.size()-1);
+    state = func.checkpoints[k];
+    return k;
+}
+
+void regstatecache::add(loc_t start, size_t k, const regstate &state){
+    std::lock_guard<std::mutex> lk(_lock);
+    function &func = get(start);
+    //another thread may have stored it first, or the function was evicted meanwhile
+    if (func.checkpoints.size() == k) func.checkpoints.push_back(state);
+}
+
+size_t regstatecache::size() const{
+    std::lock_guard<std::mutex> lk(_lock);
+    return _lru.size();
+}
+
+void regstatecache::clear(){
+    std::lock_guard<std::mutex> lk(_lock);
+    _map.clear();
+    _lru.clear();
+}
@@ -0,0 +1,67 @@
+//
+//  regstatecache.hpp
+//  liboffsetfinder64
+//
+
+#ifndef regstatecache_hpp
+#define regstatecache_hpp
+
+#include <array>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+#include <liboffsetfinder64/common.h>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            LRU of register snapshots for find_register_value, keyed by the address the replay starts at.
+            checkpoints[k] is the state before the instruction at checkpointPC(start, k),
+            they are only appended while queries move further into the function.
+            All members lock, states are copied in and out so entries may be evicted while a caller replays.
+         */
+        class regstatecache{
+        public:
+            static constexpr size_t kCheckpointInterval = 64; //instructions
+            static constexpr size_t kDefaultCapacity = 64;    //functions
+
+            typedef std::array<uint64_t, 32> regstate;
+        private:
+            struct function{
+                loc_t start;
+                std::vector<regstate> checkpoints;
+            };
+            std::list<function> _lru; //most recently used first
+            std::unordered_map<loc_t, std::list<function>::iterator> _map;
+            size_t _capacity;
+            mutable std::mutex _lock;
+
+            function &get(loc_t start);
+
+        public:
+            regstatecache(size_t capacity = kDefaultCapacity);
+
+            static loc_t checkpointPC(loc_t start, size_t k) { return start + k*kCheckpointInterval*4;}
+
+            /*
+                copies the furthest checkpoint k <= want of the function at start into state and returns k.
+                A missing function is created with an all zero first checkpoint.
+             */
+            size_t nearest(loc_t start, size_t want, regstate &state);
+
+            /*
+                store checkpoint k, ignored unless it is the next one missing
+             */
+            void add(loc_t start, size_t k, const regstate &state);
+
+            size_t size() const;
+            void clear();
+        };
+    };
+};
+
+#endif /* regstatecache_hpp */
@@ -0,0 +1,259 @@
+//
+//  resultcache.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libgeneral/macros.h>
+
+#include "resultcache.hpp"
+#include "parallelscan.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+#define HASH_CHUNK      0x400000
+#define ENTRY_MAGIC     "OF64RC01"
+#define CACHE_FORMAT    "1" //part of the directory name, bump it when finder results or the entry format change
+
+#pragma mark xxh64
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t v, int r){
+    return (v << r) | (v >> (64-r));
+}
+
+static inline uint64_t read64(const uint8_t *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input){
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxhMerge(uint64_t acc, uint64_t val){
+    acc ^= xxhRound(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t xxh64(const void *input, size_t len, uint64_t seed){
+    const uint8_t *p = (const uint8_t *)input;
+    const uint8_t *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxhRound(v1, read64(p));
+            v2 = xxhRound(v2, read64(p+8));
+            v3 = xxhRound(v3, read64(p+16));
+            v4 = xxhRound(v4, read64(p+24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxhMerge(h, v1);
+        h = xxhMerge(h, v2);
+        h = xxhMerge(h, v3);
+        h = xxhMerge(h, v4);
+    }else{
+        h = seed + XXH_P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxhRound(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+#pragma mark serialization
+
+namespace {
+    struct writer{
+        std::vector<uint8_t> buf;
+
+        void put(const void *p, size_t len){
+            buf.insert(buf.end(), (const uint8_t *)p, (const uint8_t *)p + len);
+        }
+        template <typename T> void put(T v){
+            put(&v, sizeof(v));
+        }
+    };
+
+    struct reader{
+        const uint8_t *p;
+        const uint8_t *end;
+
+        bool get(void *out, size_t len){
+            if ((size_t)(end - p) < len) return false;
+            memcpy(out, p, len);
+            p += len;
+            return true;
+        }
+        template <typename T> bool get(T &v){
+            return get(&v, sizeof(v));
+        }
+    };
+}
+
+static bool mkdirs(const std::string &path){
+    for (size_t pos = 1; pos <= path.size(); pos++) {
+        if (pos != path.size() && path[pos] != '/') continue;
+        std::string sub = path.substr(0, pos);
+        if (mkdir(sub.c_str(), 0755) && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+static std::string hex64(uint64_t v){
+    char buf[0x20];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)v);
+    return buf;
+}
+
+#pragma mark resultcache
+
+uint64_t resultcache::hashImage(const void *buf, size_t size){
+    size_t chunkCnt = (size + HASH_CHUNK-1) / HASH_CHUNK;
+    std::vector<uint64_t> chunkHashes(chunkCnt);
+    parallelscan::run(chunkCnt, [&](size_t i){
+        size_t off = i*HASH_CHUNK;
+        chunkHashes[i] = xxh64((const uint8_t *)buf + off, std::min((size_t)HASH_CHUNK, size-off), 0);
+    });
+    return xxh64(chunkHashes.data(), chunkHashes.size()*sizeof(uint64_t), size);
+}
+
+resultcache::resultcache(const std::string &root, const void *image, size_t imageSize){
+    retassure(root.size(), "empty cache directory");
+    _dir = root + "/" + hex64(hashImage(image, imageSize)) + "-f" CACHE_FORMAT "-" VERSION_COMMIT_COUNT "-" VERSION_COMMIT_SHA;
+    retassure(mkdirs(_dir), "failed to create cache directory %s errno=%d", _dir.c_str(), errno);
+}
+
+std::string resultcache::path(const std::string &finder, const std::string &args) const{
+    std::string key = finder + '\0' + args;
+    return _dir + "/" + finder + "-" + hex64(xxh64(key.data(), key.size(), 0));
+}
+
+bool resultcache::get(const std::string &finder, const std::string &args, entry &out) const{
+    std::vector<uint8_t> data;
+    {
+        FILE *f = fopen(path(finder, args).c_str(), "rb");
+        if (!f) return false;
+        cleanup([&]{
+            fclose(f);
+        })
+        uint8_t tmp[0x1000];
+        for (size_t cnt; (cnt = fread(tmp, 1, sizeof(tmp), f));) {
+            data.insert(data.end(), tmp, tmp+cnt);
+        }
+        if (ferror(f)) return false;
+    }
+
+    reader r{data.data(), data.data() + data.size()};
+    char magic[sizeof(ENTRY_MAGIC)-1];
+    if (!r.get(magic, sizeof(magic)) || memcmp(magic, ENTRY_MAGIC, sizeof(magic))) return false;
+
+    std::string storedArgs;
+    uint32_t argsLen = 0;
+    if (!r.get(argsLen)) return false;
+    storedArgs.resize(argsLen);
+    if (!r.get(&storedArgs[0], argsLen) || storedArgs != args) return false; //hash collision
+
+    entry e = {};
+    uint32_t caveCnt = 0;
+    if (!r.get(e.value) || !r.get(caveCnt)) return false;
+    for (uint32_t i=0; i<caveCnt; i++) {
+        caveallocator::reservation res = {};
+        uint32_t kind = 0;
+        if (!r.get(res.start) || !r.get(res.end) || !r.get(kind) || kind >= caveallocator::kKindCnt) return false;
+        res.k = (caveallocator::kind)kind;
+        e.caves.push_back(res);
+    }
+
+    uint32_t patchCnt = 0;
+    if (!r.get(patchCnt)) return false;
+    for (uint32_t i=0; i<patchCnt; i++) {
+        loc_t location = 0;
+        uint64_t size = 0;
+        if (!r.get(location) || !r.get(size) || size > (uint64_t)(r.end - r.p)) return false;
+        e.patches.push_back({location, r.p, (size_t)size});
+        r.p += size;
+    }
+    if (r.p != r.end) return false;
+
+    out = std::move(e);
+    return true;
+}
+
+void resultcache::put(const std::string &finder, const std::string &args, const entry &e) const{
+    writer w;
+    w.put(ENTRY_MAGIC, sizeof(ENTRY_MAGIC)-1);
+    w.put((uint32_t)args.size());
+    w.put(args.data(), args.size());
+    w.put(e.value);
+    w.put((uint32_t)e.caves.size());
+    for (auto &res : e.caves) {
+        w.put(res.start);
+        w.put(res.end);
+        w.put((uint32_t)res.k);
+    }
+    w.put((uint32_t)e.patches.size());
+    for (auto &p : e.patches) {
+        w.put(p._location);
+        w.put((uint64_t)p._patchSize);
+        w.put(p._patch, p._patchSize);
+    }
+
+    std::string dst = path(finder, args);
+    std::string tmp = dst + ".tmp" + std::to_string(getpid()) + "-" + hex64(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    FILE *f = fopen(tmp.c_str(), "wb");
+    retassure(f, "failed to create %s errno=%d", tmp.c_str(), errno);
+    bool ok = fwrite(w.buf.data(), 1, w.buf.size(), f) == w.buf.size();
+    ok &= !fclose(f);
+    if (!ok || rename(tmp.c_str(), dst.c_str())) {
+        unlink(tmp.c_str());
+        reterror("failed to write cache entry %s", dst.c_str());
+    }
+}
@@ -0,0 +1,51 @@
+//
+//  resultcache.hpp
+//  liboffsetfinder64
+//
+
+#ifndef resultcache_hpp
+#define resultcache_hpp
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <liboffsetfinder64/common.h>
+#include <liboffsetfinder64/patch.hpp>
+#include "caveallocator.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Finder results on disk, in <root>/<image hash>-f<format>-<library version>/<finder>-<key hash>.
+            The image hash is XXH64 over 4MiB chunks (hashed in parallel) and then over the chunk hashes.
+            Entries are written to a temporary file and renamed, so concurrent writers never leave a torn entry.
+            Anything unreadable is a miss.
+         */
+        class resultcache{
+        public:
+            struct entry{
+                loc_t value;
+                std::vector<patch> patches;
+                std::vector<caveallocator::reservation> caves; //reservations the finder made
+            };
+        private:
+            std::string _dir;
+
+            std::string path(const std::string &finder, const std::string &args) const;
+
+        public:
+            resultcache(const std::string &root, const void *image, size_t imageSize);
+
+            static uint64_t hashImage(const void *buf, size_t size);
+
+            bool get(const std::string &finder, const std::string &args, entry &out) const;
+            void put(const std::string &finder, const std::string &args, const entry &e) const;
+
+            const std::string &dir() const { return _dir;}
+        };
+    };
+};
+
+#endif /* resultcache_hpp */
@@ -0,0 +1,30 @@
+//
+//  segmentview.cpp
+//  liboffsetfinder64
+//
+
+#include <libgeneral/macros.h>
+
+#include "segmentview.hpp"
+#include "OFexception.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace libinsn;
+
+std::vector<segmentview> tihmstar::offsetfinder64::segmentviews(vmem *mem, int perms){
+    std::vector<segmentview> ret;
+    vmem iter(*mem, 0, perms);
+
+    try {
+        for (;;iter.nextSeg()) {
+            vsegment cseg = iter.curSeg();
+            if (cseg.size() < 4)
+                continue;
+            ret.push_back({(loc_t)cseg.base(), (const uint8_t *)cseg.memoryForLoc(cseg.base()), cseg.size(), cseg.segname()});
+        }
+    } catch (tihmstar::out_of_range &e) {
+        //no more segments
+    }
+    return ret;
+}
@@ -0,0 +1,41 @@
+//
+//  segmentview.hpp
+//  liboffsetfinder64
+//
+
+#ifndef segmentview_hpp
+#define segmentview_hpp
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include <libinsn/vmem.hpp>
+#include <liboffsetfinder64/common.h>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            raw view of one vmem segment.
+            The index builders walk instruction words directly instead of going through the vmem iterator.
+         */
+        struct segmentview{
+            loc_t base;
+            const uint8_t *buf;
+            size_t size;
+            std::string name;
+
+            loc_t end() const { return base + size;}
+            size_t wordCnt() const { return size/4;}
+            const uint32_t *words() const { return (const uint32_t *)buf;}
+        };
+
+        /*
+            all segments of mem which have (at least) the permissions perms
+         */
+        std::vector<segmentview> segmentviews(tihmstar::libinsn::vmem *mem, int perms);
+    };
+};
+
+#endif /* segmentview_hpp */
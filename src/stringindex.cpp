@@ -0,0 +1,190 @@
+//
+//  stringindex.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+
+#include <string.h>
+
+#include <libgeneral/macros.h>
+
+#include "stringindex.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+static uint32_t strhash(const char *str, size_t len){
+    //FNV-1a
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i=0; i<len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+static bool isStringChar(uint8_t c){
+    return (c >= 0x20 && c < 0x7f) || c == '\t' || c == '\n' || c == '\r';
+}
+
+stringindex::stringindex(const uint8_t *image)
+: _image(image), _uniqueCnt(0)
+{
+    //
+}
+
+stringindex::stringindex(const uint8_t *image, column<entry> &&entries, column<uint32_t> &&slots, column<uint32_t> &&tails, size_t uniqueCnt)
+: _image(image), _entries(std::move(entries)), _slots(std::move(slots)), _tails(std::move(tails)), _uniqueCnt(uniqueCnt)
+{
+    //
+}
+
+bool stringindex::isHeuristicString(const char *str, size_t len){
+    if (len < kMinHeuristicLen) return false;
+    for (size_t i=0; i<len; i++) {
+        if (!isStringChar((uint8_t)str[i])) return false;
+    }
+    return true;
+}
+
+void stringindex::addString(const char *str, loc_t addr, uint32_t len){
+    _pending.push_back({(uint64_t)((const uint8_t *)str - _image), addr, len, strhash(str, len), kNoEntry});
+}
+
+void stringindex::addCstringRegion(const segmentview &region){
+    const char *begin = (const char *)region.buf;
+    const char *end = begin + region.size;
+
+    for (const char *str = begin; str < end;) {
+        const char *nul = (const char *)memchr(str, '\0', end-str);
+        if (!nul) break; //unterminated tail
+        if (nul > str) {
+            addString(str, region.base + (str-begin), (uint32_t)(nul-str));
+        }
+        str = nul+1;
+    }
+}
+
+void stringindex::addHeuristicRegion(const segmentview &region){
+    const uint8_t *buf = region.buf;
+    size_t runStart = 0;
+
+    for (size_t i=0; i<region.size; i++) {
+        if (isStringChar(buf[i])) continue;
+        if (buf[i] == '\0' && i - runStart >= kMinHeuristicLen) {
+            addString((const char *)&buf[runStart], region.base + runStart, (uint32_t)(i-runStart));
+        }
+        runStart = i+1;
+    }
+}
+
+void stringindex::finalize(){
+    std::vector<entry> entries = std::move(_pending);
+    _pending.clear();
+    std::sort(entries.begin(), entries.end(), [](const entry &a, const entry &b){
+        return a.addr < b.addr;
+    });
+    //regions may overlap (e.g. a section is also covered by the heuristic pass)
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const entry &a, const entry &b){
+        return a.addr == b.addr;
+    }), entries.end());
+    retassure(entries.size() < kNoEntry, "too many strings to index");
+
+    size_t slotCnt = 16;
+    while (slotCnt < entries.size()*2) slotCnt <<= 1;
+    std::vector<uint32_t> slots(slotCnt, 0);
+    _uniqueCnt = 0;
+
+    std::vector<uint32_t> chainEnd(entries.size(), kNoEntry);
+    for (uint32_t i=0; i<entries.size(); i++) {
+        entry &e = entries[i];
+        for (size_t s = e.hash & (slotCnt-1);; s = (s+1) & (slotCnt-1)) {
+            if (!slots[s]) {
+                slots[s] = i+1;
+                chainEnd[i] = i;
+                _uniqueCnt++;
+                break;
+            }
+            uint32_t h = slots[s]-1;
+            const entry &he = entries[h];
+            if (he.hash == e.hash && he.len == e.len && !memcmp(_image + he.off, _image + e.off, e.len)) {
+                entries[chainEnd[h]].next = i;
+                chainEnd[h] = i;
+                break;
+            }
+        }
+    }
+
+    std::vector<uint32_t> tailOrder(entries.size());
+    for (uint32_t i=0; i<entries.size(); i++) {
+        tailOrder[i] = i;
+    }
+    std::sort(tailOrder.begin(), tailOrder.end(), [&](uint32_t a, uint32_t b){
+        const entry &ea = entries[a];
+        const entry &eb = entries[b];
+        const uint8_t *pa = _image + ea.off + ea.len;
+        const uint8_t *pb = _image + eb.off + eb.len;
+        for (uint32_t i=1; i<=ea.len && i<=eb.len; i++) {
+            if (pa[-(int64_t)i] != pb[-(int64_t)i]) return pa[-(int64_t)i] < pb[-(int64_t)i];
+        }
+        if (ea.len != eb.len) return ea.len < eb.len;
+        return ea.addr < eb.addr;
+    });
+
+    _entries = std::move(entries);
+    _slots = std::move(slots);
+    _tails = std::move(tailOrder);
+}
+
+const stringindex::entry *stringindex::head(const char *str, size_t len) const{
+    if (_slots.empty()) return NULL;
+    uint32_t hash = strhash(str, len);
+    size_t slotCnt = _slots.size();
+
+    for (size_t s = hash & (slotCnt-1); _slots[s]; s = (s+1) & (slotCnt-1)) {
+        const entry &e = _entries[_slots[s]-1];
+        if (e.hash == hash && e.len == len && !memcmp(_image + e.off, str, len))
+            return &e;
+    }
+    return NULL;
+}
+
+int stringindex::cmpTail(const entry &e, const char *str, size_t len) const{
+    //reversed e against reversed str, 0 if str is a tail of e
+    const uint8_t *pe = _image + e.off + e.len;
+    const uint8_t *ps = (const uint8_t *)str + len;
+    for (size_t i=1; i<=e.len && i<=len; i++) {
+        if (pe[-(int64_t)i] != ps[-(int64_t)i]) return pe[-(int64_t)i] < ps[-(int64_t)i] ? -1 : 1;
+    }
+    return e.len < len ? -1 : 0;
+}
+
+loc_t stringindex::find(const char *str, size_t len, loc_t startAddr) const{
+    for (const entry *e = head(str, len); e; e = (e->next == kNoEntry) ? NULL : &_entries[e->next]) {
+        if (e->addr >= startAddr)
+            return e->addr;
+    }
+    return 0;
+}
+
+std::vector<loc_t> stringindex::findAll(const char *str, size_t len) const{
+    std::vector<loc_t> ret;
+    for (const entry *e = head(str, len); e; e = (e->next == kNoEntry) ? NULL : &_entries[e->next]) {
+        ret.push_back(e->addr);
+    }
+    return ret;
+}
+
+loc_t stringindex::findTail(const char *str, size_t len, loc_t startAddr) const{
+    auto it = std::lower_bound(_tails.begin(), _tails.end(), 0, [&](uint32_t i, int){
+        return cmpTail(_entries[i], str, len) < 0;
+    });
+    loc_t ret = 0;
+    for (; it != _tails.end() && !cmpTail(_entries[*it], str, len); ++it) {
+        const entry &e = _entries[*it];
+        loc_t tail = e.addr + e.len - len;
+        if (tail >= startAddr && (!ret || tail < ret)) ret = tail;
+    }
+    return ret;
+}
@@ -0,0 +1,96 @@
+//
+//  stringindex.hpp
+//  liboffsetfinder64
+//
+
+#ifndef stringindex_hpp
+#define stringindex_hpp
+
+#include <vector>
+
+#include <stdint.h>
+
+#include <liboffsetfinder64/common.h>
+#include "segmentview.hpp"
+#include "column.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Open addressing hash table of NUL terminated strings.
+            Maps the exact string to all of its locations in address order.
+            A second order of all entries by their reversed string finds strings which are only the tail of a longer one.
+            Entries refer to the image by offset, so the tables don't depend on where it is loaded.
+         */
+        class stringindex{
+        public:
+            struct entry{
+                uint64_t off;   //from the image start
+                loc_t addr;
+                uint32_t len;   //without NUL
+                uint32_t hash;
+                uint32_t next;  //next location of the same string, kNoEntry if last
+            };
+            static constexpr uint32_t kNoEntry = (uint32_t)-1;
+        private:
+            const uint8_t *_image;
+            std::vector<entry> _pending;  //until finalize
+            column<entry> _entries;
+            column<uint32_t> _slots;      //entry index + 1, 0 is empty
+            column<uint32_t> _tails;      //entry indices ordered by reversed string, then address
+            size_t _uniqueCnt;
+
+            void addString(const char *str, loc_t addr, uint32_t len);
+            const entry *head(const char *str, size_t len) const;
+            int cmpTail(const entry &e, const char *str, size_t len) const;
+
+        public:
+            /*
+                image is the buffer all regions point into
+             */
+            stringindex(const uint8_t *image);
+            stringindex(const uint8_t *image, column<entry> &&entries, column<uint32_t> &&slots, column<uint32_t> &&tails, size_t uniqueCnt);
+
+            /*
+                every NUL separated string, e.g. a S_CSTRING_LITERALS section
+             */
+            void addCstringRegion(const segmentview &region);
+
+            /*
+                printable runs of at least kMinHeuristicLen chars which are terminated by NUL
+             */
+            void addHeuristicRegion(const segmentview &region);
+            static constexpr uint32_t kMinHeuristicLen = 4;
+
+            /*
+                str is long enough and printable, so every str\0 in a heuristic region ends an indexed run
+             */
+            static bool isHeuristicString(const char *str, size_t len);
+
+            /*
+                build the hash table, call after all regions were added
+             */
+            void finalize();
+
+            size_t size() const { return _entries.size();}
+            size_t uniqueCnt() const { return _uniqueCnt;}
+            const column<entry> &entries() const { return _entries;}
+            const column<uint32_t> &slots() const { return _slots;}
+            const column<uint32_t> &tails() const { return _tails;}
+
+            /*
+                first location of str at or after startAddr, 0 if not found
+             */
+            loc_t find(const char *str, size_t len, loc_t startAddr = 0) const;
+            std::vector<loc_t> findAll(const char *str, size_t len) const;
+
+            /*
+                first location at or after startAddr where str ends an indexed string, whole strings included.
+                0 if not found
+             */
+            loc_t findTail(const char *str, size_t len, loc_t startAddr = 0) const;
+        };
+    };
+};
+
+#endif /* stringindex_hpp */
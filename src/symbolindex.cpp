@@ -0,0 +1,94 @@
+//
+//  symbolindex.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+
+#include <string.h>
+
+#include <mach-o/nlist.h>
+
+#include <libgeneral/macros.h>
+
+#include "symbolindex.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+static uint32_t strhash(const char *str, size_t len){
+    //FNV-1a
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i=0; i<len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+symbolindex::symbolindex(const void *symtab, uint32_t nsyms, const char *strtab, uint32_t strsize){
+    const struct nlist_64 *entry = (const struct nlist_64 *)symtab;
+    _byName.reserve(nsyms);
+    for (uint32_t i = 0; i < nsyms; i++, entry++) {
+        uint32_t strx = entry->n_un.n_strx;
+        if (strx >= strsize) continue;
+        const char *name = strtab + strx;
+        uint32_t len = (uint32_t)strnlen(name, strsize - strx);
+        _byName.push_back({name, (loc_t)entry->n_value, len, strhash(name, len), entry->n_type});
+    }
+
+    size_t slotCnt = 16;
+    while (slotCnt < _byName.size()*2) slotCnt <<= 1;
+    _slots.assign(slotCnt, 0);
+    for (uint32_t i = 0; i < _byName.size(); i++) {
+        const symbol &sym = _byName[i];
+        for (size_t s = sym.hash & (slotCnt-1);; s = (s+1) & (slotCnt-1)) {
+            if (!_slots[s]) {
+                _slots[s] = i+1;
+                break;
+            }
+            const symbol &he = _byName[_slots[s]-1];
+            if (he.hash == sym.hash && he.len == sym.len && !memcmp(he.name, sym.name, sym.len)) {
+                break; //keep the first one, like the linear scan did
+            }
+        }
+
+        if (sym.type & N_STAB) continue;
+        if ((sym.type & N_TYPE) == N_SECT || (sym.type & N_TYPE) == N_ABS) {
+            _byAddr.push_back(sym);
+        }
+    }
+    std::stable_sort(_byAddr.begin(), _byAddr.end(), [](const symbol &a, const symbol &b){
+        return a.addr < b.addr;
+    });
+}
+
+const symbolindex::symbol *symbolindex::find(const char *name) const{
+    size_t len = strlen(name);
+    uint32_t hash = strhash(name, len);
+    size_t slotCnt = _slots.size();
+    for (size_t s = hash & (slotCnt-1); _slots[s]; s = (s+1) & (slotCnt-1)) {
+        const symbol &sym = _byName[_slots[s]-1];
+        if (sym.hash == hash && sym.len == len && !memcmp(sym.name, name, len))
+            return &sym;
+    }
+    return NULL;
+}
+
+const symbolindex::symbol *symbolindex::find(loc_t addr, bool allowOffset) const{
+    auto it = std::upper_bound(_byAddr.begin(), _byAddr.end(), addr, [](loc_t addr, const symbol &s){
+        return addr < s.addr;
+    });
+    auto first = std::lower_bound(_byAddr.begin(), it, addr, [](const symbol &s, loc_t addr){
+        return s.addr < addr;
+    });
+    if (first != it) return &*first;
+    if (!allowOffset) return NULL;
+
+    //absolute symbols aren't addresses, don't attribute code to them
+    while (it != _byAddr.begin()) {
+        --it;
+        if ((it->type & N_TYPE) == N_SECT) return &*it;
+    }
+    return NULL;
+}
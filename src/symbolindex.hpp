@@ -0,0 +1,55 @@
+//
+//  symbolindex.hpp
+//  liboffsetfinder64
+//
+
+#ifndef symbolindex_hpp
+#define symbolindex_hpp
+
+#include <vector>
+
+#include <stdint.h>
+
+#include <liboffsetfinder64/common.h>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Lookup tables over a LC_SYMTAB.
+            Names are hashed (open addressing) to the first symtab entry with that name,
+            defined symbols are additionally sorted by address for exact and containing lookups.
+         */
+        class symbolindex{
+        public:
+            struct symbol{
+                const char *name;
+                loc_t addr;
+                uint32_t len;
+                uint32_t hash;
+                uint8_t type;
+            };
+        private:
+            std::vector<symbol> _byName;    //symtab order
+            std::vector<uint32_t> _slots;   //_byName index + 1, 0 is empty
+            std::vector<symbol> _byAddr;    //defined symbols, address order, ties in symtab order
+
+        public:
+            symbolindex(const void *symtab, uint32_t nsyms, const char *strtab, uint32_t strsize);
+
+            /*
+                first symbol called name, NULL if there is none
+             */
+            const symbol *find(const char *name) const;
+
+            /*
+                first symbol at exactly addr.
+                With allowOffset the closest section symbol below addr if none starts there, NULL if there is none
+             */
+            const symbol *find(loc_t addr, bool allowOffset = false) const;
+
+            size_t size() const { return _byName.size();}
+        };
+    };
+};
+
+#endif /* symbolindex_hpp */
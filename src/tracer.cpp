@@ -0,0 +1,161 @@
+//
+//  tracer.cpp
+//  liboffsetfinder64
+//
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libgeneral/macros.h>
+
+#include "tracer.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+#define TRACE_ENV_VAR   "OFFSETFINDER64_TRACE"
+
+static void appendJSONString(std::string &out, const char *str, size_t len){
+    out += '"';
+    for (size_t i=0; i<len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        }else if (c < 0x20 || c >= 0x7f) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        }else{
+            out += (char)c;
+        }
+    }
+    out += '"';
+}
+
+#pragma mark tracevalue
+
+void tracevalue::append(std::string &out, bool v){
+    out += v ? "true" : "false";
+}
+
+void tracevalue::append(std::string &out, uint64_t v){
+    char buf[24];
+    snprintf(buf, sizeof(buf), "\"0x%llx\"", (unsigned long long)v);
+    out += buf;
+}
+
+void tracevalue::append(std::string &out, int64_t v){
+    out += std::to_string(v);
+}
+
+void tracevalue::append(std::string &out, const char *v){
+    if (!v) {
+        out += "null";
+        return;
+    }
+    appendJSONString(out, v, strlen(v));
+}
+
+void tracevalue::append(std::string &out, const std::string &v){
+    appendJSONString(out, v.data(), v.size());
+}
+
+void tracevalue::append(std::string &out, const std::vector<patch> &v){
+    out += '[';
+    for (size_t i=0; i<v.size(); i++) {
+        if (i) out += ", ";
+        out += "{\"loc\": ";
+        append(out, (uint64_t)v[i]._location);
+        out += ", \"size\": " + std::to_string(v[i]._patchSize) + "}";
+    }
+    out += ']';
+}
+
+void tracevalue::append(std::string &out, const std::vector<loc_t> &v){
+    out += '[';
+    for (size_t i=0; i<v.size(); i++) {
+        if (i) out += ", ";
+        append(out, (uint64_t)v[i]);
+    }
+    out += ']';
+}
+
+#pragma mark tracer
+
+tracer::tracer(const std::string &path)
+: _path(path), _epoch(std::chrono::steady_clock::now())
+{
+    //
+}
+
+tracer *tracer::global(){
+#ifdef NO_TRACING
+    return NULL;
+#else
+    //never deleted, finders may still record from static destructors after the exit handler wrote the file
+    static tracer *g = []() -> tracer *{
+        const char *path = getenv(TRACE_ENV_VAR);
+        if (!path || !*path) return NULL;
+        tracer *ret = new tracer(path);
+        atexit([]{
+            try {
+                global()->write();
+            } catch (tihmstar::exception &e) {
+                fprintf(stderr, "failed to write trace: %s\n", e.what());
+            }
+        });
+        return ret;
+    }();
+    return g;
+#endif
+}
+
+double tracer::now() const{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - _epoch).count();
+}
+
+uint32_t tracer::threadID(){
+    static std::atomic<uint32_t> nextID{1};
+    thread_local uint32_t tid = nextID++;
+    return tid;
+}
+
+void tracer::record(event &&e){
+    std::lock_guard<std::mutex> lk(_lock);
+    _events.push_back(std::move(e));
+}
+
+void tracer::write(){
+    std::vector<event> events;
+    {
+        std::lock_guard<std::mutex> lk(_lock);
+        events = _events;
+    }
+    int pid = getpid();
+    std::string tmp = _path + ".tmp" + std::to_string(pid) + "-" + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    FILE *f = fopen(tmp.c_str(), "w");
+    retassure(f, "failed to create %s errno=%d", tmp.c_str(), errno);
+
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(f, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"liboffsetfinder64\"}}", pid);
+    for (auto &e : events) {
+        fprintf(f, ",\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {%s}}",
+                e.name, e.cat, pid, e.tid, e.start, e.dur, e.args.c_str());
+    }
+    fprintf(f, "\n]}\n");
+
+    bool ok = !ferror(f);
+    ok &= !fclose(f);
+    if (!ok || rename(tmp.c_str(), _path.c_str())) {
+        unlink(tmp.c_str());
+        reterror("failed to write trace %s", _path.c_str());
+    }
+}
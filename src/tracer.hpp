@@ -0,0 +1,170 @@
+//
+//  tracer.hpp
+//  liboffsetfinder64
+//
+
+#ifndef tracer_hpp
+#define tracer_hpp
+
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+#include <liboffsetfinder64/common.h>
+#include <liboffsetfinder64/patch.hpp>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Timeline of finder and primitive calls, written as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+            Each span is a complete ("X") event on the calling thread with its arguments and result,
+            so nested calls show up as the steps of the finder that made them.
+            Building with NO_TRACING leaves tracespan empty, otherwise a span costs one pointer check while tracing is off.
+         */
+        class tracer{
+        public:
+            struct event{
+                const char *cat;
+                const char *name;
+                uint32_t tid;
+                double start;       //microseconds since the tracer was created
+                double dur;
+                std::string args;   //JSON members, without the braces
+            };
+        private:
+            std::string _path;
+            std::chrono::steady_clock::time_point _epoch;
+            std::mutex _lock;
+            std::vector<event> _events;
+
+        public:
+            tracer(const std::string &path);
+
+            /*
+                the tracer for OFFSETFINDER64_TRACE=<path>, shared by all finders of the process
+                and written when it exits. NULL if the variable isn't set
+             */
+            static tracer *global();
+
+            double now() const;
+            static uint32_t threadID();
+
+            void record(event &&e);
+
+            /*
+                all spans recorded so far, to a temporary file next to path which is renamed
+             */
+            void write();
+
+            const std::string &path() const { return _path;}
+        };
+
+        namespace tracevalue {
+            void append(std::string &out, bool v);
+            void append(std::string &out, uint64_t v); //hex, these are addresses more often than not
+            void append(std::string &out, int64_t v);
+            void append(std::string &out, const char *v);
+            void append(std::string &out, const std::string &v);
+            void append(std::string &out, const std::vector<patch> &v);
+            void append(std::string &out, const std::vector<loc_t> &v);
+
+            template <typename T>
+            void append_any(std::string &out, const T &v){
+                using U = std::remove_cv_t<T>;
+                if constexpr (std::is_same_v<U, bool>) {
+                    append(out, v);
+                }else if constexpr (std::is_integral_v<U> && std::is_unsigned_v<U> && sizeof(U) == sizeof(uint64_t)) {
+                    append(out, (uint64_t)v);
+                }else if constexpr (std::is_integral_v<U> || std::is_enum_v<U>) {
+                    append(out, (int64_t)v);
+                }else if constexpr (std::is_convertible_v<const U &, const char *>) {
+                    append(out, (const char *)v);
+                }else if constexpr (std::is_same_v<U, std::string> || std::is_same_v<U, std::vector<patch>> || std::is_same_v<U, std::vector<loc_t>>) {
+                    append(out, v);
+                }else{
+                    out += "null";
+                }
+            }
+        };
+
+        /*
+            one span, from construction to destruction:
+                tracespan tspan(_tracer, "finder", __FUNCTION__, "pos", pos);
+                ...
+                return tspan.ret(std::move(result));
+            Arguments come in name, value pairs and are only formatted while tracing.
+            ret takes the result by value and hands it back moved, so move locals in instead of copying them.
+         */
+        class tracespan{
+#ifndef NO_TRACING
+            tracer *_tracer;
+            std::unique_ptr<tracer::event> _ev;
+            int _uncaught;
+
+            void arg(const char *name){
+                _ev->args += _ev->args.size() ? ", \"" : "\"";
+                _ev->args += name;
+                _ev->args += "\": ";
+            }
+            void args(){}
+            template <typename T, typename ...Rest>
+            void args(const char *name, const T &v, const Rest &...rest){
+                arg(name);
+                tracevalue::append_any(_ev->args, v);
+                args(rest...);
+            }
+        public:
+            template <typename ...Args>
+            tracespan(tracer *t, const char *cat, const char *name, const Args &...a)
+            : _tracer(t), _uncaught(0)
+            {
+                if (!t) return;
+                _ev.reset(new tracer::event{cat, name, tracer::threadID(), 0, 0, {}});
+                args(a...);
+                _uncaught = std::uncaught_exceptions();
+                _ev->start = t->now();
+            }
+            ~tracespan(){
+                if (!_ev) return;
+                try {
+                    _ev->dur = _tracer->now() - _ev->start;
+                    if (std::uncaught_exceptions() > _uncaught) {
+                        arg("threw");
+                        _ev->args += "true";
+                    }
+                    _tracer->record(std::move(*_ev));
+                } catch (...) {
+                    //losing a span beats terminating while unwinding
+                }
+            }
+
+            template <typename T>
+            T ret(T v){
+                if (_ev) {
+                    arg("result");
+                    tracevalue::append_any(_ev->args, (const T &)v);
+                }
+                return v;
+            }
+#else
+        public:
+            template <typename ...Args>
+            tracespan(tracer *, const char *, const char *, const Args &...) {}
+
+            template <typename T>
+            T ret(T v){ return v;}
+#endif
+            tracespan(const tracespan &) = delete;
+            tracespan &operator=(const tracespan &) = delete;
+        };
+    };
+};
+
+#endif /* tracer_hpp */
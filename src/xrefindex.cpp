@@ -0,0 +1,116 @@
+//
+//  xrefindex.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+
+#include <libgeneral/macros.h>
+
+#include "xrefindex.hpp"
+#include "segmentview.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace libinsn;
+
+#define ADR_MASK        0x9F000000
+#define ADR_OPCODE      0x10000000
+#define ADRP_OPCODE     0x90000000
+#define MOVZ_MASK       0x7F800000
+#define MOVZ_OPCODE     0x52800000
+#define BCOND_MASK      0xFF000010
+#define BCOND_OPCODE    0x54000000
+
+//same lookahead as the linear scan in find_literal_ref
+#define LITERAL_REF_LOOKAHEAD 10
+
+static bool xrefLess(const xrefindex::xref &a, const xrefindex::xref &b){
+    if (a.target != b.target) return a.target < b.target;
+    return a.scanpc < b.scanpc;
+}
+
+static void addRef(std::vector<xrefindex::xref> &refs, size_t leadFirst, loc_t target, loc_t scanpc, loc_t refpc){
+    //the linear scan stops looking at a lead once it matched, so only the first hit per target counts
+    for (size_t i=leadFirst; i<refs.size(); i++) {
+        if (refs[i].target == target) return;
+    }
+    refs.push_back({target, scanpc, refpc});
+}
+
+xrefindex::xrefindex(vmem *mem){
+    std::vector<xref> refs;
+    for (auto &seg : segmentviews(mem, vsegment::kVMPROTEXEC)) {
+        const uint32_t *words = seg.words();
+        size_t wordCnt = seg.wordCnt();
+
+        for (size_t i=0; i<wordCnt; i++) {
+            uint32_t opcode = words[i];
+            loc_t pc = seg.base + i*4;
+
+            if ((opcode & ADR_MASK) == ADR_OPCODE || (opcode & BCOND_MASK) == BCOND_OPCODE) {
+                insn lead(opcode, pc);
+                if (lead == insn::adr || lead == insn::bcond) {
+                    refs.push_back({(loc_t)lead.imm(), pc, pc});
+                }
+            } else if ((opcode & ADR_MASK) == ADRP_OPCODE) {
+                insn lead(opcode, pc);
+                if (lead != insn::adrp) continue;
+                uint8_t rd = lead.rd();
+                uint64_t imm = lead.imm();
+                size_t leadFirst = refs.size();
+
+                for (size_t z=i+1; z<=i+LITERAL_REF_LOOKAHEAD && z<wordCnt; z++) {
+                    insn follow(words[z], seg.base + z*4);
+                    if ((follow == insn::add && follow.rd() == rd)
+                        || (follow.supertype() == insn::sut_memory && follow.subtype() == insn::st_immediate && follow.rn() == rd)) {
+                        addRef(refs, leadFirst, (loc_t)(imm + follow.imm()), pc, follow.pc());
+                    }
+                }
+            } else if ((opcode & MOVZ_MASK) == MOVZ_OPCODE) {
+                insn lead(opcode, pc);
+                if (lead != insn::movz) continue;
+                uint8_t rd = lead.rd();
+                uint64_t imm = lead.imm();
+                size_t leadFirst = refs.size();
+
+                for (size_t z=i+1; z<=i+LITERAL_REF_LOOKAHEAD && z<wordCnt; z++) {
+                    insn follow(words[z], seg.base + z*4);
+                    if (follow == insn::movk && follow.rd() == rd) {
+                        imm |= follow.imm();
+                        addRef(refs, leadFirst, (loc_t)imm, pc, follow.pc());
+                    } else if (follow == insn::movz && follow.rd() == rd) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    std::sort(refs.begin(), refs.end(), xrefLess);
+    _refs = std::move(refs);
+}
+
+xrefindex::xrefindex(column<xref> &&refs)
+: _refs(std::move(refs))
+{
+    //
+}
+
+loc_t xrefindex::find(loc_t target, int ignoreTimes, loc_t startPos) const{
+    auto it = std::lower_bound(_refs.begin(), _refs.end(), xref{target, startPos, 0}, xrefLess);
+    for (; it != _refs.end() && it->target == target; ++it) {
+        if (ignoreTimes-- <= 0)
+            return it->refpc;
+    }
+    return 0;
+}
+
+std::vector<loc_t> xrefindex::refs(loc_t target) const{
+    std::vector<loc_t> ret;
+    auto it = std::lower_bound(_refs.begin(), _refs.end(), xref{target, 0, 0}, xrefLess);
+    for (; it != _refs.end() && it->target == target; ++it) {
+        ret.push_back(it->refpc);
+    }
+    return ret;
+}
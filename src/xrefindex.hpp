@@ -0,0 +1,52 @@
+//
+//  xrefindex.hpp
+//  liboffsetfinder64
+//
+
+#ifndef xrefindex_hpp
+#define xrefindex_hpp
+
+#include <vector>
+
+#include <libinsn/vmem.hpp>
+#include <liboffsetfinder64/common.h>
+#include "column.hpp"
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Resolves adr, adrp+add, adrp+ldr/str (immediate), movz/movk chains and b.cond
+            in a single pass over all executable segments.
+            Lookups give the same answers as the linear scan in patchfinder64::find_literal_ref.
+         */
+        class xrefindex{
+        public:
+            struct xref{
+                loc_t target;
+                loc_t scanpc;   //adr/adrp/movz/b.cond which starts the reference
+                loc_t refpc;    //instruction which completes the reference
+            };
+        private:
+            column<xref> _refs; //sorted by target, then scanpc
+
+        public:
+            xrefindex(tihmstar::libinsn::vmem *mem);
+            xrefindex(column<xref> &&refs);
+
+            size_t size() const { return _refs.size();}
+            const column<xref> &table() const { return _refs;}
+
+            /*
+                ignoreTimes-th reference to target which starts at or after startPos, 0 if there is none
+             */
+            loc_t find(loc_t target, int ignoreTimes = 0, loc_t startPos = 0) const;
+
+            /*
+                all references to target in scan order
+             */
+            std::vector<loc_t> refs(loc_t target) const;
+        };
+    };
+};
+
+#endif /* xrefindex_hpp */
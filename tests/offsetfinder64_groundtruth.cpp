@@ -0,0 +1,267 @@
+//
+//  offsetfinder64_groundtruth.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libgeneral/macros.h>
+
+#include <liboffsetfinder64/kernelpatchfinder64.hpp>
+#include <liboffsetfinder64/ibootpatchfinder64.hpp>
+
+#include "synthimage.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+/*
+    Checks the primitives against what synthimage planted, once with the linear scans on a fresh finder
+    and once more after every build_* index exists.
+    Mach-O images also check every kernelpatchfinder64 finder against groundtruth::kernel.
+ */
+
+#define GT_SAMPLES  64
+
+namespace {
+    class checker{
+        const char *_mode;
+        size_t _checks;
+        size_t _failures;
+
+        void fail(const std::string &what, const std::string &got, const std::string &expected){
+            fprintf(stderr, "%s: %s gave %s, expected %s\n", _mode, what.c_str(), got.c_str(), expected.c_str());
+            _failures++;
+        }
+
+    public:
+        checker() : _mode(""), _checks(0), _failures(0) {}
+
+        void mode(const char *mode) { _mode = mode;}
+        size_t checks() const { return _checks;}
+        size_t failures() const { return _failures;}
+
+        template <typename T, typename F>
+        void expect(const std::string &what, const T &expected, F run, std::string (*str)(const T &)){
+            _checks++;
+            try {
+                T got = run();
+                if (got != expected) fail(what, str(got), str(expected));
+            } catch (tihmstar::exception &e) {
+                fail(what, std::string("error: ") + e.what(), str(expected));
+            }
+        }
+    };
+}
+
+static std::string hexLoc(const loc_t &loc){
+    char buf[0x20];
+    snprintf(buf, sizeof(buf), "0x%016llx", loc);
+    return buf;
+}
+
+static std::string hexLocs(const std::vector<loc_t> &locs){
+    std::string ret = "[";
+    for (auto &l : locs) {
+        ret += (ret.size() > 1 ? " " : "") + hexLoc(l);
+    }
+    return ret + "]";
+}
+
+static std::string hexRange(const std::pair<loc_t, loc_t> &range){
+    return hexLoc(range.first) + "-" + hexLoc(range.second);
+}
+
+static std::vector<loc_t> locations(const std::vector<patch> &patches){
+    std::vector<loc_t> ret;
+    for (auto &p : patches) {
+        ret.push_back(p._location);
+    }
+    return ret;
+}
+
+static bool inCave(const synthimage::groundtruth &gt, loc_t pos, size_t nops){
+    for (auto &c : gt.caves) {
+        if (pos >= c.loc && pos + nops*4 <= c.loc + c.nops*4) return true;
+    }
+    return false;
+}
+
+template <typename T>
+static std::vector<T> samples(const std::vector<T> &all){
+    std::vector<T> ret;
+    size_t cnt = std::min<size_t>(all.size(), GT_SAMPLES);
+    for (size_t i=0; i<cnt; i++) {
+        ret.push_back(all[i * all.size() / cnt]);
+    }
+    return ret;
+}
+
+/*
+    {target, site} with the site the finder returns: the first one for literal and call refs,
+    the closest one before the target for branch refs
+ */
+static std::vector<synthimage::ref> expectedRefs(const std::vector<synthimage::ref> &refs, bool last){
+    std::map<loc_t, loc_t> byTarget;
+    for (auto &r : refs) {
+        if (last) {
+            if (r.site < r.target) byTarget[r.target] = r.site;
+        }else{
+            byTarget.emplace(r.target, r.site);
+        }
+    }
+    std::vector<synthimage::ref> ret;
+    for (auto &t : byTarget) {
+        ret.push_back({t.first, t.second});
+    }
+    return ret;
+}
+
+static void checkPrimitives(checker &c, patchfinder64 *pf, const synthimage::groundtruth &gt){
+    for (auto &r : samples(expectedRefs(gt.xrefs, false))) {
+        c.expect<loc_t>("find_literal_ref(" + hexLoc(r.target) + ")", r.site, [&]{ return pf->find_literal_ref(r.target);}, hexLoc);
+    }
+    for (auto &r : samples(expectedRefs(gt.calls, false))) {
+        c.expect<loc_t>("find_call_ref(" + hexLoc(r.target) + ")", r.site, [&]{ return pf->find_call_ref(r.target);}, hexLoc);
+    }
+    for (auto &r : samples(expectedRefs(gt.branches, true))) {
+        int limit = -(int)(r.target - r.site) - 4;
+        c.expect<loc_t>("find_branch_ref(" + hexLoc(r.target) + ")", r.site, [&]{ return pf->find_branch_ref(r.target, limit);}, hexLoc);
+    }
+    for (auto &f : samples(gt.functions)) {
+        loc_t mid = f.start + ((f.end - f.start) / 2 & ~3ULL);
+        c.expect<std::pair<loc_t, loc_t>>("function_range(" + hexLoc(mid) + ")", {f.start, f.end}, [&]{ return pf->function_range(mid);}, hexRange);
+    }
+    for (auto &s : samples(gt.strings)) {
+        c.expect<loc_t>("findstr(\"" + s.str + "\", true)", s.loc, [&]{ return pf->findstr(s.str, true);}, hexLoc);
+        c.expect<loc_t>("findstr(\"" + s.str + "\", false)", s.loc, [&]{ return pf->findstr(s.str, false);}, hexLoc);
+    }
+    for (auto &cave : samples(gt.caves)) {
+        c.expect<bool>("findnops(" + std::to_string(cave.nops) + ") in a cave", true, [&]{
+            return inCave(gt, pf->findnops((uint16_t)cave.nops, false), cave.nops);
+        }, [](const bool &b) -> std::string { return b ? "true" : "false";});
+    }
+}
+
+#define KLOC(f, expected)       c.expect<loc_t>(#f, expected, [&]{ return kpf->f();}, hexLoc)
+#define KPATCH(f, expected)     c.expect<std::vector<loc_t>>(#f, expected, [&]{ return locations(kpf->f());}, hexLocs)
+
+static void checkKernel(checker &c, kernelpatchfinder64 *kpf, const synthimage::groundtruth &gt){
+    const synthimage::kernelresults &k = gt.kernel;
+    KLOC(find_syscall0, k.syscall0);
+    KLOC(find_machtrap_table, k.machtrapTable);
+    KLOC(find_kerneltask, k.kernelTask);
+    KLOC(find_rootvnode, k.rootvnode);
+    KLOC(find_allproc, k.allproc);
+    c.expect<loc_t>("find_function_for_syscall(1)", k.syscall1, [&]{ return kpf->find_function_for_syscall(1);}, hexLoc);
+    c.expect<loc_t>("find_function_for_machtrap(10)", k.machtrap10, [&]{ return kpf->find_function_for_machtrap(10);}, hexLoc);
+    KPATCH(get_MarijuanARM_patch, k.marijuanARM);
+    KPATCH(get_task_conversion_eval_patch, k.taskConversionEval);
+    KPATCH(get_vm_fault_internal_patch, k.vmFaultInternal);
+    KPATCH(get_trustcache_true_patch, k.trustcacheTrue);
+    KPATCH(get_mount_patch, k.mount);
+    KPATCH(get_tfp0_patch, k.tfp0);
+    KPATCH(get_get_task_allow_patch, k.getTaskAllow);
+    KPATCH(get_apfs_snapshot_patch, k.apfsSnapshot);
+    //the shellcode goes to a cave, everything else is planted
+    c.expect<std::vector<loc_t>>("get_amfi_patch(false)", k.amfi, [&]{
+        std::vector<loc_t> locs = locations(kpf->get_amfi_patch(false));
+        retassure(locs.size() == 3 && inCave(gt, locs[1], 8), "no shellcode in a cave");
+        locs.erase(locs.begin()+1);
+        return locs;
+    }, hexLocs);
+}
+
+#undef KLOC
+#undef KPATCH
+
+static void buildIndices(patchfinder64 *pf){
+    pf->build_xref_index();
+    pf->build_callgraph_index();
+    pf->build_branch_index();
+    pf->build_function_table();
+    pf->build_string_index();
+    pf->build_decode_table();
+}
+
+static void checkImage(checker &c, const synthimage::params &p){
+    std::vector<uint8_t> buf(synthimage::imageSize(p));
+    synthimage::groundtruth gt = synthimage::generate(p, buf.data(), buf.size());
+
+    std::unique_ptr<patchfinder64> pf;
+    if (p.type == synthimage::kMachO) {
+        pf.reset(new kernelpatchfinder64(buf.data(), buf.size()));
+    }else{
+        pf.reset(ibootpatchfinder64::make_ibootpatchfinder64(buf.data(), buf.size()));
+    }
+
+    for (int indexed = 0; indexed < 2; indexed++) {
+        if (indexed) buildIndices(pf.get());
+        c.mode(indexed ? "indexed" : "linear");
+        checkPrimitives(c, pf.get(), gt);
+        if (p.type == synthimage::kMachO) checkKernel(c, (kernelpatchfinder64 *)pf.get(), gt);
+    }
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [options]\n", prog);
+    printf("  -i, --images <n>              synthetic images of each kind, one seed each (default 2)\n");
+    printf("  -s, --size <bytes>            image size (default 0x400000)\n");
+    printf("  -h, --help                    show this help\n");
+}
+
+int main(int argc, char * const argv[]){
+    unsigned imageCnt = 2;
+    synthimage::params p;
+    p.size = 0x400000;
+
+    static struct option longopts[] = {
+        {"images",          required_argument,  NULL, 'i'},
+        {"size",            required_argument,  NULL, 's'},
+        {"help",            no_argument,        NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int c = 0;
+    while ((c = getopt_long(argc, argv, "i:s:h", longopts, NULL)) != -1) {
+        switch (c) {
+            case 'i':
+                imageCnt = (unsigned)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                p.size = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (!imageCnt) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    checker check;
+    try {
+        for (auto kind : {synthimage::kMachO, synthimage::kIBoot}) {
+            p.type = kind;
+            for (unsigned i=0; i<imageCnt; i++) {
+                p.seed = i+1;
+                checkImage(check, p);
+            }
+        }
+    } catch (tihmstar::exception &e) {
+        fprintf(stderr, "failed: %s\n", e.what());
+        return 2;
+    }
+    fprintf(stderr, "%zu checks, %zu failures\n", check.checks(), check.failures());
+    return check.failures() ? 1 : 0;
+}
@@ -0,0 +1,280 @@
+//
+//  offsetfinder64_stress.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libgeneral/macros.h>
+
+#include <liboffsetfinder64/kernelpatchfinder64.hpp>
+
+#include "synthimage.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+
+/*
+    Runs every kernelpatchfinder64 finder and a sample of primitives over synthetic images,
+    once on a single thread and then from many threads on one fresh instance, and compares the results.
+    Indices are not built up front, so the threads also race on creating them.
+    The build_* calls are in the list as well, so some threads build indices while others still scan linearly.
+    Calls which reserve caves run exclusively inside a rolled back cavescope, like the daemon does,
+    since two of them running at once rightfully get different caves.
+    The single threaded results must not be errors and have to match the groundtruth where it has an answer.
+ */
+
+#define STRESS_SAMPLES  32
+
+struct call{
+    std::string name;
+    std::function<std::string(kernelpatchfinder64 *)> run;
+    bool reservesCaves;
+    std::string truth;      //empty if the groundtruth has no exact answer
+};
+
+static std::string hexLoc(loc_t loc){
+    char buf[0x20];
+    snprintf(buf, sizeof(buf), "0x%016llx", loc);
+    return buf;
+}
+
+static std::string patchesStr(const std::vector<patch> &patches){
+    std::string ret;
+    for (auto &p : patches) {
+        ret += hexLoc(p._location) + ":";
+        for (size_t i=0; i<p._patchSize; i++) {
+            char buf[3];
+            snprintf(buf, sizeof(buf), "%02x", ((const uint8_t *)p._patch)[i]);
+            ret += buf;
+        }
+        ret += " ";
+    }
+    return ret;
+}
+
+/*
+    the first reference to every target, which is what find_literal_ref and find_call_ref return
+ */
+static std::vector<synthimage::ref> firstRefs(const std::vector<synthimage::ref> &refs){
+    std::map<loc_t, loc_t> byTarget;
+    for (auto &r : refs) {
+        byTarget.emplace(r.target, r.site);
+    }
+    std::vector<synthimage::ref> ret;
+    for (auto &t : byTarget) {
+        ret.push_back({t.first, t.second});
+    }
+    return ret;
+}
+
+template <typename T, typename F, typename G>
+static void addSamples(std::vector<call> &calls, const char *what, const std::vector<T> &all, F make, G truth){
+    size_t cnt = std::min<size_t>(all.size(), STRESS_SAMPLES);
+    for (size_t i=0; i<cnt; i++) {
+        const T &e = all[i * all.size() / cnt];
+        calls.push_back({std::string(what) + "#" + std::to_string(i), make(e), false, truth(e)});
+    }
+}
+
+#define KLOC(f, expected)   calls.push_back({#f, [](kernelpatchfinder64 *kpf){ return hexLoc(kpf->f());}, false, hexLoc(expected)})
+#define KPATCH(f)           calls.push_back({#f, [](kernelpatchfinder64 *kpf){ return patchesStr(kpf->f());}, false})
+#define KBUILD(f)           calls.push_back({#f, [](kernelpatchfinder64 *kpf){ kpf->f(); return std::string("built");}, false, "built"})
+
+static std::vector<call> makeCalls(const synthimage::groundtruth &gt){
+    std::vector<call> calls;
+    KBUILD(build_xref_index);
+    KBUILD(build_callgraph_index);
+    KBUILD(build_branch_index);
+    KBUILD(build_function_table);
+    KBUILD(build_string_index);
+    KBUILD(build_decode_table);
+    KBUILD(build_symbol_index);
+    KLOC(find_syscall0, gt.kernel.syscall0);
+    KLOC(find_machtrap_table, gt.kernel.machtrapTable);
+    KLOC(find_kerneltask, gt.kernel.kernelTask);
+    KLOC(find_rootvnode, gt.kernel.rootvnode);
+    KLOC(find_allproc, gt.kernel.allproc);
+    calls.push_back({"find_function_for_syscall", [](kernelpatchfinder64 *kpf){ return hexLoc(kpf->find_function_for_syscall(1));}, false, hexLoc(gt.kernel.syscall1)});
+    calls.push_back({"find_function_for_machtrap", [](kernelpatchfinder64 *kpf){ return hexLoc(kpf->find_function_for_machtrap(10));}, false, hexLoc(gt.kernel.machtrap10)});
+    KPATCH(get_MarijuanARM_patch);
+    KPATCH(get_task_conversion_eval_patch);
+    KPATCH(get_vm_fault_internal_patch);
+    KPATCH(get_trustcache_true_patch);
+    KPATCH(get_mount_patch);
+    KPATCH(get_tfp0_patch);
+    KPATCH(get_get_task_allow_patch);
+    KPATCH(get_apfs_snapshot_patch);
+    calls.push_back({"get_amfi_patch(false)", [](kernelpatchfinder64 *kpf){ return patchesStr(kpf->get_amfi_patch(false));}, false});
+    calls.push_back({"get_amfi_patch", [](kernelpatchfinder64 *kpf){ return patchesStr(kpf->get_amfi_patch());}, true});
+
+    addSamples(calls, "findstr", gt.strings, [](const synthimage::string &s){
+        return [s](kernelpatchfinder64 *kpf){ return hexLoc(kpf->findstr(s.str, true));};
+    }, [](const synthimage::string &s){ return hexLoc(s.loc);});
+    addSamples(calls, "find_literal_ref", firstRefs(gt.xrefs), [](const synthimage::ref &r){
+        return [r](kernelpatchfinder64 *kpf){ return hexLoc(kpf->find_literal_ref(r.target));};
+    }, [](const synthimage::ref &r){ return hexLoc(r.site);});
+    addSamples(calls, "find_call_ref", firstRefs(gt.calls), [](const synthimage::ref &r){
+        return [r](kernelpatchfinder64 *kpf){ return hexLoc(kpf->find_call_ref(r.target));};
+    }, [](const synthimage::ref &r){ return hexLoc(r.site);});
+    addSamples(calls, "function_range", gt.functions, [](const synthimage::function &f){
+        return [f](kernelpatchfinder64 *kpf){
+            auto range = kpf->function_range(f.start + ((f.end - f.start) / 2 & ~3ULL));
+            return hexLoc(range.first) + "-" + hexLoc(range.second);
+        };
+    }, [](const synthimage::function &f){ return hexLoc(f.start) + "-" + hexLoc(f.end);});
+    //any cave which fits will do, so only errors are caught
+    addSamples(calls, "findnops", gt.caves, [](const synthimage::cave &c){
+        return [c](kernelpatchfinder64 *kpf){ return hexLoc(kpf->findnops((uint16_t)c.nops, false));};
+    }, [](const synthimage::cave &){ return std::string();});
+    return calls;
+}
+
+#undef KLOC
+#undef KPATCH
+#undef KBUILD
+
+static std::string runCall(kernelpatchfinder64 *kpf, const call &c){
+    try {
+        if (!c.reservesCaves) return c.run(kpf);
+        cavescope caves(kpf);
+        cleanup([&]{
+            caves.rollback();
+        })
+        return c.run(kpf);
+    } catch (tihmstar::exception &e) {
+        return std::string("error: ") + e.what();
+    } catch (...) {
+        return "error";
+    }
+}
+
+static size_t stressImage(const synthimage::params &p, unsigned threadCnt, unsigned rounds){
+    std::vector<uint8_t> buf(synthimage::imageSize(p));
+    synthimage::groundtruth gt = synthimage::generate(p, buf.data(), buf.size());
+    std::vector<call> calls = makeCalls(gt);
+
+    std::vector<std::string> expected;
+    size_t wrong = 0;
+    {
+        kernelpatchfinder64 kpf(buf.data(), buf.size());
+        for (auto &c : calls) {
+            expected.push_back(runCall(&kpf, c));
+            const std::string &got = expected.back();
+            if (got.compare(0, 5, "error") == 0 || (c.truth.size() && got != c.truth)) {
+                fprintf(stderr, "seed %llu single threaded: %s gave \"%s\", expected \"%s\"\n",
+                        (unsigned long long)p.seed, c.name.c_str(), got.c_str(), c.truth.size() ? c.truth.c_str() : "no error");
+                wrong++;
+            }
+        }
+    }
+
+    kernelpatchfinder64 kpf(buf.data(), buf.size());
+    std::shared_mutex exclusive;
+    std::atomic<size_t> mismatches{0};
+    std::vector<std::thread> workers;
+    for (unsigned t=0; t<threadCnt; t++) {
+        workers.emplace_back([&, t]{
+            for (unsigned r=0; r<rounds; r++) {
+                for (size_t i=0; i<calls.size(); i++) {
+                    //every thread starts somewhere else, so different finders overlap
+                    size_t idx = (i + t * calls.size() / threadCnt + r) % calls.size();
+                    const call &c = calls[idx];
+                    std::string got;
+                    if (c.reservesCaves) {
+                        std::unique_lock<std::shared_mutex> ul(exclusive);
+                        got = runCall(&kpf, c);
+                    }else{
+                        std::shared_lock<std::shared_mutex> sl(exclusive);
+                        got = runCall(&kpf, c);
+                    }
+                    if (got != expected[idx]) {
+                        fprintf(stderr, "seed %llu thread %u: %s gave \"%s\", expected \"%s\"\n",
+                                (unsigned long long)p.seed, t, c.name.c_str(), got.c_str(), expected[idx].c_str());
+                        mismatches++;
+                    }
+                }
+            }
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    fprintf(stderr, "seed %llu: %zu calls x %u threads x %u rounds, %zu wrong single threaded, %zu mismatches\n",
+            (unsigned long long)p.seed, calls.size(), threadCnt, rounds, wrong, (size_t)mismatches);
+    return wrong + mismatches;
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [options]\n", prog);
+    printf("  -t, --threads <n>             threads sharing one finder (default: cpu count, at least 4)\n");
+    printf("  -r, --rounds <n>              times every thread runs every call (default 4)\n");
+    printf("  -i, --images <n>              synthetic images, one seed each (default 2)\n");
+    printf("  -s, --size <bytes>            image size (default 0x400000)\n");
+    printf("  -h, --help                    show this help\n");
+}
+
+int main(int argc, char * const argv[]){
+    unsigned threadCnt = std::max(4u, std::thread::hardware_concurrency());
+    unsigned rounds = 4;
+    unsigned imageCnt = 2;
+    synthimage::params p;
+    p.size = 0x400000;
+
+    static struct option longopts[] = {
+        {"threads",         required_argument,  NULL, 't'},
+        {"rounds",          required_argument,  NULL, 'r'},
+        {"images",          required_argument,  NULL, 'i'},
+        {"size",            required_argument,  NULL, 's'},
+        {"help",            no_argument,        NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int c = 0;
+    while ((c = getopt_long(argc, argv, "t:r:i:s:h", longopts, NULL)) != -1) {
+        switch (c) {
+            case 't':
+                threadCnt = (unsigned)strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                rounds = (unsigned)strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                imageCnt = (unsigned)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                p.size = strtoull(optarg, NULL, 0);
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (!threadCnt || !rounds || !imageCnt) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t mismatches = 0;
+    try {
+        for (unsigned i=0; i<imageCnt; i++) {
+            p.seed = i+1;
+            mismatches += stressImage(p, threadCnt, rounds);
+        }
+    } catch (tihmstar::exception &e) {
+        fprintf(stderr, "failed: %s\n", e.what());
+        return 2;
+    }
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,553 @@
+//
+//  offsetfinder64_batch.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libgeneral/macros.h>
+
+#include <liboffsetfinder64/kernelpatchfinder64.hpp>
+#include <liboffsetfinder64/ibootpatchfinder64.hpp>
+
+#include "toolutil.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace toolutil;
+
+/*
+    Runs finders over many kernelcaches and iBoots in one process.
+    Images come from the arguments (files, or directories which are walked recursively) and -l lists.
+    Each image is sniffed, loaded and handed to the selected finders on a pool of workers.
+    Every worker owns a deque of images and takes from its front, an idle worker steals from the back of another one.
+    One NDJSON line per image goes to stdout (or -o) in input order, with offsets, patch bytes, timings and errors.
+    A finder which throws only fails its own entry, an image which can't be loaded only fails its own line.
+
+    -m caps the size of a single image, -M the bytes of all images loaded at the same time.
+    With -c every finished image is appended to the checkpoint after its line was written,
+    images already listed there are skipped, so an interrupted run picks up where it stopped.
+    A line may show up twice after a crash, never not at all.
+ */
+
+#define DEFAULT_BOOTARGS        "-v"
+
+struct options{
+    unsigned threads = 0;
+    uint64_t imageCap = 0;          //0 means no cap
+    uint64_t memoryBudget = 0;      //0 means no budget
+    const char *out = NULL;
+    const char *checkpoint = NULL;
+    std::string bootargs = DEFAULT_BOOTARGS;
+};
+
+struct finder{
+    const char *name;
+    imagekind kind;
+    std::function<std::string(patchfinder64 *pf, const options &opt)> run; //the result as JSON value
+};
+
+struct job{
+    size_t index;
+    std::string path;
+};
+
+#pragma mark json
+
+static std::string jsonMillis(std::chrono::steady_clock::time_point start){
+    char buf[0x20];
+    snprintf(buf, sizeof(buf), "%.3f", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    return buf;
+}
+
+#pragma mark finders
+
+#define KLOC(f)     {#f, kKernel, [](patchfinder64 *pf, const options &){ return jsonLoc(((kernelpatchfinder64*)pf)->f());}}
+#define KPATCH(f)   {#f, kKernel, [](patchfinder64 *pf, const options &){ return jsonPatches(((kernelpatchfinder64*)pf)->f());}}
+#define IBOOL(f)    {#f, kIBoot,  [](patchfinder64 *pf, const options &){ return std::string(((ibootpatchfinder64*)pf)->f() ? "true" : "false");}}
+#define IPATCH(f)   {#f, kIBoot,  [](patchfinder64 *pf, const options &){ return jsonPatches(((ibootpatchfinder64*)pf)->f());}}
+
+static const std::vector<finder> &allFinders(){
+    static const std::vector<finder> finders = {
+        KLOC(find_syscall0),
+        KLOC(find_machtrap_table),
+        KLOC(find_kerneltask),
+        KLOC(find_rootvnode),
+        KLOC(find_allproc),
+        KPATCH(get_MarijuanARM_patch),
+        KPATCH(get_task_conversion_eval_patch),
+        KPATCH(get_vm_fault_internal_patch),
+        KPATCH(get_trustcache_true_patch),
+        KPATCH(get_mount_patch),
+        KPATCH(get_tfp0_patch),
+        KPATCH(get_amfi_patch),
+        KPATCH(get_get_task_allow_patch),
+        KPATCH(get_apfs_snapshot_patch),
+
+        IBOOL(has_kernel_load),
+        IBOOL(has_recovery_console),
+        IPATCH(get_sigcheck_patch),
+        IPATCH(get_demotion_patch),
+        {"get_boot_arg_patch", kIBoot, [](patchfinder64 *pf, const options &opt){
+            return jsonPatches(((ibootpatchfinder64*)pf)->get_boot_arg_patch(opt.bootargs.c_str()));
+        }},
+        IPATCH(get_debug_enabled_patch),
+        IPATCH(get_ra1nra1n_patch),
+        IPATCH(get_unlock_nvram_patch),
+        IPATCH(get_nvram_nosave_patch),
+        IPATCH(get_nvram_noremove_patch),
+        IPATCH(get_freshnonce_patch),
+        IPATCH(get_change_reboot_to_fsboot_patch),
+        {"get_el1_pagesize", kIBoot, [](patchfinder64 *pf, const options &){
+            return std::to_string(((ibootpatchfinder64*)pf)->get_el1_pagesize());
+        }},
+        IPATCH(get_rw_and_x_mappings_patch_el1),
+    };
+    return finders;
+}
+
+#undef KLOC
+#undef KPATCH
+#undef IBOOL
+#undef IPATCH
+
+static std::vector<const finder *> selectFinders(const char *list){
+    std::vector<const finder *> ret;
+    if (!list || !strcmp(list, "all")) {
+        for (auto &f : allFinders()) ret.push_back(&f);
+        return ret;
+    }
+    std::string names = list;
+    size_t pos = 0;
+    while (pos <= names.size()) {
+        size_t end = names.find(',', pos);
+        if (end == std::string::npos) end = names.size();
+        std::string name = names.substr(pos, end - pos);
+        pos = end + 1;
+        if (name.empty()) continue;
+        auto f = std::find_if(allFinders().begin(), allFinders().end(), [&](const finder &e){ return name == e.name;});
+        retassure(f != allFinders().end(), "unknown finder %s", name.c_str());
+        ret.push_back(&*f);
+    }
+    return ret;
+}
+
+#pragma mark images
+
+/*
+    regular files below dir, following symlinks to files but not to directories.
+    Subdirectories we may not read are skipped
+ */
+static void walkDir(const std::string &dir, std::vector<std::string> &found, bool isSubdir = false){
+    DIR *d = opendir(dir.c_str());
+    if (!d && errno == EACCES && isSubdir) return;
+    retassure(d, "failed to walk %s errno=%d", dir.c_str(), errno);
+    cleanup([&]{
+        closedir(d);
+    })
+    while (struct dirent *ent = readdir(d)) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        std::string path = dir + "/" + ent->d_name;
+        struct stat st = {};
+        if (lstat(path.c_str(), &st)) continue;
+        if (S_ISDIR(st.st_mode)) {
+            walkDir(path, found, true);
+        }else if (!stat(path.c_str(), &st) && S_ISREG(st.st_mode)) {
+            found.push_back(path);
+        }
+    }
+}
+
+static void addPath(const std::string &path, std::vector<std::string> &paths){
+    struct stat st = {};
+    if (stat(path.c_str(), &st) || !S_ISDIR(st.st_mode)) {
+        paths.push_back(path);
+        return;
+    }
+    std::vector<std::string> found;
+    walkDir(path, found);
+    //directory order is arbitrary, the output order shouldn't be
+    std::sort(found.begin(), found.end());
+    paths.insert(paths.end(), found.begin(), found.end());
+}
+
+static void addList(const char *list, std::vector<std::string> &paths){
+    FILE *f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+    retassure(f, "failed to open %s", list);
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t len = 0;
+    cleanup([&]{
+        free(line);
+        if (f != stdin) fclose(f);
+    })
+    while ((len = getline(&line, &lineCap, f)) != -1) {
+        while (len && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+        if (!len || line[0] == '#') continue;
+        addPath(line, paths);
+    }
+}
+
+/*
+    paths of completed images. A line without newline was cut off and doesn't count,
+    cutOff tells the caller to terminate it before appending
+ */
+static std::unordered_set<std::string> readCheckpoint(const char *path, bool &cutOff){
+    std::unordered_set<std::string> ret;
+    cutOff = false;
+    FILE *f = fopen(path, "r");
+    if (!f) return ret;
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t len = 0;
+    while ((len = getline(&line, &lineCap, f)) != -1) {
+        if ((cutOff = line[len-1] != '\n') || len < 2) continue;
+        ret.insert(std::string(line, len-1));
+    }
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+#pragma mark scheduling
+
+/*
+    bytes of images loaded right now. A single image bigger than the budget
+    still runs, on its own, so nothing waits forever
+ */
+class memorybudget{
+    std::mutex _lock;
+    std::condition_variable _cv;
+    uint64_t _total;
+    uint64_t _used;
+public:
+    memorybudget(uint64_t total) : _total(total), _used(0) {}
+
+    uint64_t acquire(uint64_t bytes){
+        if (!_total) return 0;
+        bytes = std::min(bytes, _total);
+        std::unique_lock<std::mutex> ul(_lock);
+        _cv.wait(ul, [&]{ return _used + bytes <= _total;});
+        _used += bytes;
+        return bytes;
+    }
+
+    void release(uint64_t bytes){
+        if (!bytes) return;
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            _used -= bytes;
+        }
+        _cv.notify_all();
+    }
+};
+
+/*
+    all jobs are known upfront and are dealt round robin, so taking from the own front
+    keeps workers close to input order and the reorder buffer small.
+    Stealing from the back of the others takes the work furthest from being written out
+ */
+class workqueues{
+    struct queue{
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+    std::vector<std::unique_ptr<queue>> _queues;
+public:
+    workqueues(size_t queueCnt, size_t jobCnt){
+        for (size_t i=0; i<queueCnt; i++) _queues.emplace_back(new queue);
+        for (size_t i=0; i<jobCnt; i++) _queues[i % queueCnt]->jobs.push_back(i);
+    }
+
+    bool take(size_t self, size_t &job){
+        {
+            auto &q = *_queues[self];
+            std::unique_lock<std::mutex> ul(q.lock);
+            if (q.jobs.size()) {
+                job = q.jobs.front();
+                q.jobs.pop_front();
+                return true;
+            }
+        }
+        for (size_t i=1; i<_queues.size(); i++) {
+            auto &q = *_queues[(self + i) % _queues.size()];
+            std::unique_lock<std::mutex> ul(q.lock);
+            if (q.jobs.size()) {
+                job = q.jobs.back();
+                q.jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/*
+    writes lines in job order as they complete, then marks them done in the checkpoint
+ */
+class orderedwriter{
+    std::mutex _lock;
+    FILE *_out;
+    FILE *_checkpoint;
+    const std::vector<job> &_jobs;
+    std::map<size_t, std::string> _pending;
+    size_t _next;
+public:
+    orderedwriter(FILE *out, FILE *checkpoint, const std::vector<job> &jobs)
+    : _out(out), _checkpoint(checkpoint), _jobs(jobs), _next(0)
+    {
+        //
+    }
+
+    void complete(size_t job, std::string &&line){
+        std::unique_lock<std::mutex> ul(_lock);
+        _pending.emplace(job, std::move(line));
+        for (auto it = _pending.begin(); it != _pending.end() && it->first == _next; it = _pending.erase(it), _next++) {
+            fwrite(it->second.data(), 1, it->second.size(), _out);
+            fflush(_out);
+            if (_checkpoint) {
+                std::string done = _jobs[it->first].path + "\n";
+                fwrite(done.data(), 1, done.size(), _checkpoint);
+                fflush(_checkpoint);
+            }
+        }
+    }
+};
+
+#pragma mark running
+
+static const char *kindName(imagekind kind){
+    switch (kind) {
+        case kKernel:   return "kernel";
+        case kIBoot:    return "iboot";
+        default:        return "unknown";
+    }
+}
+
+static std::string runImage(const options &opt, const std::vector<const finder *> &finders, memorybudget &budget, const job &j, bool &failed){
+    auto start = std::chrono::steady_clock::now();
+    std::string line = "{\"index\": " + std::to_string(j.index) + ", \"path\": " + jsonString(j.path);
+    uint64_t reserved = 0;
+    cleanup([&]{
+        budget.release(reserved);
+    })
+    try {
+        struct stat st = {};
+        retassure(!stat(j.path.c_str(), &st), "failed to stat %s", j.path.c_str());
+        line += ", \"size\": " + std::to_string((uint64_t)st.st_size);
+        retassure(!opt.imageCap || (uint64_t)st.st_size <= opt.imageCap, "image exceeds the cap of %llu bytes", (unsigned long long)opt.imageCap);
+
+        imagekind kind = sniff(j.path.c_str());
+        line += ", \"kind\": " + jsonString(kindName(kind));
+        retassure(kind != kUnknown, "not a kernelcache or iBoot");
+
+        reserved = budget.acquire(st.st_size);
+        auto loadStart = std::chrono::steady_clock::now();
+        std::unique_ptr<patchfinder64> pf;
+        if (kind == kKernel) {
+            pf.reset(new kernelpatchfinder64(j.path.c_str()));
+        }else{
+            pf.reset(ibootpatchfinder64::make_ibootpatchfinder64(j.path.c_str()));
+        }
+        line += ", \"load_ms\": " + jsonMillis(loadStart) + ", \"results\": {";
+
+        bool first = true;
+        for (auto f : finders) {
+            if (f->kind != kind) continue;
+            line += first ? "" : ", ";
+            first = false;
+            line += jsonString(f->name) + ": {";
+            auto finderStart = std::chrono::steady_clock::now();
+            try {
+                std::string value = f->run(pf.get(), opt);
+                line += "\"value\": " + value;
+            } catch (tihmstar::exception &e) {
+                line += "\"error\": " + jsonString(e.what());
+            } catch (std::exception &e) {
+                line += "\"error\": " + jsonString(e.what());
+            } catch (...) {
+                line += "\"error\": \"unknown exception\"";
+            }
+            line += ", \"ms\": " + jsonMillis(finderStart) + "}";
+        }
+        line += "}";
+    } catch (tihmstar::exception &e) {
+        line += ", \"error\": " + jsonString(e.what());
+        failed = true;
+    } catch (std::exception &e) {
+        line += ", \"error\": " + jsonString(e.what());
+        failed = true;
+    } catch (...) {
+        line += ", \"error\": \"unknown exception\"";
+        failed = true;
+    }
+    return line + ", \"ms\": " + jsonMillis(start) + "}\n";
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [options] <image|directory>...\n", prog);
+    printf("  -l, --list <file>             read image paths from file, one per line (- for stdin)\n");
+    printf("  -f, --finders <a,b,...>       finders to run (default all which match the image kind)\n");
+    printf("  -F, --list-finders            print the finder names and exit\n");
+    printf("  -j, --jobs <n>                worker threads (default one per core)\n");
+    printf("  -m, --max-image <bytes>       fail images bigger than this, k/m/g suffixes work\n");
+    printf("  -M, --memory-budget <bytes>   bytes of images loaded at the same time\n");
+    printf("  -o, --output <file>           write NDJSON here instead of stdout\n");
+    printf("  -c, --checkpoint <file>       skip images listed here and append finished ones\n");
+    printf("  -b, --bootargs <str>          bootargs for get_boot_arg_patch (default \"%s\")\n", DEFAULT_BOOTARGS);
+}
+
+int main(int argc, char * const argv[]){
+    static struct option longopts[] = {
+        {"list",            required_argument,  NULL, 'l'},
+        {"finders",         required_argument,  NULL, 'f'},
+        {"list-finders",    no_argument,        NULL, 'F'},
+        {"jobs",            required_argument,  NULL, 'j'},
+        {"max-image",       required_argument,  NULL, 'm'},
+        {"memory-budget",   required_argument,  NULL, 'M'},
+        {"output",          required_argument,  NULL, 'o'},
+        {"checkpoint",      required_argument,  NULL, 'c'},
+        {"bootargs",        required_argument,  NULL, 'b'},
+        {"help",            no_argument,        NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    options opt;
+    std::vector<const char *> lists;
+    const char *finderList = NULL;
+    int c = 0;
+    while ((c = getopt_long(argc, argv, "l:f:Fj:m:M:o:c:b:h", longopts, NULL)) != -1) {
+        switch (c) {
+            case 'l':
+                lists.push_back(optarg);
+                break;
+            case 'f':
+                finderList = optarg;
+                break;
+            case 'F':
+                for (auto &f : allFinders()) printf("%-36s %s\n", f.name, kindName(f.kind));
+                return 0;
+            case 'j':
+                opt.threads = (unsigned)strtoul(optarg, NULL, 0);
+                break;
+            case 'm':
+                opt.imageCap = parseSize(optarg);
+                break;
+            case 'M':
+                opt.memoryBudget = parseSize(optarg);
+                break;
+            case 'o':
+                opt.out = optarg;
+                break;
+            case 'c':
+                opt.checkpoint = optarg;
+                break;
+            case 'b':
+                opt.bootargs = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc && lists.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<const finder *> finders;
+    std::vector<job> jobs;
+    size_t skipped = 0;
+    bool checkpointCutOff = false;
+    try {
+        finders = selectFinders(finderList);
+
+        std::vector<std::string> paths;
+        for (int i=optind; i<argc; i++) addPath(argv[i], paths);
+        for (auto l : lists) addList(l, paths);
+
+        std::unordered_set<std::string> done;
+        if (opt.checkpoint) done = readCheckpoint(opt.checkpoint, checkpointCutOff);
+        for (size_t i=0; i<paths.size(); i++) {
+            if (done.count(paths[i])) {
+                skipped++;
+                continue;
+            }
+            jobs.push_back({i, paths[i]});
+        }
+    } catch (tihmstar::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+
+    //finders print to stdout here and there, keep that out of the NDJSON
+    FILE *out = NULL;
+    if (opt.out) {
+        out = fopen(opt.out, opt.checkpoint ? "a" : "w");
+    }else{
+        int outfd = dup(STDOUT_FILENO);
+        if (outfd != -1 && dup2(STDERR_FILENO, STDOUT_FILENO) != -1) out = fdopen(outfd, "w");
+    }
+    if (!out) {
+        fprintf(stderr, "failed to open %s\n", opt.out ? opt.out : "stdout");
+        return 1;
+    }
+    FILE *checkpoint = NULL;
+    if (opt.checkpoint && !(checkpoint = fopen(opt.checkpoint, "a"))) {
+        fprintf(stderr, "failed to open %s\n", opt.checkpoint);
+        fclose(out);
+        return 1;
+    }
+    if (checkpointCutOff) fputc('\n', checkpoint);
+
+    unsigned threadCnt = opt.threads ? opt.threads : std::max(1u, std::thread::hardware_concurrency());
+    threadCnt = (unsigned)std::max<size_t>(1, std::min<size_t>(threadCnt, jobs.size()));
+    fprintf(stderr, "%zu images (%zu done before), %zu finders, %u workers\n", jobs.size(), skipped, finders.size(), threadCnt);
+
+    workqueues queues(threadCnt, jobs.size());
+    memorybudget budget(opt.memoryBudget);
+    orderedwriter writer(out, checkpoint, jobs);
+    std::atomic<size_t> failedCnt{0};
+
+    auto work = [&](size_t self){
+        size_t j = 0;
+        while (queues.take(self, j)) {
+            bool failed = false;
+            std::string line = runImage(opt, finders, budget, jobs[j], failed);
+            if (failed) {
+                failedCnt++;
+                fprintf(stderr, "%s: failed\n", jobs[j].path.c_str());
+            }
+            writer.complete(j, std::move(line));
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i=1; i<threadCnt; i++) workers.emplace_back(work, i);
+    work(0);
+    for (auto &t : workers) t.join();
+
+    fclose(out);
+    if (checkpoint) fclose(checkpoint);
+    fprintf(stderr, "%zu images, %zu failed\n", jobs.size(), (size_t)failedCnt);
+    return failedCnt ? 2 : 0;
+}
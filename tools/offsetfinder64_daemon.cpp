@@ -0,0 +1,929 @@
+//
+//  offsetfinder64_daemon.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <libgeneral/macros.h>
+
+#include <liboffsetfinder64/kernelpatchfinder64.hpp>
+#include <liboffsetfinder64/ibootpatchfinder64.hpp>
+
+#include "imagefile.hpp"
+#include "resultcache.hpp"
+#include "toolutil.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace toolutil;
+
+/*
+    Keeps finders and their indices loaded between requests and answers queries over a Unix socket.
+
+    The protocol is one JSON object per line in both directions:
+        {"id": 1, "image": "/path/to/kernelcache", "call": "find_literal_ref", "args": ["0xfffffff007012345"]}
+        {"id": 1, "result": "0xfffffff0070abcd0", "cached": true, "us": 12}
+    or {"id": 1, "error": "..."} if the call threw. The id is optional and has to be a string, a number or null. Numbers may be given as JSON numbers or as (hex) strings,
+    addresses are returned as hex strings and patches as [{"location": ..., "bytes": "<hex>"}].
+    {"call": "calls"} lists the calls, {"call": "stats"} returns cache counters and per call latency histograms.
+    A client may send several requests without waiting, responses come back in order.
+
+    Finders are kept in an LRU keyed by the image hash, so the same image under another path shares the finder.
+    Each finder is charged its image size times -x (the indices are a multiple of the image),
+    least recently used finders are dropped once -M is exceeded. A finder which is dropped while
+    a request still uses it lives until that request is done.
+    Primitives run concurrently on a finder. get_*_patch finders reserve nop caves, so they get it to themselves
+    and their reservations are rolled back afterwards, which gives every request the patches a new process would get.
+ */
+
+#define DEFAULT_SOCKET          "/tmp/offsetfinder64.sock"
+#define DEFAULT_MEMORY_BUDGET   (4ULL << 30)
+#define DEFAULT_INDEX_FACTOR    4.0
+#define HISTOGRAM_BUCKETS       40          //bucket i counts latencies below 2^i microseconds
+#define MAX_REQUEST_SIZE        0x100000
+#define MAX_JSON_DEPTH          16
+
+struct options{
+    const char *socketPath = DEFAULT_SOCKET;
+    uint64_t memoryBudget = DEFAULT_MEMORY_BUDGET;
+    double indexFactor = DEFAULT_INDEX_FACTOR;
+    bool buildIndices = true;
+};
+
+#pragma mark json
+
+/*
+    just enough JSON for requests: objects, arrays, strings, numbers and literals.
+    Numbers and literals keep their text
+ */
+struct jsonvalue{
+    enum type{
+        kNull,
+        kBool,
+        kNumber,
+        kString,
+        kArray,
+        kObject
+    } type = kNull;
+    std::string str;
+    std::vector<jsonvalue> arr;
+    std::map<std::string, jsonvalue> obj;
+
+    const jsonvalue *get(const char *key) const{
+        auto it = obj.find(key);
+        return it == obj.end() ? NULL : &it->second;
+    }
+};
+
+class jsonparser{
+    const char *_cur;
+    const char *_end;
+
+    void skipSpace(){
+        while (_cur < _end && (*_cur == ' ' || *_cur == '\t' || *_cur == '\r' || *_cur == '\n')) _cur++;
+    }
+
+    char peek(){
+        skipSpace();
+        retassure(_cur < _end, "unexpected end of JSON");
+        return *_cur;
+    }
+
+    void expect(char c){
+        retassure(peek() == c, "expected '%c' in JSON", c);
+        _cur++;
+    }
+
+    std::string parseString(){
+        expect('"');
+        std::string ret;
+        while (true) {
+            retassure(_cur < _end, "unterminated JSON string");
+            char c = *_cur++;
+            if (c == '"') break;
+            if (c != '\\') {
+                ret += c;
+                continue;
+            }
+            retassure(_cur < _end, "unterminated JSON string");
+            switch (c = *_cur++) {
+                case 'n': ret += '\n'; break;
+                case 't': ret += '\t'; break;
+                case 'r': ret += '\r'; break;
+                case 'b': ret += '\b'; break;
+                case 'f': ret += '\f'; break;
+                case 'u':
+                {
+                    retassure(_end - _cur >= 4, "bad JSON escape");
+                    uint32_t cp = (uint32_t)strtoul(std::string(_cur, 4).c_str(), NULL, 16);
+                    _cur += 4;
+                    //symbol and path names are ASCII, anything else is kept as UTF-8 without surrogate pairing
+                    if (cp < 0x80) {
+                        ret += (char)cp;
+                    } else if (cp < 0x800) {
+                        ret += (char)(0xc0 | (cp >> 6));
+                        ret += (char)(0x80 | (cp & 0x3f));
+                    } else {
+                        ret += (char)(0xe0 | (cp >> 12));
+                        ret += (char)(0x80 | ((cp >> 6) & 0x3f));
+                        ret += (char)(0x80 | (cp & 0x3f));
+                    }
+                    break;
+                }
+                default: ret += c; break;
+            }
+        }
+        return ret;
+    }
+
+public:
+    jsonparser(const std::string &str) : _cur(str.data()), _end(str.data() + str.size()) {}
+
+    jsonvalue parse(int depth = 0){
+        retassure(depth < MAX_JSON_DEPTH, "JSON nested too deep");
+        jsonvalue ret;
+        char c = peek();
+        if (c == '{') {
+            ret.type = jsonvalue::kObject;
+            _cur++;
+            if (peek() == '}') {
+                _cur++;
+                return ret;
+            }
+            while (true) {
+                std::string key = parseString();
+                expect(':');
+                ret.obj[key] = parse(depth+1);
+                if (peek() == '}') break;
+                expect(',');
+            }
+            _cur++;
+        } else if (c == '[') {
+            ret.type = jsonvalue::kArray;
+            _cur++;
+            if (peek() == ']') {
+                _cur++;
+                return ret;
+            }
+            while (true) {
+                ret.arr.push_back(parse(depth+1));
+                if (peek() == ']') break;
+                expect(',');
+            }
+            _cur++;
+        } else if (c == '"') {
+            ret.type = jsonvalue::kString;
+            ret.str = parseString();
+        } else {
+            const char *start = _cur;
+            while (_cur < _end && (isalnum((unsigned char)*_cur) || *_cur == '-' || *_cur == '+' || *_cur == '.')) _cur++;
+            ret.str = std::string(start, _cur - start);
+            retassure(ret.str.size(), "unexpected '%c' in JSON", c);
+            if (ret.str == "true" || ret.str == "false") {
+                ret.type = jsonvalue::kBool;
+            } else if (ret.str == "null") {
+                ret.type = jsonvalue::kNull;
+            } else {
+                ret.type = jsonvalue::kNumber;
+            }
+        }
+        return ret;
+    }
+
+    bool atEnd(){
+        skipSpace();
+        return _cur == _end;
+    }
+};
+
+/*
+    str is a number as the JSON grammar has it: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+ */
+static bool isJSONNumber(const std::string &str){
+    const char *c = str.c_str();
+    if (*c == '-') c++;
+    if (*c == '0') {
+        c++;
+    } else if (isdigit((unsigned char)*c)) {
+        while (isdigit((unsigned char)*c)) c++;
+    } else {
+        return false;
+    }
+    if (*c == '.') {
+        if (!isdigit((unsigned char)*++c)) return false;
+        while (isdigit((unsigned char)*c)) c++;
+    }
+    if (*c == 'e' || *c == 'E') {
+        c++;
+        if (*c == '+' || *c == '-') c++;
+        if (!isdigit((unsigned char)*c)) return false;
+        while (isdigit((unsigned char)*c)) c++;
+    }
+    return *c == '\0';
+}
+
+static std::string jsonLocs(const std::vector<loc_t> &locs){
+    std::string ret = "[";
+    for (size_t i=0; i<locs.size(); i++) {
+        ret += i ? ", " : "";
+        ret += jsonLoc(locs[i]);
+    }
+    return ret + "]";
+}
+
+#pragma mark calls
+
+static const imagekind kAny = kUnknown;  //calls which run on every image
+
+class callargs{
+    const std::vector<jsonvalue> &_args;
+
+    const jsonvalue &at(size_t i) const{
+        retassure(i < _args.size(), "missing argument %zu", i);
+        return _args[i];
+    }
+public:
+    callargs(const std::vector<jsonvalue> &args) : _args(args) {}
+
+    size_t size() const { return _args.size();}
+
+    std::string str(size_t i) const{
+        auto &v = at(i);
+        retassure(v.type == jsonvalue::kString, "argument %zu is not a string", i);
+        return v.str;
+    }
+
+    uint64_t num(size_t i, uint64_t def) const{
+        return i < _args.size() ? num(i) : def;
+    }
+
+    uint64_t num(size_t i) const{
+        auto &v = at(i);
+        retassure(v.type == jsonvalue::kNumber || v.type == jsonvalue::kString, "argument %zu is not a number", i);
+        char *end = NULL;
+        uint64_t ret = strtoull(v.str.c_str(), &end, 0);
+        retassure(v.str.size() && end && !*end, "argument %zu is not a number", i);
+        return ret;
+    }
+
+    bool flag(size_t i, bool def) const{
+        if (i >= _args.size()) return def;
+        retassure(_args[i].type == jsonvalue::kBool, "argument %zu is not a bool", i);
+        return _args[i].str == "true";
+    }
+};
+
+struct call{
+    const char *name;
+    imagekind kind;
+    bool exclusive;     //reserves caves
+    const char *args;   //for the calls listing
+    std::function<std::string(patchfinder64 *pf, const callargs &a)> run;
+};
+
+#define KLOC(f)     {#f, kKernel, false, "", [](patchfinder64 *pf, const callargs &){ return jsonLoc(((kernelpatchfinder64*)pf)->f());}}
+#define KPATCH(f)   {#f, kKernel, true,  "", [](patchfinder64 *pf, const callargs &){ return jsonPatches(((kernelpatchfinder64*)pf)->f());}}
+#define IBOOL(f)    {#f, kIBoot,  false, "", [](patchfinder64 *pf, const callargs &){ return std::string(((ibootpatchfinder64*)pf)->f() ? "true" : "false");}}
+#define IPATCH(f)   {#f, kIBoot,  true,  "", [](patchfinder64 *pf, const callargs &){ return jsonPatches(((ibootpatchfinder64*)pf)->f());}}
+
+static const std::vector<call> &allCalls(){
+    static const std::vector<call> calls = {
+        {"find_base", kAny, false, "", [](patchfinder64 *pf, const callargs &){ return jsonLoc(pf->find_base());}},
+        {"find_entry", kAny, false, "", [](patchfinder64 *pf, const callargs &){ return jsonLoc(pf->find_entry());}},
+        {"findstr", kAny, false, "str, [hasNullTerminator=true]", [](patchfinder64 *pf, const callargs &a){
+            return jsonLoc(pf->findstr(a.str(0), a.flag(1, true)));
+        }},
+        {"find_bof", kAny, false, "pos", [](patchfinder64 *pf, const callargs &a){ return jsonLoc(pf->find_bof(a.num(0)));}},
+        {"find_eof", kAny, false, "pos", [](patchfinder64 *pf, const callargs &a){ return jsonLoc(pf->find_eof(a.num(0)));}},
+        {"find_register_value", kAny, false, "where, reg, [startAddr]", [](patchfinder64 *pf, const callargs &a){
+            return jsonLoc(pf->find_register_value(a.num(0), (int)a.num(1), a.num(2, 0)));
+        }},
+        {"find_literal_ref", kAny, false, "pos, [ignoreTimes]", [](patchfinder64 *pf, const callargs &a){
+            return jsonLoc(pf->find_literal_ref(a.num(0), (int)a.num(1, 0)));
+        }},
+        {"find_literal_refs", kAny, false, "pos", [](patchfinder64 *pf, const callargs &a){ return jsonLocs(pf->find_literal_refs(a.num(0)));}},
+        {"find_call_ref", kAny, false, "pos, [ignoreTimes]", [](patchfinder64 *pf, const callargs &a){
+            return jsonLoc(pf->find_call_ref(a.num(0), (int)a.num(1, 0)));
+        }},
+        {"find_call_refs", kAny, false, "pos", [](patchfinder64 *pf, const callargs &a){ return jsonLocs(pf->find_call_refs(a.num(0)));}},
+        {"find_branch_refs", kAny, false, "pos", [](patchfinder64 *pf, const callargs &a){ return jsonLocs(pf->find_branch_refs(a.num(0)));}},
+        {"find_sym", kKernel, false, "sym", [](patchfinder64 *pf, const callargs &a){
+            return jsonLoc(((machopatchfinder64*)pf)->find_sym(a.str(0).c_str()));
+        }},
+
+        KLOC(find_syscall0),
+        KLOC(find_machtrap_table),
+        KLOC(find_kerneltask),
+        KLOC(find_rootvnode),
+        KLOC(find_allproc),
+        {"find_function_for_syscall", kKernel, false, "syscall", [](patchfinder64 *pf, const callargs &a){
+            return jsonLoc(((kernelpatchfinder64*)pf)->find_function_for_syscall((int)a.num(0)));
+        }},
+        {"find_function_for_machtrap", kKernel, false, "trapcall", [](patchfinder64 *pf, const callargs &a){
+            return jsonLoc(((kernelpatchfinder64*)pf)->find_function_for_machtrap((int)a.num(0)));
+        }},
+        KPATCH(get_MarijuanARM_patch),
+        KPATCH(get_task_conversion_eval_patch),
+        KPATCH(get_vm_fault_internal_patch),
+        KPATCH(get_trustcache_true_patch),
+        KPATCH(get_mount_patch),
+        KPATCH(get_tfp0_patch),
+        {"get_amfi_patch", kKernel, true, "[doApplyPatch=true]", [](patchfinder64 *pf, const callargs &a){
+            return jsonPatches(((kernelpatchfinder64*)pf)->get_amfi_patch(a.flag(0, true)));
+        }},
+        KPATCH(get_get_task_allow_patch),
+        KPATCH(get_apfs_snapshot_patch),
+
+        IBOOL(has_kernel_load),
+        IBOOL(has_recovery_console),
+        IPATCH(get_sigcheck_patch),
+        IPATCH(get_demotion_patch),
+        {"get_boot_arg_patch", kIBoot, true, "bootargs", [](patchfinder64 *pf, const callargs &a){
+            return jsonPatches(((ibootpatchfinder64*)pf)->get_boot_arg_patch(a.str(0).c_str()));
+        }},
+        IPATCH(get_debug_enabled_patch),
+        {"get_cmd_handler_patch", kIBoot, true, "cmd, ptr", [](patchfinder64 *pf, const callargs &a){
+            return jsonPatches(((ibootpatchfinder64*)pf)->get_cmd_handler_patch(a.str(0).c_str(), a.num(1)));
+        }},
+        IPATCH(replace_bgcolor_with_memcpy),
+        IPATCH(get_ra1nra1n_patch),
+        IPATCH(get_unlock_nvram_patch),
+        IPATCH(get_nvram_nosave_patch),
+        IPATCH(get_nvram_noremove_patch),
+        IPATCH(get_freshnonce_patch),
+        IPATCH(get_change_reboot_to_fsboot_patch),
+        {"find_iBoot_logstr", kIBoot, false, "loghex, [skip], [shortdec]", [](patchfinder64 *pf, const callargs &a){
+            return jsonLoc(((ibootpatchfinder64*)pf)->find_iBoot_logstr(a.num(0), (int)a.num(1, 0), a.num(2, 0)));
+        }},
+        {"get_el1_pagesize", kIBoot, false, "", [](patchfinder64 *pf, const callargs &){
+            return std::to_string(((ibootpatchfinder64*)pf)->get_el1_pagesize());
+        }},
+        IPATCH(get_rw_and_x_mappings_patch_el1),
+    };
+    return calls;
+}
+
+#undef KLOC
+#undef KPATCH
+#undef IBOOL
+#undef IPATCH
+
+static const char *kindName(imagekind kind){
+    switch (kind) {
+        case kKernel:   return "kernel";
+        case kIBoot:    return "iboot";
+        default:        return "any";
+    }
+}
+
+#pragma mark latency
+
+/*
+    log2 buckets, cheap enough to update on every request without a lock
+ */
+class histogram{
+    std::atomic<uint64_t> _buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _errors;
+    std::atomic<uint64_t> _totalUs;
+    std::atomic<uint64_t> _maxUs;
+
+public:
+    histogram() : _count(0), _errors(0), _totalUs(0), _maxUs(0) {
+        for (auto &b : _buckets) b = 0;
+    }
+
+    void add(uint64_t us, bool failed){
+        size_t i = 0;
+        while (i < HISTOGRAM_BUCKETS-1 && us >= (1ULL << i)) i++;
+        _buckets[i]++;
+        _count++;
+        if (failed) _errors++;
+        _totalUs += us;
+        uint64_t max = _maxUs;
+        while (us > max && !_maxUs.compare_exchange_weak(max, us));
+    }
+
+    uint64_t count() const { return _count;}
+
+    /*
+        upper bound of the bucket holding the quantile q
+     */
+    uint64_t quantile(double q) const{
+        uint64_t cnt = _count;
+        uint64_t rank = (uint64_t)(q * cnt);
+        uint64_t seen = 0;
+        for (size_t i=0; i<HISTOGRAM_BUCKETS; i++) {
+            seen += _buckets[i];
+            if (seen > rank) return std::min<uint64_t>(1ULL << i, _maxUs);
+        }
+        return _maxUs;
+    }
+
+    std::string json() const{
+        uint64_t cnt = _count;
+        std::string ret = "{\"count\": " + std::to_string(cnt) + ", \"errors\": " + std::to_string((uint64_t)_errors)
+            + ", \"mean_us\": " + std::to_string(cnt ? _totalUs / cnt : 0)
+            + ", \"p50_us\": " + std::to_string(quantile(0.5))
+            + ", \"p90_us\": " + std::to_string(quantile(0.9))
+            + ", \"p99_us\": " + std::to_string(quantile(0.99))
+            + ", \"max_us\": " + std::to_string((uint64_t)_maxUs) + ", \"buckets\": {";
+        bool first = true;
+        for (size_t i=0; i<HISTOGRAM_BUCKETS; i++) {
+            if (!_buckets[i]) continue;
+            ret += first ? "\"<" : ", \"<";
+            first = false;
+            ret += std::to_string(1ULL << i) + "\": " + std::to_string((uint64_t)_buckets[i]);
+        }
+        return ret + "}}";
+    }
+};
+
+#pragma mark finder cache
+
+class findercache{
+public:
+    struct slot{
+        std::mutex loadLock;
+        std::shared_ptr<patchfinder64> pf;
+        imagekind kind = kAny;
+        std::shared_mutex useLock;  //shared for primitives, exclusive for calls which reserve caves
+        uint64_t charge = 0;
+    };
+private:
+    struct fileid{
+        uint64_t size;
+        int64_t mtimeNs;
+        uint64_t hash;
+    };
+
+    const options &_opt;
+    std::mutex _lock;
+    std::list<uint64_t> _lru;   //front is the most recent
+    std::unordered_map<uint64_t, std::pair<std::shared_ptr<slot>, std::list<uint64_t>::iterator>> _slots;
+    std::map<std::pair<uint64_t, uint64_t>, fileid> _hashes;    //(dev, ino) -> hash, so unchanged files aren't hashed again
+    uint64_t _used;
+    uint64_t _hits;
+    uint64_t _misses;
+    uint64_t _evictions;
+
+    uint64_t hashFile(const char *path, const struct stat &st){
+#ifdef __APPLE__
+        int64_t mtimeNs = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        int64_t mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+        std::pair<uint64_t, uint64_t> key = {(uint64_t)st.st_dev, (uint64_t)st.st_ino};
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            auto it = _hashes.find(key);
+            if (it != _hashes.end() && it->second.size == (uint64_t)st.st_size && it->second.mtimeNs == mtimeNs) return it->second.hash;
+        }
+        imagefile::image img = imagefile::load(path);
+        uint64_t hash = resultcache::hashImage(img.buf, img.size);
+        imagefile::release(img.buf, img.mappedSize);
+        std::unique_lock<std::mutex> ul(_lock);
+        _hashes[key] = {(uint64_t)st.st_size, mtimeNs, hash};
+        return hash;
+    }
+
+    void load(slot &s, const char *path){
+        s.kind = sniff(path);
+        retassure(s.kind != kUnknown, "%s is not a kernelcache or iBoot", path);
+        if (s.kind == kKernel) {
+            s.pf.reset(new kernelpatchfinder64(path));
+        }else{
+            s.pf.reset(ibootpatchfinder64::make_ibootpatchfinder64(path));
+        }
+        if (_opt.buildIndices) {
+            s.pf->build_xref_index();
+            s.pf->build_callgraph_index();
+            s.pf->build_function_table();
+            s.pf->build_string_index();
+        }
+    }
+
+    //with _lock held
+    void evictFor(uint64_t charge){
+        while (_lru.size() && _used + charge > _opt.memoryBudget) {
+            uint64_t victim = _lru.back();
+            auto it = _slots.find(victim);
+            _used -= it->second.first->charge;
+            _slots.erase(it);
+            _lru.pop_back();
+            _evictions++;
+        }
+    }
+
+    void drop(uint64_t hash, const std::shared_ptr<slot> &s){
+        std::unique_lock<std::mutex> ul(_lock);
+        auto it = _slots.find(hash);
+        if (it == _slots.end() || it->second.first != s) return;
+        _used -= s->charge;
+        _lru.erase(it->second.second);
+        _slots.erase(it);
+    }
+
+public:
+    findercache(const options &opt) : _opt(opt), _used(0), _hits(0), _misses(0), _evictions(0) {}
+
+    /*
+        the finder for the image at path, loading it if no image with the same hash is cached.
+        Concurrent requests for an image which is still loading wait for that load
+     */
+    std::shared_ptr<slot> get(const char *path, bool &wasCached){
+        struct stat st = {};
+        retassure(!stat(path, &st), "failed to stat %s", path);
+        uint64_t hash = hashFile(path, st);
+
+        std::shared_ptr<slot> s;
+        {
+            std::unique_lock<std::mutex> ul(_lock);
+            auto it = _slots.find(hash);
+            if (it != _slots.end()) {
+                s = it->second.first;
+                _lru.splice(_lru.begin(), _lru, it->second.second);
+                _hits++;
+                wasCached = true;
+            }else{
+                s = std::make_shared<slot>();
+                s->charge = (uint64_t)(st.st_size * _opt.indexFactor);
+                evictFor(s->charge);
+                _lru.push_front(hash);
+                _slots[hash] = {s, _lru.begin()};
+                _used += s->charge;
+                _misses++;
+                wasCached = false;
+            }
+        }
+
+        std::unique_lock<std::mutex> ul(s->loadLock);
+        if (!s->pf) {
+            try {
+                load(*s, path);
+            } catch (...) {
+                //don't keep a slot which would fail again, the next request retries
+                s->pf = NULL;
+                drop(hash, s);
+                throw;
+            }
+        }
+        return s;
+    }
+
+    std::string json(){
+        std::unique_lock<std::mutex> ul(_lock);
+        return "{\"entries\": " + std::to_string(_slots.size()) + ", \"charged_bytes\": " + std::to_string(_used)
+            + ", \"budget_bytes\": " + std::to_string(_opt.memoryBudget) + ", \"hits\": " + std::to_string(_hits)
+            + ", \"misses\": " + std::to_string(_misses) + ", \"evictions\": " + std::to_string(_evictions) + "}";
+    }
+};
+
+#pragma mark server
+
+class server{
+    const options &_opt;
+    findercache _cache;
+    std::map<std::string, const call *> _calls;
+    std::map<std::string, std::unique_ptr<histogram>> _latency;  //filled before serving, read only afterwards
+    histogram _loadLatency;
+    std::chrono::steady_clock::time_point _started;
+    std::atomic<uint64_t> _clients;
+
+    std::string handle(const jsonvalue &req, std::string &id){
+        retassure(req.type == jsonvalue::kObject, "request is not a JSON object");
+        if (auto v = req.get("id")) {
+            //echoed back, so only what we can write as valid JSON again
+            if (v->type == jsonvalue::kString) {
+                id = jsonString(v->str);
+            } else if (v->type != jsonvalue::kNull) {
+                retassure(v->type == jsonvalue::kNumber && isJSONNumber(v->str), "id has to be a string, a number or null");
+                id = v->str;
+            }
+        }
+        auto callName = req.get("call");
+        retassure(callName && callName->type == jsonvalue::kString, "request has no call");
+
+        if (callName->str == "stats") return stats();
+        if (callName->str == "calls") return listCalls();
+
+        auto c = _calls.find(callName->str);
+        retassure(c != _calls.end(), "unknown call %s", callName->str.c_str());
+        auto image = req.get("image");
+        retassure(image && image->type == jsonvalue::kString, "%s needs an image", c->first.c_str());
+        static const std::vector<jsonvalue> noArgs;
+        auto args = req.get("args");
+        retassure(!args || args->type == jsonvalue::kArray, "args is not an array");
+
+        auto loadStart = std::chrono::steady_clock::now();
+        bool wasCached = false;
+        std::shared_ptr<findercache::slot> s;
+        try {
+            s = _cache.get(image->str.c_str(), wasCached);
+        } catch (...) {
+            _loadLatency.add(elapsedUs(loadStart), true);
+            throw;
+        }
+        if (!wasCached) _loadLatency.add(elapsedUs(loadStart), false);
+        retassure(c->second->kind == kAny || c->second->kind == s->kind, "%s needs a %s image", c->first.c_str(), kindName(c->second->kind));
+
+        auto callStart = std::chrono::steady_clock::now();
+        std::string result;
+        bool failed = true;
+        cleanup([&]{
+            _latency.find(c->first)->second->add(elapsedUs(callStart), failed);
+        })
+        if (c->second->exclusive) {
+            //every request gets the caves a freshly loaded finder would give it
+            std::unique_lock<std::shared_mutex> ul(s->useLock);
+            cavescope caves(s->pf.get());
+            cleanup([&]{
+                caves.rollback();
+            })
+            result = c->second->run(s->pf.get(), callargs(args ? args->arr : noArgs));
+        }else{
+            std::shared_lock<std::shared_mutex> sl(s->useLock);
+            result = c->second->run(s->pf.get(), callargs(args ? args->arr : noArgs));
+        }
+        failed = false;
+        return "\"result\": " + result + ", \"cached\": " + (wasCached ? "true" : "false");
+    }
+
+    std::string stats(){
+        std::string ret = "\"result\": {\"uptime_s\": " + std::to_string((uint64_t)std::chrono::duration<double>(std::chrono::steady_clock::now() - _started).count())
+            + ", \"clients\": " + std::to_string((uint64_t)_clients) + ", \"cache\": " + _cache.json()
+            + ", \"load\": " + _loadLatency.json() + ", \"calls\": {";
+        bool first = true;
+        for (auto &l : _latency) {
+            if (!l.second->count()) continue;
+            ret += first ? "" : ", ";
+            first = false;
+            ret += jsonString(l.first) + ": " + l.second->json();
+        }
+        return ret + "}}";
+    }
+
+    std::string listCalls(){
+        std::string ret = "\"result\": [";
+        bool first = true;
+        for (auto &c : allCalls()) {
+            ret += first ? "" : ", ";
+            first = false;
+            ret += "{\"call\": " + jsonString(c.name) + ", \"image\": " + jsonString(kindName(c.kind)) + ", \"args\": " + jsonString(c.args) + "}";
+        }
+        return ret + "]";
+    }
+
+    static uint64_t elapsedUs(std::chrono::steady_clock::time_point start){
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    std::string respond(const std::string &line){
+        auto start = std::chrono::steady_clock::now();
+        std::string id = "null";
+        std::string body;
+        try {
+            jsonparser p(line);
+            jsonvalue req = p.parse();
+            retassure(p.atEnd(), "trailing data after request");
+            body = handle(req, id);
+        } catch (tihmstar::exception &e) {
+            body = "\"error\": " + jsonString(e.what());
+        } catch (std::exception &e) {
+            body = "\"error\": " + jsonString(e.what());
+        } catch (...) {
+            body = "\"error\": \"unknown exception\"";
+        }
+        return "{\"id\": " + id + ", " + body + ", \"us\": " + std::to_string(elapsedUs(start)) + "}\n";
+    }
+
+    void serveClient(int fd){
+        cleanup([&]{
+            close(fd);
+            _clients--;
+        })
+        std::string pending;
+        char buf[0x4000];
+        ssize_t didRead = 0;
+        while ((didRead = recv(fd, buf, sizeof(buf), 0)) > 0) {
+            pending.append(buf, didRead);
+            size_t pos = 0;
+            size_t nl = 0;
+            while ((nl = pending.find('\n', pos)) != std::string::npos) {
+                std::string line = pending.substr(pos, nl - pos);
+                pos = nl + 1;
+                if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+                std::string resp = respond(line);
+                for (size_t sent = 0; sent < resp.size();) {
+                    ssize_t didSend = send(fd, resp.data() + sent, resp.size() - sent, MSG_NOSIGNAL);
+                    if (didSend <= 0) return;
+                    sent += didSend;
+                }
+            }
+            pending.erase(0, pos);
+            if (pending.size() > MAX_REQUEST_SIZE) {
+                std::string resp = "{\"id\": null, \"error\": \"request too large\"}\n";
+                send(fd, resp.data(), resp.size(), MSG_NOSIGNAL);
+                return;
+            }
+        }
+    }
+
+public:
+    server(const options &opt) : _opt(opt), _cache(opt), _started(std::chrono::steady_clock::now()), _clients(0) {
+        for (auto &c : allCalls()) {
+            _calls[c.name] = &c;
+            _latency[c.name].reset(new histogram);
+        }
+    }
+
+    void run(int listenFd){
+        while (true) {
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                reterror("accept failed with errno=%d", errno);
+            }
+            _clients++;
+            std::thread(&server::serveClient, this, fd).detach();
+        }
+    }
+};
+
+#pragma mark socket
+
+static const char *gSocketPath = NULL;
+
+static void removeSocket(int sig){
+    unlink(gSocketPath);
+    _exit(sig == SIGTERM || sig == SIGINT ? 0 : 1);
+}
+
+static struct sockaddr_un socketAddr(const char *path){
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    retassure(strlen(path) < sizeof(addr.sun_path), "socket path %s is too long", path);
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    return addr;
+}
+
+static int listenOn(const char *path){
+    struct sockaddr_un addr = socketAddr(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    retassure(fd != -1, "failed to create socket");
+
+    //a socket nobody answers on is left over from a daemon which died, one that answers is in use
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe != -1) {
+        bool inUse = !connect(probe, (struct sockaddr*)&addr, sizeof(addr));
+        close(probe);
+        if (inUse) {
+            close(fd);
+            reterror("%s is in use by another daemon", path);
+        }
+    }
+    unlink(path);
+
+    mode_t oldMask = umask(0077); //the socket hands out image contents, keep it to this user
+    int err = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(oldMask);
+    if (err || listen(fd, SOMAXCONN)) {
+        close(fd);
+        reterror("failed to listen on %s errno=%d", path, errno);
+    }
+    return fd;
+}
+
+/*
+    sends the requests from stdin, one per line, and prints the responses
+ */
+static int query(const char *path){
+    struct sockaddr_un addr = socketAddr(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    retassure(fd != -1, "failed to create socket");
+    cleanup([&]{
+        close(fd);
+    })
+    retassure(!connect(fd, (struct sockaddr*)&addr, sizeof(addr)), "failed to connect to %s errno=%d", path, errno);
+
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t len = 0;
+    size_t sentCnt = 0;
+    while ((len = getline(&line, &lineCap, stdin)) != -1) {
+        std::string req(line, len);
+        if (req.back() != '\n') req += '\n';
+        for (size_t sent = 0; sent < req.size();) {
+            ssize_t didSend = send(fd, req.data() + sent, req.size() - sent, MSG_NOSIGNAL);
+            retassure(didSend > 0, "failed to send request");
+            sent += didSend;
+        }
+        sentCnt++;
+    }
+    free(line);
+    shutdown(fd, SHUT_WR);
+
+    char buf[0x4000];
+    ssize_t didRead = 0;
+    size_t received = 0;
+    while ((didRead = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        fwrite(buf, 1, didRead, stdout);
+        received += std::count(buf, buf + didRead, '\n');
+    }
+    fflush(stdout);
+    return received == sentCnt ? 0 : 2;
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [options]\n", prog);
+    printf("  -s, --socket <path>           Unix socket to listen on (default %s)\n", DEFAULT_SOCKET);
+    printf("  -M, --memory-budget <bytes>   charged bytes of all loaded finders, k/m/g suffixes work (default 4g)\n");
+    printf("  -x, --index-factor <f>        finders are charged image size times this (default %.1f)\n", DEFAULT_INDEX_FACTOR);
+    printf("  -n, --no-indices              don't build the xref/call/function/string indices on load\n");
+    printf("  -q, --query                   send requests from stdin to a running daemon and print the responses\n");
+}
+
+int main(int argc, char * const argv[]){
+    static struct option longopts[] = {
+        {"socket",          required_argument,  NULL, 's'},
+        {"memory-budget",   required_argument,  NULL, 'M'},
+        {"index-factor",    required_argument,  NULL, 'x'},
+        {"no-indices",      no_argument,        NULL, 'n'},
+        {"query",           no_argument,        NULL, 'q'},
+        {"help",            no_argument,        NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    options opt;
+    bool doQuery = false;
+    int c = 0;
+    while ((c = getopt_long(argc, argv, "s:M:x:nqh", longopts, NULL)) != -1) {
+        switch (c) {
+            case 's':
+                opt.socketPath = optarg;
+                break;
+            case 'M':
+                opt.memoryBudget = parseSize(optarg);
+                break;
+            case 'x':
+                opt.indexFactor = strtod(optarg, NULL);
+                break;
+            case 'n':
+                opt.buildIndices = false;
+                break;
+            case 'q':
+                doQuery = true;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        if (doQuery) return query(opt.socketPath);
+
+        int listenFd = listenOn(opt.socketPath);
+        gSocketPath = opt.socketPath;
+        signal(SIGINT, removeSocket);
+        signal(SIGTERM, removeSocket);
+        signal(SIGPIPE, SIG_IGN);
+        fprintf(stderr, "listening on %s\n", opt.socketPath);
+
+        server s(opt);
+        s.run(listenFd);
+    } catch (tihmstar::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        if (gSocketPath) unlink(gSocketPath);
+        return 1;
+    }
+    return 0;
+}
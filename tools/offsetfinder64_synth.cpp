@@ -0,0 +1,206 @@
+//
+//  offsetfinder64_synth.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgeneral/macros.h>
+
+#include <liboffsetfinder64/kernelpatchfinder64.hpp>
+#include <liboffsetfinder64/ibootpatchfinder64.hpp>
+
+#include "synthimage.hpp"
+#include "toolutil.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace toolutil;
+
+/*
+    Writes a synthetic image and its groundtruth (<image>.json unless -g is given).
+    With --verify the image is loaded with the matching finder afterwards and a sample of the
+    planted anchors is looked up through the indices.
+ */
+
+#define VERIFY_SAMPLES  64
+
+template <typename T, typename F>
+static size_t checkSample(const char *what, const std::vector<T> &all, F check){
+    size_t failed = 0;
+    size_t cnt = std::min<size_t>(all.size(), VERIFY_SAMPLES);
+    for (size_t i=0; i<cnt; i++) {
+        const T &e = all[i * all.size() / cnt];
+        if (!check(e)) failed++;
+    }
+    fprintf(stderr, "%-10s %zu/%zu ok\n", what, cnt - failed, cnt);
+    return failed;
+}
+
+static bool contains(const std::vector<loc_t> &v, loc_t l){
+    return std::find(v.begin(), v.end(), l) != v.end();
+}
+
+static size_t verify(const synthimage::groundtruth &gt, const char *path){
+    std::unique_ptr<patchfinder64> pf;
+    if (gt.type == synthimage::kMachO) {
+        pf.reset(new kernelpatchfinder64(path));
+    }else{
+        pf.reset(ibootpatchfinder64::make_ibootpatchfinder64(path));
+    }
+    size_t failed = 0;
+    if (pf->find_base() != gt.base || pf->find_entry() != gt.entry) {
+        fprintf(stderr, "base/entry 0x%016llx/0x%016llx, expected 0x%016llx/0x%016llx\n", pf->find_base(), pf->find_entry(), gt.base, gt.entry);
+        failed++;
+    }
+
+    pf->build_xref_index();
+    pf->build_callgraph_index();
+    pf->build_function_table();
+
+    failed += checkSample("strings", gt.strings, [&](const synthimage::string &s){
+        return pf->findstr(s.str, true) == s.loc;
+    });
+    failed += checkSample("xrefs", gt.xrefs, [&](const synthimage::ref &r){
+        return contains(pf->find_literal_refs(r.target), r.site);
+    });
+    failed += checkSample("calls", gt.calls, [&](const synthimage::ref &r){
+        return contains(pf->find_call_refs(r.target), r.site);
+    });
+    failed += checkSample("functions", gt.functions, [&](const synthimage::function &f){
+        return pf->find_bof(f.start + (f.end - f.start) / 2) == f.start;
+    });
+    return failed;
+}
+
+static void usage(const char *prog){
+    printf("Usage: %s [options] <out image>\n", prog);
+    printf("  -k, --kind <macho|iboot>      image kind (default macho)\n");
+    printf("  -s, --size <bytes>            image size, k/m/g suffixes work (default 16m)\n");
+    printf("  -f, --functions <n>           function count (default one per 2k)\n");
+    printf("  -S, --string-density <d>      strings per function (default 0.5)\n");
+    printf("  -x, --xref-density <d>        references per string (default 1.0)\n");
+    printf("  -c, --call-density <d>        share of functions calling another one (default 0.5)\n");
+    printf("  -n, --caves <n>               nop caves (default 16)\n");
+    printf("  -N, --cave-nops <n>           nops per cave (default 32)\n");
+    printf("  -r, --seed <n>                seed (default 0)\n");
+    printf("  -b, --base <addr>             base address (default depends on kind)\n");
+    printf("  -v, --iboot-version <str>     iBoot version string (default iBoot-7429.12.15)\n");
+    printf("  -g, --ground-truth <file>     write groundtruth JSON here (default <out image>.json)\n");
+    printf("  -V, --verify                  load the image afterwards and check planted anchors\n");
+}
+
+int main(int argc, char * const argv[]){
+    static struct option longopts[] = {
+        {"kind",            required_argument,  NULL, 'k'},
+        {"size",            required_argument,  NULL, 's'},
+        {"functions",       required_argument,  NULL, 'f'},
+        {"string-density",  required_argument,  NULL, 'S'},
+        {"xref-density",    required_argument,  NULL, 'x'},
+        {"call-density",    required_argument,  NULL, 'c'},
+        {"caves",           required_argument,  NULL, 'n'},
+        {"cave-nops",       required_argument,  NULL, 'N'},
+        {"seed",            required_argument,  NULL, 'r'},
+        {"base",            required_argument,  NULL, 'b'},
+        {"iboot-version",   required_argument,  NULL, 'v'},
+        {"ground-truth",    required_argument,  NULL, 'g'},
+        {"verify",          no_argument,        NULL, 'V'},
+        {"help",            no_argument,        NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    synthimage::params p;
+    const char *gtPath = NULL;
+    bool doVerify = false;
+    int c = 0;
+    while ((c = getopt_long(argc, argv, "k:s:f:S:x:c:n:N:r:b:v:g:Vh", longopts, NULL)) != -1) {
+        switch (c) {
+            case 'k':
+                if (!strcmp(optarg, "macho")) {
+                    p.type = synthimage::kMachO;
+                }else if (!strcmp(optarg, "iboot")) {
+                    p.type = synthimage::kIBoot;
+                }else{
+                    fprintf(stderr, "unknown kind %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                p.size = parseSize(optarg);
+                break;
+            case 'f':
+                p.functionCnt = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                p.stringDensity = strtod(optarg, NULL);
+                break;
+            case 'x':
+                p.xrefDensity = strtod(optarg, NULL);
+                break;
+            case 'c':
+                p.callDensity = strtod(optarg, NULL);
+                break;
+            case 'n':
+                p.caveCnt = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'N':
+                p.caveNops = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                p.seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'b':
+                p.base = strtoull(optarg, NULL, 0);
+                break;
+            case 'v':
+                p.ibootVersion = optarg;
+                break;
+            case 'g':
+                gtPath = optarg;
+                break;
+            case 'V':
+                doVerify = true;
+                break;
+            default:
+                usage(argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc-1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *out = argv[optind];
+    std::string gtDefault = std::string(out) + ".json";
+    if (!gtPath) gtPath = gtDefault.c_str();
+
+    try {
+        synthimage::groundtruth gt = synthimage::generate_file(p, out);
+        fprintf(stderr, "%s: 0x%llx bytes, %zu functions, %zu strings, %zu xrefs, %zu calls, %zu caves\n",
+                out, (unsigned long long)gt.size, gt.functions.size(), gt.strings.size(), gt.xrefs.size(), gt.calls.size(), gt.caves.size());
+
+        FILE *f = fopen(gtPath, "w");
+        if (!f) {
+            fprintf(stderr, "failed to open %s\n", gtPath);
+            return 1;
+        }
+        synthimage::write_groundtruth(gt, f);
+        fclose(f);
+
+        if (doVerify && verify(gt, out)) {
+            fprintf(stderr, "%s: verification failed\n", out);
+            return 3;
+        }
+    } catch (tihmstar::exception &e) {
+        fprintf(stderr, "%s: failed: %s\n", out, e.what());
+        return 2;
+    }
+    return 0;
+}
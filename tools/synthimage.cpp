@@ -0,0 +1,802 @@
+//
+//  synthimage.cpp
+//  liboffsetfinder64
+//
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+
+#include <libgeneral/macros.h>
+
+#include "synthimage.hpp"
+#include "toolutil.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace synthimage;
+
+#define SYNTH_PAGE_SIZE             0x4000
+#define MIN_IMAGE_SIZE              (4*SYNTH_PAGE_SIZE)
+
+#define DEFAULT_MACHO_BASE          0xfffffff007004000
+#define DEFAULT_IBOOT_BASE          0x19c030000
+
+
+#define ARM_THREAD_STATE64          6
+#define ARM_THREAD_STATE64_COUNT    68
+
+#define OPCODE_NOP                  0xd503201f
+#define OPCODE_RET                  0xd65f03c0
+#define OPCODE_PROLOGUE_STP         0xa9bf7bfd  //stp x29, x30, [sp, #-0x10]!
+#define OPCODE_PROLOGUE_MOV         0x910003fd  //mov x29, sp
+#define OPCODE_EPILOGUE_LDP         0xa8c17bfd  //ldp x29, x30, [sp], #0x10
+#define OPCODE_FILLER               0x91000529  //add x9, x9, #1
+#define OPCODE_MRS_X8_TPIDR_EL1     0xd538d088
+#define OPCODE_AND_W10_W8_FF        0x12001d0a
+#define OPCODE_CMP_W10_6            0x7100195f
+#define OPCODE_MOVZ_W10_16          0x528002ca
+#define OPCODE_MOV_X11_X0           0xaa0003eb
+#define OPCODE_MOV_X0_X20           0xaa1403e0
+#define OPCODE_ORR_W8_10000         0x32100108  //orr w8, w8, #0x10000
+#define OPCODE_AND_X8_NOT_2000      0x9272f908  //and x8, x8, #0xffffffffffffdfff
+
+#define COND_EQ                     0
+#define COND_NE                     1
+
+#define ADRP_RANGE                  (1LL << 32)
+#define ADR_RANGE                   (1LL << 20)
+#define BL_RANGE                    (1LL << 27)
+#define CBZ_RANGE                   (1LL << 20)
+
+#define FUNCTION_SYMBOL_PREFIX      "_synth_func_"
+
+#define KERNEL_ANCHOR_WORDS         128     //every kernel anchor function, filler pads it
+#define KERNEL_MACHTRAP_CNT         128
+#define KERNEL_MACHTRAP_SIZE        0x20
+#define KERNEL_SYSENT_OFFSET        0x1000
+#define KERNEL_SYSENT_CNT           168     //up to mount
+#define KERNEL_SYSENT_SIZE          0x18
+#define KERNEL_VARS_OFFSET          0x2100  //not at the start of a page, adrp+ldr chains ref page+0 and page+8
+#define KERNEL_DATA_SIZE            SYNTH_PAGE_SIZE
+#define KERNEL_SYSCALL_SIG          "\x06\x00\x00\x00\x03\x00\x0c\x00" //sysent[3] return type, narg, arg bytes
+
+namespace {
+    //splitmix64, the image must not depend on the host's std::random implementation
+    class prng{
+        uint64_t _state;
+    public:
+        prng(uint64_t seed) : _state(seed) {}
+        uint64_t next(){
+            uint64_t z = (_state += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            return z ^ (z >> 31);
+        }
+        uint64_t below(uint64_t n){
+            return next() % n;
+        }
+        bool chance(double p){
+            return (next() >> 11) * 0x1.0p-53 < p;
+        }
+    };
+
+    struct layout{
+        uint64_t size;
+        loc_t base;
+        uint64_t cstrOff;
+        uint64_t cstrSize;
+        uint64_t dataOff;
+        uint64_t textOff;
+        uint64_t textEnd;
+        uint64_t linkeditOff;
+        uint64_t symOff;
+        uint64_t strOff;
+        uint64_t strSize;
+    };
+
+    //what kernelpatchfinder64 searches for, in this order after the random strings
+    enum kernelString{
+        kStrKernelTask,
+        kStrVMFault,
+        kStrMountAsRoot,
+        kStrAMFIExecve,
+        kStrAMFIHashType,
+        kStrGetTaskAllow,
+        kStrOSUpdate,
+        kStrPgrpAdd,
+        kStrVersion,
+        kKernelStringCnt
+    };
+
+    //the functions the kernel finders look for, at the start of __text
+    enum kernelAnchor{
+        kFnKernelTask,
+        kFnTaskConversionEval,
+        kFnVMFault,
+        kFnTrustcache,
+        kFnMount,
+        kFnMountInternal,
+        kFnAMFIExecve,
+        kFnAMFIHashType,
+        kFnGetTaskAllow,
+        kFnGetTaskAllowCaller,
+        kFnAllproc,
+        kKernelAnchorCnt
+    };
+}
+
+//at KERNEL_VARS_OFFSET, 8 bytes each
+static const char *kKernelDataSymbols[] = {
+    "_kernel_task",
+    "_allproc",
+    "_rootvnode",
+};
+#define KERNEL_DATA_SYMBOL_CNT      (sizeof(kKernelDataSymbols)/sizeof(*kKernelDataSymbols))
+
+static const char *kKernelStrings[kKernelStringCnt] = {
+    "current_task() == kernel_task",
+    "\"Write fault on compressor map, va: %p type: %u bounds: %p->%p\" @%s:%d",
+    "%s:%d: not allowed to mount as root\n",
+    "AMFI: hook..execve() killing pid %u: %s\n",
+    "%s: Hash type is not SHA256 (%u) but %u.",
+    "get-task-allow",
+    "com.apple.os.update-",
+    "\"pgrp_add : pgrp is dead adding process\"",
+    "Darwin Kernel Version 20.0.0: synth; root:xnu-7195.0.0~1/RELEASE_ARM64_T8030",
+};
+
+static uint64_t roundUp(uint64_t v, uint64_t align){
+    return (v + align - 1) & ~(align - 1);
+}
+
+static bool inRange(loc_t pc, loc_t target, int64_t range){
+    int64_t d = (int64_t)(target - pc);
+    return d >= -range && d < range;
+}
+
+static uint32_t encodeAdrp(loc_t pc, loc_t target, int rd){
+    int64_t pages = ((int64_t)(target & ~0xfffULL) - (int64_t)(pc & ~0xfffULL)) >> 12;
+    return 0x90000000 | (uint32_t)((pages & 3) << 29) | (uint32_t)(((pages >> 2) & 0x7ffff) << 5) | rd;
+}
+
+static uint32_t encodeAddImm(int rd, int rn, uint32_t imm12){
+    return 0x91000000 | (imm12 << 10) | (rn << 5) | rd;
+}
+
+static uint32_t encodeAdr(loc_t pc, loc_t target, int rd){
+    int64_t d = (int64_t)(target - pc);
+    return 0x10000000 | (uint32_t)((d & 3) << 29) | (uint32_t)(((d >> 2) & 0x7ffff) << 5) | rd;
+}
+
+static uint32_t encodeBl(loc_t pc, loc_t target){
+    return 0x94000000 | (uint32_t)(((int64_t)(target - pc) >> 2) & 0x3ffffff);
+}
+
+static uint32_t encodeCbz(loc_t pc, loc_t target, int rt){
+    return 0xb4000000 | (uint32_t)((((int64_t)(target - pc) >> 2) & 0x7ffff) << 5) | rt;
+}
+
+static uint32_t encodeBcond(loc_t pc, loc_t target, int cond){
+    return 0x54000000 | (uint32_t)((((int64_t)(target - pc) >> 2) & 0x7ffff) << 5) | cond;
+}
+
+static uint32_t encodeTbz(loc_t pc, loc_t target, int rt, int bit, bool nonzero){
+    return (nonzero ? 0x37000000 : 0x36000000) | (uint32_t)((bit >> 5) << 31) | (uint32_t)((bit & 0x1f) << 19)
+            | (uint32_t)((((int64_t)(target - pc) >> 2) & 0x3fff) << 5) | rt;
+}
+
+static uint32_t encodeLdrImm(int rt, int rn, uint32_t off){
+    return 0xf9400000 | ((off / 8) << 10) | (rn << 5) | rt;
+}
+
+static uint32_t encodeLdrbImm(int rt, int rn, uint32_t off){
+    return 0x39400000 | (off << 10) | (rn << 5) | rt;
+}
+
+static uint32_t encodeCmp(int rn, int rm, bool is64){
+    return (is64 ? 0xeb00001f : 0x6b00001f) | (rm << 16) | (rn << 5);
+}
+
+static uint32_t encodeCcmp(int rn, int rm, int nzcv, int cond){
+    return 0xfa400000 | (rm << 16) | (cond << 12) | (rn << 5) | nzcv;
+}
+
+static uint32_t encodeMadd(int rd, int rn, int rm, int ra){
+    return 0x9b000000 | (rm << 16) | (ra << 10) | (rn << 5) | rd;
+}
+
+static std::string makeString(prng &rng, uint64_t idx){
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "synth_%llx_", (unsigned long long)idx);
+    std::string ret = prefix;
+    for (size_t len = 4 + rng.below(29); len; len--) {
+        ret += (char)('a' + rng.below(26));
+    }
+    return ret;
+}
+
+static size_t symbolNameSize(uint64_t idx){
+    return sizeof(FUNCTION_SYMBOL_PREFIX) + std::to_string(idx).size(); //including the NUL
+}
+
+static void writeMachOHeaders(uint8_t *buf, const layout &l, uint32_t symbolCnt, loc_t entry){
+    struct mach_header_64 *mh = (struct mach_header_64 *)buf;
+    mh->magic = MH_MAGIC_64;
+    mh->cputype = CPU_TYPE_ARM64;
+    mh->cpusubtype = CPU_SUBTYPE_ARM64_ALL;
+    mh->filetype = MH_EXECUTE;
+    mh->flags = MH_NOUNDEFS;
+
+    uint8_t *cmd = (uint8_t *)(mh + 1);
+    auto addSegment = [&](const char *segname, uint64_t fileoff, uint64_t size, vm_prot_t prot, const char *sectname, uint64_t sectoff, uint64_t sectsize, uint32_t sectflags){
+        struct segment_command_64 *seg = (struct segment_command_64 *)cmd;
+        seg->cmd = LC_SEGMENT_64;
+        seg->cmdsize = sizeof(*seg) + (sectname ? sizeof(struct section_64) : 0);
+        strncpy(seg->segname, segname, sizeof(seg->segname));
+        seg->vmaddr = l.base + fileoff;
+        seg->vmsize = size;
+        seg->fileoff = fileoff;
+        seg->filesize = size;
+        seg->maxprot = seg->initprot = prot;
+        if (sectname) {
+            struct section_64 *sect = (struct section_64 *)(seg + 1);
+            strncpy(sect->sectname, sectname, sizeof(sect->sectname));
+            strncpy(sect->segname, segname, sizeof(sect->segname));
+            sect->addr = l.base + sectoff;
+            sect->size = sectsize;
+            sect->offset = (uint32_t)sectoff;
+            sect->flags = sectflags;
+            seg->nsects = 1;
+        }
+        cmd += seg->cmdsize;
+        mh->ncmds++;
+    };
+
+    //section numbers in the symbols below follow this order: __cstring is 1, __data is 2, __text is 3
+    addSegment("__TEXT", 0, l.dataOff, VM_PROT_READ, "__cstring", l.cstrOff, l.cstrSize, S_CSTRING_LITERALS);
+    addSegment("__DATA", l.dataOff, KERNEL_DATA_SIZE, VM_PROT_READ | VM_PROT_WRITE, "__data", l.dataOff, KERNEL_DATA_SIZE, S_REGULAR);
+    addSegment("__LINKEDIT", l.linkeditOff, l.textOff - l.linkeditOff, VM_PROT_READ, NULL, 0, 0, 0);
+    addSegment("__TEXT_EXEC", l.textOff, l.textEnd - l.textOff, VM_PROT_READ | VM_PROT_EXECUTE,
+               "__text", l.textOff, l.textEnd - l.textOff, S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS);
+
+    struct symtab_command *symtab = (struct symtab_command *)cmd;
+    symtab->cmd = LC_SYMTAB;
+    symtab->cmdsize = sizeof(*symtab);
+    symtab->symoff = (uint32_t)l.symOff;
+    symtab->nsyms = symbolCnt;
+    symtab->stroff = (uint32_t)l.strOff;
+    symtab->strsize = (uint32_t)l.strSize;
+    cmd += symtab->cmdsize;
+    mh->ncmds++;
+
+    //{flavor, count} and the arm_thread_state64: x0-x28, fp, lr, sp, pc, cpsr, pad
+    struct load_command *thread = (struct load_command *)cmd;
+    thread->cmd = LC_UNIXTHREAD;
+    thread->cmdsize = sizeof(*thread) + 2*sizeof(uint32_t) + ARM_THREAD_STATE64_COUNT*sizeof(uint32_t);
+    uint32_t *ptr = (uint32_t *)(thread + 1);
+    ptr[0] = ARM_THREAD_STATE64;
+    ptr[1] = ARM_THREAD_STATE64_COUNT;
+    memcpy(&ptr[2 + 32*2], &entry, sizeof(entry));
+    cmd += thread->cmdsize;
+    mh->ncmds++;
+
+    mh->sizeofcmds = (uint32_t)(cmd - (uint8_t *)(mh + 1));
+}
+
+/*
+    the functions every kernelpatchfinder64 finder looks for, they are the first kKernelAnchorCnt in gt.functions.
+    firstString is where kKernelStrings start in gt.strings
+ */
+static void writeKernelAnchors(uint8_t *buf, const layout &l, groundtruth &gt, size_t firstString){
+    uint32_t *code = (uint32_t *)buf;
+    kernelresults &k = gt.kernel;
+    loc_t kernelTask = l.base + l.dataOff + KERNEL_VARS_OFFSET;
+    loc_t allproc = kernelTask + 8;
+    loc_t pc = 0;
+    auto emit = [&](uint32_t insn) {
+        code[(pc - l.base) / 4] = insn;
+        pc += 4;
+    };
+    auto str = [&](kernelString s) -> loc_t {
+        return gt.strings[firstString + s].loc;
+    };
+    //adrp+add, the add is what find_literal_ref returns
+    auto refer = [&](int rd, loc_t target) {
+        emit(encodeAdrp(pc, target, rd));
+        gt.xrefs.push_back({target, pc});
+        emit(encodeAddImm(rd, rd, target & 0xfff));
+    };
+    //adrp+ldr, the ldr is what find_literal_ref returns
+    auto load = [&](int rt, loc_t target) {
+        emit(encodeAdrp(pc, target, rt));
+        gt.xrefs.push_back({target, pc});
+        emit(encodeLdrImm(rt, rt, target & 0xfff));
+    };
+    auto branch = [&](uint32_t insn, loc_t target) {
+        gt.branches.push_back({target, pc});
+        emit(insn);
+    };
+    auto call = [&](loc_t target) {
+        gt.calls.push_back({target, pc});
+        emit(encodeBl(pc, target));
+    };
+
+    for (int fn=0; fn<kKernelAnchorCnt; fn++) {
+        const function &f = gt.functions[fn];
+        loc_t epilogue = f.end - 8;
+        pc = f.start;
+        emit(OPCODE_PROLOGUE_STP);
+        emit(OPCODE_PROLOGUE_MOV);
+        switch (fn) {
+            case kFnKernelTask:
+                //mrs tpidr_el1, then kernel_task compared to it within 5 instructions
+                emit(OPCODE_MRS_X8_TPIDR_EL1);
+                load(10, kernelTask);
+                emit(encodeCmp(8, 10, true));
+                branch(encodeBcond(pc, epilogue, COND_NE), epilogue);
+                refer(0, str(kStrKernelTask));
+                k.kernelTask = kernelTask;
+                break;
+            case kFnTaskConversionEval:
+                //caller == kernel_task || caller == victim, inlined
+                emit(OPCODE_MRS_X8_TPIDR_EL1);
+                emit(encodeLdrImm(8, 8, 0x368));
+                emit(encodeLdrImm(21, 21, 0x68));
+                load(10, kernelTask);
+                emit(encodeCmp(8, 21, true));
+                k.taskConversionEval.push_back(pc);
+                emit(encodeCcmp(10, 8, 4, COND_NE));
+                branch(encodeBcond(pc, epilogue, COND_NE), epilogue);
+                break;
+            case kFnVMFault:
+                refer(0, str(kStrVMFault));
+                emit(OPCODE_AND_W10_W8_FF);
+                emit(OPCODE_CMP_W10_6);
+                k.vmFaultInternal.push_back(pc);
+                branch(encodeBcond(pc, epilogue, COND_NE), epilogue);
+                break;
+            case kFnTrustcache:
+                //movz, anything, madd, then 14 byte compares
+                k.trustcacheTrue.push_back(pc);
+                emit(OPCODE_MOVZ_W10_16);
+                emit(OPCODE_MOV_X11_X0);
+                emit(encodeMadd(12, 10, 11, 0));
+                for (uint32_t i=0; i<14; i++) {
+                    emit(encodeLdrbImm(13, 0, i));
+                    emit(encodeLdrbImm(14, 1, i));
+                    emit(encodeCmp(13, 14, false));
+                    branch(encodeBcond(pc, epilogue, COND_NE), epilogue);
+                    emit(encodeMadd(12, 12, 11, 0));
+                }
+                break;
+            case kFnMount:
+                call(gt.functions[kFnMountInternal].start);
+                break;
+            case kFnMountInternal:
+            {
+                //tbnz #5, ldrb, a branch to the orr #0x10000, then cmp before the string reference
+                loc_t tbnz = pc;
+                branch(encodeTbz(pc, epilogue, 8, 5, true), epilogue);
+                k.mount.push_back(pc);
+                k.mount.push_back(tbnz);
+                emit(encodeLdrbImm(8, 0, 0x71));
+                loc_t orr = pc + 3*4;
+                branch(encodeTbz(pc, orr, 8, 0, false), orr);
+                emit(OPCODE_FILLER);
+                emit(OPCODE_FILLER);
+                emit(OPCODE_ORR_W8_10000);
+                k.mount.push_back(pc);
+                emit(encodeCmp(8, 1, true));
+                branch(encodeBcond(pc, epilogue, COND_NE), epilogue);
+                refer(0, str(kStrMountAsRoot));
+                break;
+            }
+            case kFnAMFIExecve:
+                //the ret branches to the shellcode
+                refer(0, str(kStrAMFIExecve));
+                k.amfi.push_back(f.end - 4);
+                break;
+            case kFnAMFIHashType:
+                call(gt.functions[kFnKernelTask].start);
+                k.amfi.push_back(pc);
+                emit(encodeCmp(0, 1, false));
+                branch(encodeBcond(pc, epilogue, COND_EQ), epilogue);
+                refer(0, str(kStrAMFIHashType));
+                break;
+            case kFnGetTaskAllow:
+                //a single adrp before the ret
+                refer(0, str(kStrGetTaskAllow));
+                break;
+            case kFnGetTaskAllowCaller:
+                k.getTaskAllow.push_back(pc);
+                emit(OPCODE_MOV_X0_X20);
+                call(gt.functions[kFnGetTaskAllow].start);
+                break;
+            case kFnAllproc:
+                //allproc is in x8 two instructions before the and
+                refer(0, str(kStrPgrpAdd));
+                refer(8, allproc);
+                emit(encodeLdrImm(8, 8, 0));
+                emit(encodeLdrImm(8, 8, 8));
+                emit(OPCODE_AND_X8_NOT_2000);
+                k.allproc = allproc;
+                break;
+        }
+        assure(pc < epilogue);
+        while (pc < epilogue) emit(OPCODE_FILLER);
+        emit(OPCODE_EPILOGUE_LDP);
+        emit(OPCODE_RET);
+    }
+
+    const string &version = gt.strings[firstString + kStrVersion];
+    k.marijuanARM.push_back(version.loc + version.str.find("RELEASE_ARM"));
+    k.apfsSnapshot.push_back(str(kStrOSUpdate));
+}
+
+/*
+    mach trap table, sysent and the variables in __DATA.
+    Handlers other than mount are generic functions, so they need to be placed already
+ */
+static void writeKernelData(uint8_t *buf, const layout &l, groundtruth &gt){
+    uint8_t *data = &buf[l.dataOff];
+    loc_t dataBase = l.base + l.dataOff;
+    size_t genericCnt = gt.functions.size() - kKernelAnchorCnt;
+    auto handler = [&](size_t i) -> const function & {
+        return gt.functions[kKernelAnchorCnt + i % genericCnt];
+    };
+
+    //kern_invalid for all but 10 and 45, find_machtrap_table wants the first four entries to be the same
+    for (uint32_t t=0; t<KERNEL_MACHTRAP_CNT; t++) {
+        loc_t fn = handler(0).start;
+        if (t == 10) fn = handler(1).start;
+        if (t == 45) fn = handler(2).start;
+        memcpy(&data[t*KERNEL_MACHTRAP_SIZE], &fn, sizeof(fn));
+    }
+
+    for (uint32_t i=0; i<KERNEL_SYSENT_CNT; i++) {
+        uint8_t *e = &data[KERNEL_SYSENT_OFFSET + i*KERNEL_SYSENT_SIZE];
+        loc_t fn = handler(0).start;
+        if (i == 1) fn = handler(3).start;
+        if (i == 167) fn = gt.functions[kFnMount].start;
+        memcpy(e, &fn, sizeof(fn));
+        if (i == 3) {
+            memcpy(e + 0x10, KERNEL_SYSCALL_SIG, sizeof(KERNEL_SYSCALL_SIG)-1);
+        }else{
+            e[0x10] = 1; //int return, no arguments
+        }
+    }
+
+    kernelresults &k = gt.kernel;
+    k.machtrapTable = dataBase;
+    k.machtrap10 = handler(1).start;
+    k.syscall0 = dataBase + KERNEL_SYSENT_OFFSET + KERNEL_SYSENT_SIZE; //what find_syscall0 calls syscall 0 is sysent[1]
+    k.syscall1 = handler(3).start;
+    k.rootvnode = dataBase + KERNEL_VARS_OFFSET + 2*8;
+
+    //the first cbz of task_for_pid, generic functions only have the one before their epilogue
+    loc_t taskForPid = handler(2).start;
+    auto cbz = std::lower_bound(gt.branches.begin(), gt.branches.end(), taskForPid, [](const ref &r, loc_t pos){
+        return r.site < pos;
+    });
+    assure(cbz != gt.branches.end());
+    k.tfp0.push_back(cbz->site);
+}
+
+static void writeIBootHeader(uint8_t *buf, const params &p, loc_t base){
+    uint32_t magic = IBOOT_MAGIC;
+    memcpy(buf, &magic, sizeof(magic));
+    strncpy((char *)&buf[IBOOT_STAGE_STR_OFFSET], p.ibootStage.c_str(), IBOOT_MODE_STR_OFFSET - IBOOT_STAGE_STR_OFFSET - 1);
+    strncpy((char *)&buf[IBOOT_MODE_STR_OFFSET], "RELEASE", IBOOT_VERS_STR_OFFSET - IBOOT_MODE_STR_OFFSET - 1);
+    strncpy((char *)&buf[IBOOT_VERS_STR_OFFSET], p.ibootVersion.c_str(), IBOOT_BASE_OFFSET_IOS14 - IBOOT_VERS_STR_OFFSET - 1);
+    //iOS 14 and later finders read the base from 0x300, older ones from 0x318
+    memcpy(&buf[IBOOT_BASE_OFFSET_IOS14], &base, sizeof(base));
+    memcpy(&buf[IBOOT_BASE_OFFSET], &base, sizeof(base));
+}
+
+uint64_t synthimage::imageSize(const params &p){
+    return roundUp(std::max<uint64_t>(p.size, MIN_IMAGE_SIZE), SYNTH_PAGE_SIZE);
+}
+
+groundtruth synthimage::generate(const params &p, void *outBuf, size_t bufSize){
+    uint8_t *buf = (uint8_t *)outBuf;
+    retassure(p.type == kMachO || p.type == kIBoot, "unknown image kind %d", p.type);
+    retassure(p.stringDensity >= 0 && p.xrefDensity >= 0 && p.callDensity >= 0, "densities can't be negative");
+    retassure(p.type != kIBoot || !strncmp(p.ibootVersion.c_str(), "iBoot-", sizeof("iBoot-")-1), "iBoot version needs to look like iBoot-NNNN.x.y");
+
+    layout l = {};
+    l.size = imageSize(p);
+    retassure(bufSize >= l.size, "buffer of 0x%zx bytes is too small for a 0x%llx byte image", bufSize, l.size);
+    l.base = p.base ? p.base : (p.type == kMachO ? DEFAULT_MACHO_BASE : DEFAULT_IBOOT_BASE);
+    retassure(!(l.base & (SYNTH_PAGE_SIZE-1)), "base 0x%016llx is not page aligned", l.base);
+
+    groundtruth gt = {};
+    gt.type = p.type;
+    gt.size = l.size;
+    gt.seed = p.seed;
+    gt.base = l.base;
+
+    prng rng(p.seed);
+    uint64_t functionCnt = p.functionCnt ? p.functionCnt : std::max<uint64_t>(1, l.size / 0x800);
+    uint64_t stringCnt = (uint64_t)(functionCnt * p.stringDensity + 0.5);
+    uint64_t refCnt = stringCnt ? (uint64_t)(stringCnt * p.xrefDensity + 0.5) : 0;
+
+    std::vector<std::string> strs;
+    strs.reserve(stringCnt + 2);
+    for (uint64_t i=0; i<stringCnt; i++) {
+        strs.push_back(makeString(rng, i));
+    }
+    if (p.type == kIBoot) {
+        //last, so the adr to the chip id string from the first function is always in range
+        strs.push_back("platform-name");
+        strs.push_back("t" + std::to_string(p.chipid));
+        gt.chipid = p.chipid;
+    }else{
+        for (auto s : kKernelStrings) strs.push_back(s);
+    }
+
+    l.cstrOff = (p.type == kMachO) ? SYNTH_PAGE_SIZE : IBOOT_HEADER_SIZE;
+    for (auto &s : strs) l.cstrSize += s.size() + 1;
+    l.textOff = roundUp(l.cstrOff + l.cstrSize, SYNTH_PAGE_SIZE);
+    if (p.type == kMachO) {
+        l.dataOff = l.textOff;
+        l.textOff += KERNEL_DATA_SIZE;
+        //__LINKEDIT goes before the code, symtab offsets are 32 bit and the code may reach far beyond 4G
+        retassure(functionCnt <= UINT32_MAX - KERNEL_DATA_SYMBOL_CNT, "too many functions for a symtab");
+        l.strSize = 1;
+        for (uint64_t i=0; i<functionCnt; i++) l.strSize += symbolNameSize(i);
+        for (auto name : kKernelDataSymbols) l.strSize += strlen(name) + 1;
+        l.linkeditOff = l.textOff;
+        l.symOff = l.linkeditOff;
+        l.strOff = l.symOff + (functionCnt + KERNEL_DATA_SYMBOL_CNT)*sizeof(struct nlist_64);
+        retassure(l.strOff + l.strSize <= UINT32_MAX, "symtab has to be in the first 4G of the image");
+        l.textOff = roundUp(l.strOff + l.strSize, SYNTH_PAGE_SIZE);
+    }
+    l.textEnd = l.size;
+    retassure(l.textOff < l.textEnd, "image too small for %llu strings and %llu symbols", stringCnt, functionCnt);
+
+    uint64_t textWords = (l.textEnd - l.textOff) / 4;
+    uint64_t caveWords = (uint64_t)p.caveCnt * p.caveNops;
+    retassure(caveWords < textWords, "image too small for %u caves of %u nops", p.caveCnt, p.caveNops);
+    uint64_t anchorCnt = (p.type == kMachO) ? kKernelAnchorCnt : 0;
+    retassure(caveWords + anchorCnt*KERNEL_ANCHOR_WORDS < textWords, "image too small for the kernel anchors");
+    uint64_t funcWords = textWords - caveWords - anchorCnt*KERNEL_ANCHOR_WORDS;
+    uint64_t refsPerFunction = (refCnt + functionCnt - 1) / functionCnt;
+    uint64_t minWords = 5 + 2*refsPerFunction + 1 + (p.type == kIBoot ? 3 : 0); //frame, cbz, refs, bl, platform-name
+    retassure(funcWords / functionCnt >= minWords, "image too small for %llu functions with %llu references each", functionCnt, refsPerFunction);
+
+    //place functions and caves first, calls need to know where their targets are
+    gt.functions.reserve(anchorCnt + functionCnt);
+    gt.caves.reserve(p.caveCnt);
+    loc_t cursor = l.base + l.textOff;
+    for (uint64_t i=0; i<anchorCnt; i++) {
+        gt.functions.push_back({cursor, cursor + KERNEL_ANCHOR_WORDS*4});
+        cursor += KERNEL_ANCHOR_WORDS*4;
+    }
+    uint32_t nextCave = 0;
+    for (uint64_t i=0; i<functionCnt; i++) {
+        while (nextCave < p.caveCnt && (nextCave+1) * functionCnt / ((uint64_t)p.caveCnt+1) == i) {
+            if (p.caveNops) gt.caves.push_back({cursor, p.caveNops});
+            cursor += p.caveNops * 4;
+            nextCave++;
+        }
+        uint64_t words = (i+1) * funcWords / functionCnt - i * funcWords / functionCnt;
+        gt.functions.push_back({cursor, cursor + words*4});
+        cursor += words*4;
+    }
+
+    memset(buf, 0, l.size);
+    uint32_t *code = (uint32_t *)buf;
+    auto word = [&](loc_t loc) -> uint32_t &{
+        return code[(loc - l.base) / 4];
+    };
+
+    gt.strings.reserve(strs.size());
+    uint64_t strOff = l.cstrOff;
+    for (auto &s : strs) {
+        memcpy(&buf[strOff], s.c_str(), s.size() + 1);
+        gt.strings.push_back({l.base + strOff, std::move(s)});
+        strOff += gt.strings.back().str.size() + 1;
+    }
+
+    for (auto &c : gt.caves) {
+        for (size_t i=0; i<c.nops; i++) word(c.loc + i*4) = OPCODE_NOP;
+    }
+
+    if (p.type == kMachO) {
+        writeKernelAnchors(buf, l, gt, stringCnt);
+    }
+
+    //calls stay well inside the bl range, caves between the functions only make the distance a bit larger
+    uint64_t avgFunctionSize = std::max<uint64_t>(4, funcWords * 4 / functionCnt);
+    uint64_t callWindow = std::max<uint64_t>(1, (BL_RANGE / 2) / avgFunctionSize);
+
+    gt.xrefs.reserve(refCnt + (p.type == kIBoot ? 2 : 0));
+    gt.branches.reserve(functionCnt);
+    uint64_t r = 0;
+    for (uint64_t i=0; i<functionCnt; i++) {
+        const function &f = gt.functions[anchorCnt + i];
+        loc_t pc = f.start;
+        auto emit = [&](uint32_t insn) {
+            word(pc) = insn;
+            pc += 4;
+        };
+
+        emit(OPCODE_PROLOGUE_STP);
+        emit(OPCODE_PROLOGUE_MOV);
+
+        if (p.type == kIBoot && i == 0) {
+            //what the ibootpatchfinder64 constructor looks for to get the chip id
+            const string &platformName = gt.strings[gt.strings.size()-2];
+            const string &chipid = gt.strings.back();
+            retassure(inRange(pc + 8, chipid.loc, ADR_RANGE), "chip id string is out of adr range");
+            emit(encodeAdrp(pc, platformName.loc, 0));
+            gt.xrefs.push_back({platformName.loc, pc});
+            emit(encodeAddImm(0, 0, platformName.loc & 0xfff));
+            gt.xrefs.push_back({chipid.loc, pc});
+            emit(encodeAdr(pc, chipid.loc, 1));
+        }
+
+        for (; r < refCnt && r * functionCnt / refCnt == i; r++) {
+            const string &s = gt.strings[r % stringCnt];
+            if (!inRange(pc, s.loc, ADRP_RANGE - SYNTH_PAGE_SIZE)) continue;
+            int rd = (int)(r % 8);
+            emit(encodeAdrp(pc, s.loc, rd));
+            gt.xrefs.push_back({s.loc, pc});
+            emit(encodeAddImm(rd, rd, s.loc & 0xfff));
+        }
+
+        if (functionCnt > 1 && rng.chance(p.callDensity)) {
+            int64_t delta = (int64_t)rng.below(2*callWindow + 1) - (int64_t)callWindow;
+            int64_t j = std::min<int64_t>(std::max<int64_t>((int64_t)i + delta, 0), (int64_t)functionCnt - 1);
+            if (j == (int64_t)i) j = (i+1 < functionCnt) ? i+1 : i-1;
+            loc_t target = gt.functions[anchorCnt + j].start;
+            if (inRange(pc, target, BL_RANGE)) {
+                gt.calls.push_back({target, pc});
+                emit(encodeBl(pc, target));
+            }
+        }
+
+        loc_t epilogue = f.end - 8;
+        assure(inRange(pc, epilogue, CBZ_RANGE));
+        gt.branches.push_back({epilogue, pc});
+        emit(encodeCbz(pc, epilogue, 0));
+
+        while (pc < epilogue) emit(OPCODE_FILLER);
+        emit(OPCODE_EPILOGUE_LDP);
+        emit(OPCODE_RET);
+    }
+
+    if (p.type == kMachO) {
+        gt.entry = gt.functions.front().start;
+        writeMachOHeaders(buf, l, (uint32_t)(functionCnt + KERNEL_DATA_SYMBOL_CNT), gt.entry);
+        writeKernelData(buf, l, gt);
+
+        struct nlist_64 *syms = (struct nlist_64 *)&buf[l.symOff];
+        char *strtab = (char *)&buf[l.strOff];
+        uint32_t strx = 1;
+        for (uint64_t i=0; i<functionCnt; i++) {
+            syms[i].n_un.n_strx = strx;
+            syms[i].n_type = N_SECT | N_EXT;
+            syms[i].n_sect = 3;
+            syms[i].n_value = gt.functions[anchorCnt + i].start;
+            strx += snprintf(&strtab[strx], symbolNameSize(i), FUNCTION_SYMBOL_PREFIX "%llu", (unsigned long long)i) + 1;
+        }
+        for (size_t i=0; i<KERNEL_DATA_SYMBOL_CNT; i++) {
+            struct nlist_64 &sym = syms[functionCnt + i];
+            sym.n_un.n_strx = strx;
+            sym.n_type = N_SECT | N_EXT;
+            sym.n_sect = 2;
+            sym.n_value = l.base + l.dataOff + KERNEL_VARS_OFFSET + i*8;
+            strx += strlen(strcpy(&strtab[strx], kKernelDataSymbols[i])) + 1;
+        }
+    }else{
+        gt.entry = l.base;
+        writeIBootHeader(buf, p, l.base);
+    }
+    return gt;
+}
+
+groundtruth synthimage::generate_file(const params &p, const char *path){
+    uint64_t size = imageSize(p);
+    std::string tmp = std::string(path) + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    int fd = -1;
+    uint8_t *map = NULL;
+    bool done = false;
+    cleanup([&]{
+        if (map) munmap(map, size);
+        if (fd >= 0) close(fd);
+        if (!done) unlink(tmp.c_str());
+    })
+
+    retassure((fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) != -1, "failed to create %s errno=%d", tmp.c_str(), errno);
+    retassure(!ftruncate(fd, (off_t)size), "failed to grow %s to 0x%llx bytes errno=%d", tmp.c_str(), size, errno);
+    void *shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    retassure(shared != MAP_FAILED, "failed to map %s errno=%d", tmp.c_str(), errno);
+    map = (uint8_t *)shared;
+
+    groundtruth gt = generate(p, map, size);
+    retassure(!msync(map, size, MS_SYNC), "failed to sync %s errno=%d", tmp.c_str(), errno);
+    retassure(!rename(tmp.c_str(), path), "failed to rename %s to %s errno=%d", tmp.c_str(), path, errno);
+    done = true;
+    return gt;
+}
+
+static void writeJSONString(FILE *f, const std::string &s){
+    fputc('"', f);
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void writeRefs(FILE *f, const char *name, const std::vector<ref> &refs){
+    fprintf(f, ",\n  \"%s\": [", name);
+    for (size_t i=0; i<refs.size(); i++) {
+        fprintf(f, "%s\n    {\"target\": \"0x%016llx\", \"site\": \"0x%016llx\"}", i ? "," : "", refs[i].target, refs[i].site);
+    }
+    fprintf(f, "\n  ]");
+}
+
+static void writeLocs(FILE *f, const char *name, const std::vector<loc_t> &locs){
+    fprintf(f, ",\n    \"%s\": [", name);
+    for (size_t i=0; i<locs.size(); i++) {
+        fprintf(f, "%s\"0x%016llx\"", i ? ", " : "", locs[i]);
+    }
+    fputc(']', f);
+}
+
+static void writeKernelResults(FILE *f, const kernelresults &k){
+    fprintf(f, ",\n  \"kernel\": {\n    \"syscall0\": \"0x%016llx\",\n    \"machtrap_table\": \"0x%016llx\",\n    \"kernel_task\": \"0x%016llx\""
+            ",\n    \"rootvnode\": \"0x%016llx\",\n    \"allproc\": \"0x%016llx\",\n    \"syscall1\": \"0x%016llx\",\n    \"machtrap10\": \"0x%016llx\"",
+            k.syscall0, k.machtrapTable, k.kernelTask, k.rootvnode, k.allproc, k.syscall1, k.machtrap10);
+    writeLocs(f, "MarijuanARM", k.marijuanARM);
+    writeLocs(f, "task_conversion_eval", k.taskConversionEval);
+    writeLocs(f, "vm_fault_internal", k.vmFaultInternal);
+    writeLocs(f, "trustcache_true", k.trustcacheTrue);
+    writeLocs(f, "mount", k.mount);
+    writeLocs(f, "tfp0", k.tfp0);
+    writeLocs(f, "amfi", k.amfi);
+    writeLocs(f, "get_task_allow", k.getTaskAllow);
+    writeLocs(f, "apfs_snapshot", k.apfsSnapshot);
+    fprintf(f, "\n  }");
+}
+
+void synthimage::write_groundtruth(const groundtruth &gt, FILE *f){
+    fprintf(f, "{\n  \"kind\": \"%s\",\n  \"size\": %llu,\n  \"seed\": %llu,\n  \"base\": \"0x%016llx\",\n  \"entry\": \"0x%016llx\"",
+            gt.type == kMachO ? "macho" : "iboot", (unsigned long long)gt.size, (unsigned long long)gt.seed, gt.base, gt.entry);
+    if (gt.type == kIBoot) fprintf(f, ",\n  \"chipid\": %u", gt.chipid);
+    if (gt.type == kMachO) writeKernelResults(f, gt.kernel);
+
+    fprintf(f, ",\n  \"functions\": [");
+    for (size_t i=0; i<gt.functions.size(); i++) {
+        fprintf(f, "%s\n    {\"start\": \"0x%016llx\", \"end\": \"0x%016llx\"}", i ? "," : "", gt.functions[i].start, gt.functions[i].end);
+    }
+    fprintf(f, "\n  ],\n  \"strings\": [");
+    for (size_t i=0; i<gt.strings.size(); i++) {
+        fprintf(f, "%s\n    {\"loc\": \"0x%016llx\", \"str\": ", i ? "," : "", gt.strings[i].loc);
+        writeJSONString(f, gt.strings[i].str);
+        fputc('}', f);
+    }
+    fprintf(f, "\n  ]");
+    writeRefs(f, "xrefs", gt.xrefs);
+    writeRefs(f, "calls", gt.calls);
+    writeRefs(f, "branches", gt.branches);
+    fprintf(f, ",\n  \"caves\": [");
+    for (size_t i=0; i<gt.caves.size(); i++) {
+        fprintf(f, "%s\n    {\"loc\": \"0x%016llx\", \"nops\": %zu}", i ? "," : "", gt.caves[i].loc, gt.caves[i].nops);
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
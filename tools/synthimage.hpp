@@ -0,0 +1,148 @@
+//
+//  synthimage.hpp
+//  liboffsetfinder64
+//
+
+#ifndef synthimage_hpp
+#define synthimage_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <liboffsetfinder64/common.h>
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Synthetic ARM64 images for tests and benchmarks, so nothing from Apple has to be shipped.
+            Mach-O output is a kernel shaped MH_EXECUTE with __TEXT (__cstring), __DATA (__data), __LINKEDIT and __TEXT_EXEC (__text)
+            segments, LC_SYMTAB and LC_UNIXTHREAD, and loads with kernelpatchfinder64.
+            __LINKEDIT comes before the code so the 32 bit symtab offsets still work for multi GB images.
+            It also has what every kernelpatchfinder64 finder looks for: the strings, a function per finder at the start
+            of __text, and mach trap table, sysent and kernel_task/allproc/_rootvnode in __DATA. What they should find
+            is in groundtruth::kernel.
+            iBoot output has the 0x90000000 magic, stage/mode/version strings at 0x200/0x240/0x280, the base at 0x300 and 0x318
+            and a "platform-name" reference followed by an adr to the chip id string, as ibootpatchfinder64 expects.
+
+            The code is made of functions which look like
+                stp x29, x30, [sp, #-0x10]!
+                mov x29, sp
+                adrp xN, str@PAGE ; add xN, xN, str@PAGEOFF     (the planted string references)
+                bl callee                                       (some functions)
+                cbz x0, epilogue
+                add x9, x9, #1 ...                              (filler up to the function size)
+                ldp x29, x30, [sp], #0x10
+                ret
+            with runs of nops between some of them. Everything planted is recorded in the groundtruth.
+            The same params and seed always give the same image.
+         */
+        namespace synthimage {
+            enum kind{
+                kMachO,
+                kIBoot
+            };
+
+            struct params{
+                kind type = kMachO;
+                uint64_t size = 0x1000000;      //rounded up to 16K pages
+                uint32_t functionCnt = 0;       //0 means one function per 2K of image
+                double stringDensity = 0.5;     //strings per function
+                double xrefDensity = 1.0;       //references per string
+                double callDensity = 0.5;       //share of functions which call another one
+                uint32_t caveCnt = 16;
+                uint32_t caveNops = 32;
+                uint64_t seed = 0;
+                uint64_t base = 0;              //0 picks one for the kind
+                std::string ibootVersion = "iBoot-7429.12.15";
+                std::string ibootStage = "iBEC";
+                uint32_t chipid = 8030;
+            };
+
+            struct ref{
+                loc_t target;
+                loc_t site;     //the add of adrp+add, the bl or the cbz. What find_*_ref return
+            };
+
+            struct function{
+                loc_t start;
+                loc_t end;      //exclusive, the ret is at end-4
+            };
+
+            struct string{
+                loc_t loc;
+                std::string str;
+            };
+
+            struct cave{
+                loc_t loc;
+                size_t nops;
+            };
+
+            /*
+                expected kernelpatchfinder64 results, patches by their locations.
+                amfi leaves out the shellcode, which goes to whatever cave is free
+             */
+            struct kernelresults{
+                loc_t syscall0;
+                loc_t machtrapTable;
+                loc_t kernelTask;
+                loc_t rootvnode;
+                loc_t allproc;
+                loc_t syscall1;         //find_function_for_syscall(1)
+                loc_t machtrap10;       //find_function_for_machtrap(10)
+                std::vector<loc_t> marijuanARM;
+                std::vector<loc_t> taskConversionEval;
+                std::vector<loc_t> vmFaultInternal;
+                std::vector<loc_t> trustcacheTrue;
+                std::vector<loc_t> mount;
+                std::vector<loc_t> tfp0;
+                std::vector<loc_t> amfi;
+                std::vector<loc_t> getTaskAllow;
+                std::vector<loc_t> apfsSnapshot;
+            };
+
+            struct groundtruth{
+                kind type;
+                uint64_t size;
+                uint64_t seed;
+                loc_t base;
+                loc_t entry;
+                uint32_t chipid;                //iBoot only
+                kernelresults kernel;           //Mach-O only
+                std::vector<function> functions;
+                std::vector<string> strings;
+                std::vector<ref> xrefs;         //sorted by site
+                std::vector<ref> calls;         //sorted by site
+                std::vector<ref> branches;      //sorted by site, every branch except bl
+                std::vector<cave> caves;
+            };
+
+            /*
+                bytes generate() needs for p
+             */
+            uint64_t imageSize(const params &p);
+
+            /*
+                fills buf (at least imageSize(p) bytes) with the image.
+                References which can't be encoded (adrp beyond +-4G, bl beyond +-128M) are left out of image and groundtruth
+             */
+            groundtruth generate(const params &p, void *buf, size_t bufSize);
+
+            /*
+                writes the image through a shared mapping of a temporary file next to path and renames it,
+                so multi GB images never need to fit in memory
+             */
+            groundtruth generate_file(const params &p, const char *path);
+
+            /*
+                groundtruth as JSON. Addresses are hex strings, they don't fit in a double
+             */
+            void write_groundtruth(const groundtruth &gt, FILE *f);
+        };
+    };
+};
+
+#endif /* synthimage_hpp */
@@ -0,0 +1,86 @@
+//
+//  toolutil.cpp
+//  liboffsetfinder64
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libgeneral/macros.h>
+
+#include "toolutil.hpp"
+
+using namespace tihmstar;
+using namespace offsetfinder64;
+using namespace toolutil;
+
+#define SNIFF_SIZE                  0x300
+#define DER_SEQUENCE                0x30        //IMG4 and IM4P containers, unwrapped by kernelpatchfinder64
+
+imagekind toolutil::sniff(const char *path){
+    uint8_t buf[SNIFF_SIZE] = {};
+    FILE *f = fopen(path, "rb");
+    retassure(f, "failed to open %s", path);
+    size_t didRead = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    if (didRead < sizeof(uint32_t)) return kUnknown;
+    uint32_t magic = *(uint32_t*)buf;
+    if (magic == 0xfeedfacf || magic == 0xcafebabe || magic == 0xbebafeca) return kKernel;
+    if (buf[0] == DER_SEQUENCE) return kKernel;
+    if (didRead == sizeof(buf) && magic == IBOOT_MAGIC && !strncmp((char*)&buf[IBOOT_VERS_STR_OFFSET], "iBoot", sizeof("iBoot")-1)) return kIBoot;
+    return kUnknown;
+}
+
+std::string toolutil::jsonString(const std::string &str){
+    std::string ret = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if ((unsigned char)c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            ret += esc;
+        } else {
+            ret += c;
+        }
+    }
+    return ret + "\"";
+}
+
+std::string toolutil::jsonLoc(loc_t loc){
+    char buf[0x20];
+    snprintf(buf, sizeof(buf), "\"0x%016llx\"", (unsigned long long)loc);
+    return buf;
+}
+
+std::string toolutil::jsonPatches(const std::vector<patch> &patches){
+    static const char hex[] = "0123456789abcdef";
+    std::string ret = "[";
+    for (size_t i=0; i<patches.size(); i++) {
+        auto &p = patches[i];
+        ret += i ? ", {\"location\": " : "{\"location\": ";
+        ret += jsonLoc(p._location);
+        ret += ", \"bytes\": \"";
+        for (size_t z=0; z<p._patchSize; z++) {
+            uint8_t b = ((const uint8_t*)p._patch)[z];
+            ret += hex[b >> 4];
+            ret += hex[b & 0xf];
+        }
+        ret += "\"}";
+    }
+    return ret + "]";
+}
+
+uint64_t toolutil::parseSize(const char *str){
+    char *end = NULL;
+    uint64_t ret = strtoull(str, &end, 0);
+    switch (end ? *end : '\0') {
+        case 'g': case 'G': ret <<= 10; [[fallthrough]];
+        case 'm': case 'M': ret <<= 10; [[fallthrough]];
+        case 'k': case 'K': ret <<= 10; break;
+        default: break;
+    }
+    return ret;
+}
@@ -0,0 +1,66 @@
+//
+//  toolutil.hpp
+//  liboffsetfinder64
+//
+
+#ifndef toolutil_hpp
+#define toolutil_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <liboffsetfinder64/common.h>
+#include <liboffsetfinder64/patch.hpp>
+
+#define IBOOT_MAGIC                 0x90000000
+#define IBOOT_STAGE_STR_OFFSET      0x200
+#define IBOOT_MODE_STR_OFFSET       0x240
+#define IBOOT_VERS_STR_OFFSET       0x280
+#define IBOOT_BASE_OFFSET_IOS14     0x300
+#define IBOOT_BASE_OFFSET           0x318
+#define IBOOT_HEADER_SIZE           0x400
+
+namespace tihmstar {
+    namespace offsetfinder64 {
+        /*
+            Helpers the command line tools share, so the daemon, batch runner, bench and synth
+            agree on image kinds, JSON encoding and size arguments.
+         */
+        namespace toolutil {
+            enum imagekind{
+                kUnknown,
+                kKernel,
+                kIBoot
+            };
+
+            /*
+                kKernel for Mach-O, fat and IMG4/IM4P wrapped images, kIBoot for raw iBoots, kUnknown otherwise.
+                Throws if path can't be opened
+             */
+            imagekind sniff(const char *path);
+
+            /*
+                quoted and escaped
+             */
+            std::string jsonString(const std::string &str);
+
+            /*
+                quoted hex string, addresses don't fit in a double
+             */
+            std::string jsonLoc(loc_t loc);
+
+            /*
+                [{"location": "0x...", "bytes": "hex"}, ...]
+             */
+            std::string jsonPatches(const std::vector<patch> &patches);
+
+            /*
+                strtoull with an optional k/m/g suffix
+             */
+            uint64_t parseSize(const char *str);
+        };
+    };
+};
+
+#endif /* toolutil_hpp */